@@ -0,0 +1,302 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Benchmark_h
+#define Benchmark_h
+
+#include "Common.h"
+#include "CorpusGenerator.h"
+#include "MappedSequenceFile.h"
+#include "Pipeline.h"
+#include "PwmConverter.h"
+#include "PwmConverterWithWeights.h"
+#include "PwmPfmConverter.h"
+#include "TsvWriter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct BenchmarkOptions {
+    CorpusOptions corpus;
+    unsigned iterations{5};
+    unsigned threads{1};
+    Format output_format{Format::DNA};
+    // Corpora and outputs go here
+    std::string directory;
+};
+
+//
+// Timings of one converter on one corpus. Every stage is run 'iterations'
+// times:
+//
+//    read        records are read from the (mapped) corpus file
+//    parse       matrix text -> numbers (matrix converters only)
+//    convert     the converter call on every record, matrix parsing included
+//    write       the converted records are written to a .tsv file
+//    end_to_end  file -> .tsv the way a regular run does it
+//
+struct BenchmarkResult {
+    static constexpr const char *kStages[] = {"read", "parse", "convert", "write", "end_to_end"};
+    static constexpr size_t kStageCount = 5;
+
+    std::string converter;
+    std::string corpus;
+    uint64_t records{0};
+    uint64_t input_bytes{0};
+    uint64_t output_bytes{0};
+    bool has_parse{false};
+    std::vector<double> seconds[kStageCount];
+
+    double Min(size_t stage) const
+    {
+        return *std::min_element(seconds[stage].begin(), seconds[stage].end());
+    }
+
+    double Median(size_t stage) const
+    {
+        std::vector<double> sorted = seconds[stage];
+        std::sort(sorted.begin(), sorted.end());
+        size_t middle = sorted.size() / 2;
+        return (sorted.size() % 2) ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+    }
+};
+
+class Benchmark {
+ public:
+    explicit Benchmark(const BenchmarkOptions& options) : options_(options)
+    {
+        if (options_.iterations == 0)
+            options_.iterations = 1;
+        if (!options_.directory.empty() && options_.directory.back() != '/')
+            options_.directory += '/';
+    }
+
+    std::vector<BenchmarkResult> Run()
+    {
+        CorpusGenerator generator(options_.corpus);
+        std::string iupac_path = options_.directory + "corpus-iupac.fasta";
+        std::string weights_path = options_.directory + "corpus-weights.fasta";
+        std::string pfm_path = options_.directory + "corpus-jaspar.pfm";
+        generator.WriteIupac(iupac_path);
+        generator.WriteWeights(weights_path);
+        generator.WritePfm(pfm_path);
+
+        std::vector<BenchmarkResult> results;
+        results.push_back(Measure("PwmConverterRandom", "iupac", iupac_path, false));
+        results.push_back(Measure("PwmConverterWithWeights", "weights", weights_path, true));
+        results.push_back(Measure("PwmPfmConverter", "jaspar_pfm", pfm_path, true));
+        return results;
+    }
+
+    void WriteJson(const std::vector<BenchmarkResult>& results, FILE *out) const
+    {
+        char timestamp[32];
+        time_t now = time(nullptr);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        fprintf(out, "{\n");
+        fprintf(out, "  \"schema\": 1,\n");
+        fprintf(out, "  \"timestamp\": \"%s\",\n", timestamp);
+        fprintf(out, "  \"compiler\": \"%s\",\n", Escape(CompilerVersion()).c_str());
+        fprintf(out, "  \"build_date\": \"%s\",\n", __DATE__);
+        fprintf(out, "  \"threads\": %u,\n", options_.threads);
+        fprintf(out, "  \"iterations\": %u,\n", options_.iterations);
+        fprintf(out, "  \"corpus\": {\"records\": %llu, \"length\": %zu, \"degeneracy\": %g, \"seed\": %llu},\n",
+                static_cast<unsigned long long>(options_.corpus.records), options_.corpus.length,
+                options_.corpus.degeneracy, static_cast<unsigned long long>(options_.corpus.seed));
+        fprintf(out, "  \"results\": [\n");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& result = results[i];
+            double end_to_end = result.Min(4);
+
+            fprintf(out, "    {\n");
+            fprintf(out, "      \"converter\": \"%s\",\n", result.converter.c_str());
+            fprintf(out, "      \"corpus\": \"%s\",\n", result.corpus.c_str());
+            fprintf(out, "      \"records\": %llu,\n", static_cast<unsigned long long>(result.records));
+            fprintf(out, "      \"input_bytes\": %llu,\n", static_cast<unsigned long long>(result.input_bytes));
+            fprintf(out, "      \"output_bytes\": %llu,\n", static_cast<unsigned long long>(result.output_bytes));
+            fprintf(out, "      \"records_per_s\": %.1f,\n", end_to_end > 0 ? result.records / end_to_end : 0.0);
+            fprintf(out, "      \"input_mb_per_s\": %.3f,\n", end_to_end > 0 ? result.input_bytes / end_to_end / 1e6 : 0.0);
+            fprintf(out, "      \"stages\": {\n");
+            for (size_t stage = 0; stage < BenchmarkResult::kStageCount; ++stage) {
+                const char *separator = (stage + 1 < BenchmarkResult::kStageCount) ? "," : "";
+                if (stage == 1 && !result.has_parse) {
+                    fprintf(out, "        \"%s\": null%s\n", BenchmarkResult::kStages[stage], separator);
+                    continue;
+                }
+                fprintf(out, "        \"%s\": {\"min_s\": %.6f, \"median_s\": %.6f}%s\n",
+                        BenchmarkResult::kStages[stage], result.Min(stage), result.Median(stage), separator);
+            }
+            fprintf(out, "      }\n");
+            fprintf(out, "    }%s\n", (i + 1 < results.size()) ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+
+    // One line per converter, for people rather than scripts
+    static void PrintSummary(const std::vector<BenchmarkResult>& results, FILE *out)
+    {
+        fprintf(out, "%-24s %10s %10s %10s %10s %12s %10s\n",
+                "converter", "read ms", "parse ms", "convert ms", "write ms", "end2end ms", "MB/s");
+        for (const auto& result : results) {
+            double end_to_end = result.Min(4);
+            fprintf(out, "%-24s %10.2f ", result.converter.c_str(), result.Min(0) * 1e3);
+            if (result.has_parse)
+                fprintf(out, "%10.2f ", result.Min(1) * 1e3);
+            else
+                fprintf(out, "%10s ", "-");
+            fprintf(out, "%10.2f %10.2f %12.2f %10.1f\n", result.Min(2) * 1e3, result.Min(3) * 1e3,
+                    end_to_end * 1e3, end_to_end > 0 ? result.input_bytes / end_to_end / 1e6 : 0.0);
+        }
+    }
+
+ private:
+    using Clock = std::chrono::steady_clock;
+
+    BenchmarkOptions options_;
+
+    static double Since(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    static std::string CompilerVersion()
+    {
+#ifdef __VERSION__
+        return __VERSION__;
+#else
+        return "unknown";
+#endif
+    }
+
+    static std::string Escape(const std::string& text)
+    {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    ConverterSet MakeConverters(bool matrix) const
+    {
+        return MakeConverterSet(options_.output_format, matrix, options_.corpus.seed);
+    }
+
+    std::unique_ptr<RecordReader> OpenCorpus(const std::string& path, bool matrix) const
+    {
+        std::string error;
+        auto reader = RecordReader::Open(path, matrix, error);
+        if (!reader)
+            throw std::runtime_error(error);
+        if (!reader->mapped())
+            throw std::runtime_error("Couldn't map the corpus file '" + path + "'");
+        return reader;
+    }
+
+    BenchmarkResult Measure(const std::string& converter, const std::string& corpus,
+                            const std::string& path, bool matrix)
+    {
+        BenchmarkResult result;
+        result.converter = converter;
+        result.corpus = corpus;
+        result.has_parse = matrix;
+
+        int64_t mtime_ns = 0;
+        GetFileStamp(path, mtime_ns, result.input_bytes);
+
+        std::string output_path = options_.directory + "corpus-" + corpus + "-bases.tsv";
+        ConverterSet converters = MakeConverters(matrix);
+
+        for (unsigned iteration = 0; iteration < options_.iterations; ++iteration) {
+            // read
+            auto start = Clock::now();
+            auto reader = OpenCorpus(path, matrix);
+            bool pfm = reader->pfm();
+            std::vector<RecordView> records;
+            RecordView record;
+            while (reader->Next(record))
+                records.push_back(record);
+            result.seconds[0].push_back(Since(start));
+            result.records = records.size();
+
+            // parse
+            if (matrix) {
+                start = Clock::now();
+                for (const auto& view : records)
+                    converters.For(pfm).ParseColumns(view.seq, converters.columns);
+                result.seconds[1].push_back(Since(start));
+            }
+
+            // convert
+            std::string bases;
+            std::vector<size_t> ends;
+            ends.reserve(records.size());
+            start = Clock::now();
+            for (size_t i = 0; i < records.size(); ++i) {
+                ConvertBases(converters, pfm, records[i], 0, i);
+                bases += converters.bases;
+                ends.push_back(bases.size());
+            }
+            result.seconds[2].push_back(Since(start));
+
+            // write
+            start = Clock::now();
+            auto writer = OpenOutput(output_path);
+            for (size_t i = 0; i < records.size(); ++i) {
+                size_t begin = i ? ends[i - 1] : 0;
+                writer->WriteRecord(records[i], std::string_view(bases).substr(begin, ends[i] - begin));
+            }
+            writer->Close();
+            result.seconds[3].push_back(Since(start));
+
+            // end to end
+            start = Clock::now();
+            std::vector<std::unique_ptr<RecordReader>> inputs;
+            inputs.emplace_back(OpenCorpus(path, matrix));
+            writer = OpenOutput(output_path);
+            if (options_.threads > 1) {
+                ConversionPipeline pipeline(options_.threads, [this, matrix] { return MakeConverters(matrix); });
+                pipeline.Run(inputs, *writer);
+            } else {
+                ConvertRecords(converters, *inputs[0], *writer);
+            }
+            writer->Close();
+            result.seconds[4].push_back(Since(start));
+        }
+
+        GetFileStamp(output_path, mtime_ns, result.output_bytes);
+        return result;
+    }
+
+    static std::unique_ptr<TsvWriter> OpenOutput(const std::string& path)
+    {
+        auto writer = TsvWriter::Open(path);
+        if (!writer)
+            throw std::runtime_error("Couldn't open the output file '" + path + "'");
+        return writer;
+    }
+};
+
+#endif /* Benchmark_h */
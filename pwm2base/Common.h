@@ -17,10 +17,17 @@
 #ifndef Utils_h
 #define Utils_h
 
+#include <cstdint>
+
+//
+// 'Packed' output carries base codes (0-3, see BaseToNumber()) instead of
+// letters; '--output-format packed' packs them four to a byte.
+//
 enum class Format {
     PWM,
     RNA,
-    DNA
+    DNA,
+    Packed
 };
 
 
@@ -56,4 +63,31 @@ char NumberToBase(uint8_t index, Format output_format = Format::DNA)
     }
 }
 
+//
+// The output bases of a format, indexed by BaseToNumber(). Converters are
+// templates on the output format and look their bases up here, so their
+// loops don't test the format.
+//
+template<Format Format_>
+struct OutputBases {
+    static constexpr char kBases[5] = {
+        (Format_ == Format::Packed) ? '\0' : 'A',
+        (Format_ == Format::Packed) ? '\1' : 'C',
+        (Format_ == Format::Packed) ? '\2' : 'G',
+        (Format_ == Format::Packed) ? '\3' : (Format_ == Format::DNA) ? 'T' : 'U',
+        '\0'
+    };
+};
+
+// OutputBases<>::kBases of a format known at run time
+constexpr
+const char *OutputBasesFor(Format output_format)
+{
+    switch (output_format) {
+        case Format::DNA: return OutputBases<Format::DNA>::kBases;
+        case Format::Packed: return OutputBases<Format::Packed>::kBases;
+        default: return OutputBases<Format::RNA>::kBases;
+    }
+}
+
 #endif /* Utils_h */
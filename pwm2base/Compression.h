@@ -0,0 +1,575 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Compression_h
+#define Compression_h
+
+#include <zlib.h>
+#ifdef PWM2BASE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//
+// gzip and zstd support for inputs and outputs. zstd needs libzstd and is only
+// compiled in with PWM2BASE_ZSTD defined.
+//
+enum class Compression {
+    None,
+    Gzip,
+    Zstd
+};
+
+inline const char *CompressionExtension(Compression compression)
+{
+    switch (compression) {
+        case Compression::Gzip: return "gz";
+        case Compression::Zstd: return "zst";
+        default: return "";
+    }
+}
+
+// 'motifs.pfm.gz' -> 'motifs.pfm'
+inline std::string WithoutCompressionExtension(const std::string& path)
+{
+    for (const char *suffix : {".gz", ".zst"}) {
+        size_t size = strlen(suffix);
+        if (path.size() > size && path.compare(path.size() - size, size, suffix) == 0)
+            return path.substr(0, path.size() - size);
+    }
+    return path;
+}
+
+// Compression by the first 'size' (up to 4) bytes of a file
+inline Compression CompressionOfMagic(const unsigned char *magic, size_t size)
+{
+    if (size >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+        return Compression::Gzip;
+    if (size == 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+        return Compression::Zstd;
+    return Compression::None;
+}
+
+// Compression of a file by its magic number
+inline Compression DetectCompression(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return Compression::None;
+    unsigned char magic[4] = {};
+    ssize_t size = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    return CompressionOfMagic(magic, size > 0 ? static_cast<size_t>(size) : 0);
+}
+
+//
+// Streaming decompression of a whole file. Multi-member gzip files (BGZF
+// among them) and multi-frame zstd files are read to the end.
+//
+class Decompressor {
+ public:
+    static constexpr size_t kInputSize = size_t{1} << 18;
+
+    // Returns nullptr and sets 'error' if the file can't be read
+    static std::unique_ptr<Decompressor> Open(const std::string& path, Compression compression, std::string& error);
+
+    //
+    // Reader of an open stream that can't be seeked (stdin): the compression
+    // is told by its first bytes, which are kept for the decompressor. An
+    // uncompressed stream is passed through. Takes ownership of 'fd'; 'name'
+    // is used in error messages.
+    //
+    static std::unique_ptr<Decompressor> OpenStream(int fd, const std::string& name, std::string& error);
+
+    virtual ~Decompressor()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    //
+    // Decompress up to 'size' bytes into 'out'. Returns 0 at the end of the
+    // file and throws if the data is corrupt or truncated.
+    //
+    virtual size_t Read(char *out, size_t size) = 0;
+
+ protected:
+    int fd_;
+    std::string path_;
+    std::vector<unsigned char> input_;
+    size_t input_begin_{0};
+    size_t input_end_{0};
+
+    Decompressor(int fd, const std::string& path) : fd_(fd), path_(path), input_(kInputSize) {}
+
+    // Refill the input buffer once it's used up. Returns false at the end of the file.
+    bool FillInput()
+    {
+        if (input_begin_ < input_end_)
+            return true;
+        for (;;) {
+            ssize_t size = read(fd_, input_.data(), input_.size());
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0)
+                throw std::runtime_error("Couldn't read the input file '" + path_ + "'");
+            input_begin_ = 0;
+            input_end_ = static_cast<size_t>(size);
+            return size > 0;
+        }
+    }
+
+    [[noreturn]] void Corrupt() const
+    {
+        throw std::runtime_error("The compressed input file '" + path_ + "' is corrupt or truncated");
+    }
+
+    // Bytes already read from the file, returned before anything else
+    void Preload(const unsigned char *data, size_t size)
+    {
+        memcpy(input_.data(), data, size);
+        input_begin_ = 0;
+        input_end_ = size;
+    }
+};
+
+class PassThroughDecompressor : public Decompressor {
+ public:
+    PassThroughDecompressor(int fd, const std::string& path) : Decompressor(fd, path) {}
+
+    size_t Read(char *out, size_t size) override
+    {
+        if (input_begin_ == input_end_) {
+            // Large reads go straight to 'out'
+            for (;;) {
+                ssize_t read_size = read(fd_, out, size);
+                if (read_size < 0 && errno == EINTR)
+                    continue;
+                if (read_size < 0)
+                    throw std::runtime_error("Couldn't read the input file '" + path_ + "'");
+                return static_cast<size_t>(read_size);
+            }
+        }
+        size = std::min(size, input_end_ - input_begin_);
+        memcpy(out, input_.data() + input_begin_, size);
+        input_begin_ += size;
+        return size;
+    }
+};
+
+class GzipDecompressor : public Decompressor {
+ public:
+    GzipDecompressor(int fd, const std::string& path) : Decompressor(fd, path)
+    {
+        memset(&stream_, 0, sizeof(stream_));
+        // 15 + 32: a zlib or gzip header, detected automatically
+        if (inflateInit2(&stream_, 15 + 32) != Z_OK)
+            throw std::runtime_error("Couldn't initialize zlib");
+    }
+
+    ~GzipDecompressor() override
+    {
+        inflateEnd(&stream_);
+    }
+
+    size_t Read(char *out, size_t size) override
+    {
+        stream_.next_out = reinterpret_cast<Bytef *>(out);
+        stream_.avail_out = static_cast<uInt>(size);
+        while (stream_.avail_out == size) {
+            if (!FillInput()) {
+                if (in_member_)
+                    Corrupt();
+                break;
+            }
+            stream_.next_in = input_.data() + input_begin_;
+            stream_.avail_in = static_cast<uInt>(input_end_ - input_begin_);
+            int result = inflate(&stream_, Z_NO_FLUSH);
+            in_member_ = true;
+            input_begin_ = input_end_ - stream_.avail_in;
+
+            if (result == Z_STREAM_END) {
+                // The next member (if any) starts right after this one
+                inflateReset(&stream_);
+                in_member_ = false;
+            } else if (result != Z_OK && result != Z_BUF_ERROR) {
+                Corrupt();
+            }
+        }
+        return size - stream_.avail_out;
+    }
+
+ private:
+    z_stream stream_;
+    bool in_member_{false};
+};
+
+#ifdef PWM2BASE_ZSTD
+class ZstdDecompressor : public Decompressor {
+ public:
+    ZstdDecompressor(int fd, const std::string& path) : Decompressor(fd, path), stream_(ZSTD_createDStream())
+    {
+        if (!stream_)
+            throw std::runtime_error("Couldn't initialize zstd");
+    }
+
+    ~ZstdDecompressor() override
+    {
+        ZSTD_freeDStream(stream_);
+    }
+
+    size_t Read(char *out, size_t size) override
+    {
+        ZSTD_outBuffer output{out, size, 0};
+        while (output.pos == 0) {
+            if (!FillInput()) {
+                if (in_frame_)
+                    Corrupt();
+                break;
+            }
+            ZSTD_inBuffer input{input_.data() + input_begin_, input_end_ - input_begin_, 0};
+            size_t result = ZSTD_decompressStream(stream_, &output, &input);
+            if (ZSTD_isError(result))
+                Corrupt();
+            input_begin_ += input.pos;
+            // 0: a frame is complete
+            in_frame_ = result != 0;
+        }
+        return output.pos;
+    }
+
+ private:
+    ZSTD_DStream *stream_;
+    bool in_frame_{false};
+};
+#endif
+
+inline
+std::unique_ptr<Decompressor> Decompressor::Open(const std::string& path, Compression compression, std::string& error)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "Couldn't open input file '" + path + "'. Either it doesn't exist, or you don't have permissions to read it";
+        return nullptr;
+    }
+    if (compression == Compression::Gzip)
+        return std::make_unique<GzipDecompressor>(fd, path);
+#ifdef PWM2BASE_ZSTD
+    if (compression == Compression::Zstd)
+        return std::make_unique<ZstdDecompressor>(fd, path);
+#endif
+    close(fd);
+    error = "Can't read '" + path + "': this build of pwm2base has no " +
+            (compression == Compression::Zstd ? "zstd" : "decompression") + " support";
+    return nullptr;
+}
+
+inline
+std::unique_ptr<Decompressor> Decompressor::OpenStream(int fd, const std::string& name, std::string& error)
+{
+    unsigned char magic[4];
+    size_t size = 0;
+    while (size < sizeof(magic)) {
+        ssize_t read_size = read(fd, magic + size, sizeof(magic) - size);
+        if (read_size < 0 && errno == EINTR)
+            continue;
+        if (read_size < 0) {
+            close(fd);
+            error = "Couldn't read the input file '" + name + "'";
+            return nullptr;
+        }
+        if (read_size == 0)
+            break;
+        size += static_cast<size_t>(read_size);
+    }
+
+    std::unique_ptr<Decompressor> decompressor;
+    Compression compression = CompressionOfMagic(magic, size);
+    if (compression == Compression::None)
+        decompressor = std::make_unique<PassThroughDecompressor>(fd, name);
+    else if (compression == Compression::Gzip)
+        decompressor = std::make_unique<GzipDecompressor>(fd, name);
+#ifdef PWM2BASE_ZSTD
+    else
+        decompressor = std::make_unique<ZstdDecompressor>(fd, name);
+#else
+    else {
+        close(fd);
+        error = "Can't read '" + name + "': this build of pwm2base has no zstd support";
+        return nullptr;
+    }
+#endif
+    decompressor->Preload(magic, size);
+    return decompressor;
+}
+
+//
+// Compresses an output stream in independent blocks on worker threads and
+// hands the compressed blocks to 'sink' in order (pigz-style).
+//
+//    gzip  BGZF: every block is a gzip member of at most 64 KiB carrying its
+//          size in a 'BC' extra field, followed by the BGZF end-of-file
+//          block. Any gzip reader reads it; htslib tools can seek in it.
+//    zstd  every block is an independent zstd frame
+//
+class BlockCompressor {
+ public:
+    using Sink = std::function<void(std::string_view)>;
+
+    // Uncompressed bytes per block
+    static constexpr size_t kBgzfBlockSize = 0xFF00;
+    static constexpr size_t kZstdBlockSize = size_t{1} << 20;
+
+    BlockCompressor(Compression compression, unsigned threads, Sink sink)
+    : compression_(compression),
+      block_size_(compression == Compression::Zstd ? kZstdBlockSize : kBgzfBlockSize),
+      max_in_flight_(threads > 1 ? threads * 4 : 0),
+      sink_(std::move(sink))
+    {
+#ifndef PWM2BASE_ZSTD
+        if (compression == Compression::Zstd)
+            throw std::runtime_error("This build of pwm2base has no zstd support");
+#endif
+        pending_.reserve(block_size_);
+        for (unsigned i = 0; max_in_flight_ != 0 && i < threads; ++i)
+            workers_.emplace_back(&BlockCompressor::Work, this);
+    }
+
+    ~BlockCompressor()
+    {
+        Stop();
+    }
+
+    BlockCompressor(const BlockCompressor&) = delete;
+    BlockCompressor& operator=(const BlockCompressor&) = delete;
+
+    void Write(std::string_view data)
+    {
+        while (!data.empty()) {
+            size_t size = std::min(data.size(), block_size_ - pending_.size());
+            pending_.append(data.data(), size);
+            data.remove_prefix(size);
+            if (pending_.size() == block_size_)
+                SubmitPending();
+        }
+    }
+
+    // Compress and hand over everything written so far, then the end-of-file block
+    void Finish()
+    {
+        if (!pending_.empty())
+            SubmitPending();
+        WriteFinished(0);
+        Stop();
+        if (compression_ == Compression::Gzip)
+            sink_(std::string_view(reinterpret_cast<const char *>(kBgzfEof), sizeof(kBgzfEof)));
+    }
+
+ private:
+    static constexpr unsigned char kBgzfEof[28] = {
+        0x1F, 0x8B, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x06, 0x00, 0x42, 0x43,
+        0x02, 0x00, 0x1B, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    struct Block {
+        std::string input;
+        std::string output;
+        bool done{false};
+        bool failed{false};
+    };
+
+    Compression compression_;
+    size_t block_size_;
+    size_t max_in_flight_;
+    Sink sink_;
+    std::string pending_;
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    // Blocks in output order; workers take the oldest 'queued' ones
+    std::deque<std::shared_ptr<Block>> blocks_;
+    std::deque<std::shared_ptr<Block>> queued_;
+    bool stop_{false};
+
+    void SubmitPending()
+    {
+        auto block = std::make_shared<Block>();
+        block->input.swap(pending_);
+        pending_.reserve(block_size_);
+
+        if (workers_.empty()) {
+            Compress(*block);
+            sink_(block->output);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            blocks_.push_back(block);
+            queued_.push_back(block);
+        }
+        changed_.notify_all();
+        WriteFinished(max_in_flight_);
+    }
+
+    // Hand finished blocks over in order until at most 'keep' remain in flight
+    void WriteFinished(size_t keep)
+    {
+        for (;;) {
+            std::shared_ptr<Block> block;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (blocks_.size() <= keep && !(keep && !blocks_.empty() && blocks_.front()->done))
+                    return;
+                changed_.wait(lock, [this] { return blocks_.front()->done; });
+                block = std::move(blocks_.front());
+                blocks_.pop_front();
+            }
+            if (block->failed)
+                throw std::runtime_error("Couldn't compress the output");
+            sink_(block->output);
+        }
+    }
+
+    void Work()
+    {
+        for (;;) {
+            std::shared_ptr<Block> block;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+                if (queued_.empty())
+                    return;
+                block = std::move(queued_.front());
+                queued_.pop_front();
+            }
+            try {
+                Compress(*block);
+            } catch (...) {
+                block->failed = true;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                block->done = true;
+            }
+            changed_.notify_all();
+        }
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        changed_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+        workers_.clear();
+    }
+
+    void Compress(Block& block) const
+    {
+        block.output.clear();
+#ifdef PWM2BASE_ZSTD
+        if (compression_ == Compression::Zstd) {
+            block.output.resize(ZSTD_compressBound(block.input.size()));
+            size_t size = ZSTD_compress(&block.output[0], block.output.size(),
+                                        block.input.data(), block.input.size(), 3);
+            if (ZSTD_isError(size))
+                throw std::runtime_error(ZSTD_getErrorName(size));
+            block.output.resize(size);
+            return;
+        }
+#endif
+        CompressBgzf(block.input, block.output, Z_DEFAULT_COMPRESSION);
+        // Incompressible data may not fit a BGZF block; it's stored then
+        if (block.output.size() > 65536)
+            CompressBgzf(block.input, block.output, Z_NO_COMPRESSION);
+    }
+
+    static void CompressBgzf(const std::string& input, std::string& output, int level)
+    {
+        constexpr size_t kHeaderSize = 18;
+        constexpr size_t kFooterSize = 8;
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // Raw deflate: the gzip header and footer are written here
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Couldn't initialize zlib");
+
+        output.resize(kHeaderSize + deflateBound(&stream, static_cast<uLong>(input.size())) + kFooterSize);
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+        stream.avail_in = static_cast<uInt>(input.size());
+        stream.next_out = reinterpret_cast<Bytef *>(&output[kHeaderSize]);
+        stream.avail_out = static_cast<uInt>(output.size() - kHeaderSize - kFooterSize);
+        int result = deflate(&stream, Z_FINISH);
+        size_t deflated = stream.total_out;
+        deflateEnd(&stream);
+        if (result != Z_STREAM_END)
+            throw std::runtime_error("Couldn't compress the output");
+
+        size_t block_size = kHeaderSize + deflated + kFooterSize;
+        output.resize(block_size);
+        static const unsigned char kHeader[12] = {0x1F, 0x8B, 0x08, 0x04, 0, 0, 0, 0, 0, 0xFF, 0x06, 0x00};
+        memcpy(&output[0], kHeader, sizeof(kHeader));
+        output[12] = 'B';
+        output[13] = 'C';
+        output[14] = 2;
+        output[15] = 0;
+        PutLittleEndian16(&output[16], block_size - 1);
+
+        uint32_t crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(input.data()),
+                                                   static_cast<uInt>(input.size())));
+        PutLittleEndian32(&output[block_size - 8], crc);
+        PutLittleEndian32(&output[block_size - 4], static_cast<uint32_t>(input.size()));
+    }
+
+    static void PutLittleEndian16(char *out, size_t value)
+    {
+        out[0] = static_cast<char>(value & 0xFF);
+        out[1] = static_cast<char>((value >> 8) & 0xFF);
+    }
+
+    static void PutLittleEndian32(char *out, uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+            out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+};
+
+#endif /* Compression_h */
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Consensus_h
+#define Consensus_h
+
+#include "Common.h"
+#include "MatrixCache.h"
+#include "MatrixParser.h"
+#include "PwmConverter.h"
+#include "Stats.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//
+// Consensus of whole matrices: the argmax of every column (see
+// ConsensusIndex()) and the bases it stands for. The AVX2 kernels compare a
+// block of columns at once, one row (base) after the other, so the first
+// strictly greatest positive value still wins. Weights are compared as the
+// doubles they were parsed into: rounding them to floats could turn a
+// narrow win into a tie.
+//
+
+namespace consensus {
+
+using WeightsKernel = void (*)(const std::array<double, 4> *columns, size_t count, uint8_t *consensus);
+using CountsKernel = void (*)(const int *const rows[4], size_t count, uint8_t *consensus);
+using BasesKernel = void (*)(const uint8_t *consensus, size_t count, const char *bases, char *out);
+
+inline void WeightsScalar(const std::array<double, 4> *columns, size_t count, uint8_t *consensus)
+{
+    for (size_t i = 0; i < count; ++i)
+        consensus[i] = ConsensusIndex(columns[i].data());
+}
+
+inline void CountsScalar(const int *const rows[4], size_t count, uint8_t *consensus)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const int counts[4] = {rows[0][i], rows[1][i], rows[2][i], rows[3][i]};
+        consensus[i] = ConsensusIndex(counts);
+    }
+}
+
+// Columns without a consensus are left for the caller
+inline void BasesScalar(const uint8_t *consensus, size_t count, const char *bases, char *out)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = (consensus[i] == pwmbin::kNoConsensus) ? '\0' : bases[consensus[i]];
+}
+
+#if PWM2BASE_X86
+//
+// Four columns at a time: the columns are loaded as they are stored and
+// transposed into one register per base.
+//
+__attribute__((target("avx2")))
+inline void WeightsAvx2(const std::array<double, 4> *columns, size_t count, uint8_t *consensus)
+{
+    const __m128i low_bytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const double *values = columns[i].data();
+        __m256d c0 = _mm256_loadu_pd(values);
+        __m256d c1 = _mm256_loadu_pd(values + 4);
+        __m256d c2 = _mm256_loadu_pd(values + 8);
+        __m256d c3 = _mm256_loadu_pd(values + 12);
+        __m256d ag01 = _mm256_unpacklo_pd(c0, c1);
+        __m256d ct01 = _mm256_unpackhi_pd(c0, c1);
+        __m256d ag23 = _mm256_unpacklo_pd(c2, c3);
+        __m256d ct23 = _mm256_unpackhi_pd(c2, c3);
+        const __m256d rows[4] = {
+            _mm256_permute2f128_pd(ag01, ag23, 0x20),
+            _mm256_permute2f128_pd(ct01, ct23, 0x20),
+            _mm256_permute2f128_pd(ag01, ag23, 0x31),
+            _mm256_permute2f128_pd(ct01, ct23, 0x31)
+        };
+
+        __m256d max = _mm256_setzero_pd();
+        __m256d index = _mm256_set1_pd(pwmbin::kNoConsensus);
+        for (int row = 0; row < 4; ++row) {
+            __m256d greater = _mm256_cmp_pd(rows[row], max, _CMP_GT_OQ);
+            max = _mm256_blendv_pd(max, rows[row], greater);
+            index = _mm256_blendv_pd(index, _mm256_set1_pd(row), greater);
+        }
+        int packed = _mm_cvtsi128_si32(_mm_shuffle_epi8(_mm256_cvtpd_epi32(index), low_bytes));
+        memcpy(consensus + i, &packed, 4);
+    }
+    WeightsScalar(columns + i, count - i, consensus + i);
+}
+
+// Eight columns at a time, straight from the rows of the counts
+__attribute__((target("avx2")))
+inline void CountsAvx2(const int *const rows[4], size_t count, uint8_t *consensus)
+{
+    const __m256i low_bytes = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i max = _mm256_setzero_si256();
+        __m256i index = _mm256_set1_epi32(pwmbin::kNoConsensus);
+        for (int row = 0; row < 4; ++row) {
+            __m256i counts = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[row] + i));
+            __m256i greater = _mm256_cmpgt_epi32(counts, max);
+            max = _mm256_blendv_epi8(max, counts, greater);
+            index = _mm256_blendv_epi8(index, _mm256_set1_epi32(row), greater);
+        }
+        index = _mm256_shuffle_epi8(index, low_bytes);
+        int low = _mm_cvtsi128_si32(_mm256_castsi256_si128(index));
+        int high = _mm_cvtsi128_si32(_mm256_extracti128_si256(index, 1));
+        memcpy(consensus + i, &low, 4);
+        memcpy(consensus + i + 4, &high, 4);
+    }
+    const int *const rest[4] = {rows[0] + i, rows[1] + i, rows[2] + i, rows[3] + i};
+    CountsScalar(rest, count - i, consensus + i);
+}
+
+//
+// 32 columns at a time: the consensus indices select their bases from a
+// shuffle table. kNoConsensus has its high bit set and becomes '\0'.
+//
+__attribute__((target("avx2")))
+inline void BasesAvx2(const uint8_t *consensus, size_t count, const char *bases, char *out)
+{
+    const __m256i table = _mm256_setr_epi8(bases[0], bases[1], bases[2], bases[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                           bases[0], bases[1], bases[2], bases[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(consensus + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_shuffle_epi8(table, index));
+    }
+    BasesScalar(consensus + i, count - i, bases, out + i);
+}
+#endif
+
+struct Kernels {
+    WeightsKernel weights{WeightsScalar};
+    CountsKernel counts{CountsScalar};
+    BasesKernel bases{BasesScalar};
+};
+
+inline const Kernels& SelectKernels()
+{
+    static const Kernels kernels = [] {
+        Kernels selected;
+#if PWM2BASE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            selected = Kernels{WeightsAvx2, CountsAvx2, BasesAvx2};
+#endif
+        return selected;
+    }();
+    return kernels;
+}
+
+} // namespace consensus
+
+// The argmax of every column of a weights matrix into 'consensus'
+inline
+void ComputeConsensus(const std::vector<std::array<double, 4>>& columns, std::vector<uint8_t>& consensus)
+{
+    consensus.resize(columns.size());
+    consensus::SelectKernels().weights(columns.data(), columns.size(), consensus.data());
+}
+
+// The argmax of every column of a .pfm matrix into 'consensus'
+inline
+void ComputeConsensus(const PfmCounts& counts, std::vector<uint8_t>& consensus)
+{
+    const int *const rows[4] = {counts.row(0), counts.row(1), counts.row(2), counts.row(3)};
+    consensus.resize(counts.columns());
+    consensus::SelectKernels().counts(rows, counts.columns(), consensus.data());
+}
+
+//
+// Replace 'out' with the bases of a compiled matrix: the precomputed argmax of
+// every column, or a random base where the column had no positive value (as
+// the converters do). Those columns draw their bases in column order once the
+// rest is written.
+//
+inline
+void WriteConsensus(const uint8_t *consensus, size_t columns, Format output_format, std::string& out)
+{
+    out.resize(columns);
+    if (columns == 0)
+        return;
+    const char *bases = OutputBasesFor(output_format);
+    consensus::SelectKernels().bases(consensus, columns, bases, &out[0]);
+
+    const uint8_t *fallback = consensus;
+    const uint8_t *end = consensus + columns;
+    size_t fallbacks = 0;
+    while ((fallback = static_cast<const uint8_t *>(memchr(fallback, pwmbin::kNoConsensus, end - fallback)))) {
+        out[fallback - consensus] = bases[random_bits.Uniform<4>()];
+        ++fallbacks;
+        ++fallback;
+    }
+    if (stats_enabled && fallbacks > 0)
+        LocalStats().random_fallbacks += fallbacks;
+}
+
+#endif /* Consensus_h */
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ConsensusMemo_h
+#define ConsensusMemo_h
+
+#include "Consensus.h"
+#include "MatrixCache.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//
+// Consensus of every matrix text converted so far, shared by the converters
+// of all threads. Releases tend to repeat the same matrices under different
+// ids, and a repeat is then turned into bases by WriteConsensus() without
+// being parsed again. Columns without a consensus still draw their random
+// base, so the output is the same as without the memo.
+//
+// Matrices are looked up by a hash of their raw text (line breaks included)
+// and the text is compared on a hit. The memo stops growing at kMaxBytes.
+//
+// Save() and Load() keep the memo in a file between runs:
+//
+//    char[8]    kMagic
+//    uint32_t   kVersion
+//    uint64_t   entry count
+//    entries    uint8_t kind, uint32_t text size, uint32_t column count, text, consensus
+//    uint64_t   pwmbin::Checksum() of the entries
+//
+class ConsensusMemo {
+ public:
+    static constexpr char kMagic[8] = {'P', 'W', 'M', 'M', 'E', 'M', 'O', '\n'};
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kMaxBytes = size_t{256} << 20;
+
+    ConsensusMemo() = default;
+    ConsensusMemo(const ConsensusMemo&) = delete;
+    ConsensusMemo& operator=(const ConsensusMemo&) = delete;
+
+    // Copy the consensus of 'text' into 'consensus' if it's known
+    bool Find(pwmbin::MotifKind kind, std::string_view text, std::vector<uint8_t>& consensus)
+    {
+        uint64_t hash = Hash(kind, text);
+        Shard& shard = shards_[hash % kShards];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto entry = shard.entries.find(hash);
+            if (entry != shard.entries.end() && entry->second.kind == kind && entry->second.text == text) {
+                consensus = entry->second.consensus;
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void Insert(pwmbin::MotifKind kind, std::string_view text, const std::vector<uint8_t>& consensus)
+    {
+        size_t size = text.size() + consensus.size();
+        if (bytes_.fetch_add(size, std::memory_order_relaxed) + size > kMaxBytes) {
+            bytes_.fetch_sub(size, std::memory_order_relaxed);
+            return;
+        }
+
+        uint64_t hash = Hash(kind, text);
+        Shard& shard = shards_[hash % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        // On a hash collision the first matrix keeps the slot
+        if (!shard.entries.emplace(hash, Entry{kind, std::string(text), consensus}).second)
+            bytes_.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    uint64_t hits() const
+    {
+        return hits_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t misses() const
+    {
+        return misses_.load(std::memory_order_relaxed);
+    }
+
+    //
+    // Add the entries of a memo file. A missing file is no error (there's
+    // nothing to add on the first run); a corrupt one is.
+    //
+    bool Load(const std::string& path, std::string& error)
+    {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr)
+            return true;
+        std::string image;
+        char chunk[1 << 16];
+        size_t size;
+        while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+            image.append(chunk, size);
+        fclose(file);
+
+        const size_t header_size = sizeof(kMagic) + sizeof(uint32_t) + sizeof(uint64_t);
+        uint32_t version = 0;
+        uint64_t count = 0;
+        uint64_t checksum = 0;
+        if (image.size() >= header_size + sizeof(checksum)) {
+            memcpy(&version, image.data() + sizeof(kMagic), sizeof(version));
+            memcpy(&count, image.data() + sizeof(kMagic) + sizeof(version), sizeof(count));
+            memcpy(&checksum, image.data() + image.size() - sizeof(checksum), sizeof(checksum));
+        }
+        if (image.size() < header_size + sizeof(checksum) || memcmp(image.data(), kMagic, sizeof(kMagic)) != 0 ||
+            version != kVersion ||
+            pwmbin::Checksum(image.data() + header_size, image.size() - header_size - sizeof(checksum)) != checksum) {
+            error = "'" + path + "' is not a valid matrix memo file";
+            return false;
+        }
+
+        const char *p = image.data() + header_size;
+        const char *end = image.data() + image.size() - sizeof(checksum);
+        std::vector<uint8_t> consensus;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint8_t kind;
+            uint32_t text_size;
+            uint32_t columns;
+            if (end - p < static_cast<ptrdiff_t>(sizeof(kind) + sizeof(text_size) + sizeof(columns)))
+                break;
+            memcpy(&kind, p, sizeof(kind));
+            memcpy(&text_size, p + sizeof(kind), sizeof(text_size));
+            memcpy(&columns, p + sizeof(kind) + sizeof(text_size), sizeof(columns));
+            p += sizeof(kind) + sizeof(text_size) + sizeof(columns);
+            if (static_cast<size_t>(end - p) < size_t{text_size} + columns)
+                break;
+            consensus.assign(p + text_size, p + text_size + columns);
+            Insert(static_cast<pwmbin::MotifKind>(kind), std::string_view(p, text_size), consensus);
+            p += text_size + columns;
+        }
+        return true;
+    }
+
+    // Write the memo atomically (see WriteFileAtomically())
+    bool Save(const std::string& path, std::string& error) const
+    {
+        std::string image(kMagic, sizeof(kMagic));
+        uint64_t count = 0;
+        image.append(reinterpret_cast<const char *>(&kVersion), sizeof(kVersion));
+        image.append(sizeof(count), '\0');
+        size_t header_size = image.size();
+
+        for (const Shard& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& item : shard.entries) {
+                const Entry& entry = item.second;
+                uint8_t kind = static_cast<uint8_t>(entry.kind);
+                uint32_t text_size = static_cast<uint32_t>(entry.text.size());
+                uint32_t columns = static_cast<uint32_t>(entry.consensus.size());
+                image.append(reinterpret_cast<const char *>(&kind), sizeof(kind));
+                image.append(reinterpret_cast<const char *>(&text_size), sizeof(text_size));
+                image.append(reinterpret_cast<const char *>(&columns), sizeof(columns));
+                image += entry.text;
+                image.append(entry.consensus.begin(), entry.consensus.end());
+                ++count;
+            }
+        }
+        memcpy(&image[sizeof(kMagic) + sizeof(kVersion)], &count, sizeof(count));
+        uint64_t checksum = pwmbin::Checksum(image.data() + header_size, image.size() - header_size);
+        image.append(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+
+        return WriteFileAtomically(path, image, error);
+    }
+
+ private:
+    // Threads converting matrices rarely wait for each other with this many locks
+    static constexpr size_t kShards = 32;
+
+    struct Entry {
+        pwmbin::MotifKind kind;
+        std::string text;
+        std::vector<uint8_t> consensus;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<uint64_t, Entry> entries;
+    };
+
+    std::array<Shard, kShards> shards_;
+    std::atomic<size_t> bytes_{0};
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+
+    static uint64_t Hash(pwmbin::MotifKind kind, std::string_view text)
+    {
+        return pwmbin::Checksum(text.data(), text.size()) ^ (static_cast<uint64_t>(kind) << 63);
+    }
+};
+
+#endif /* ConsensusMemo_h */
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ConversionContext_h
+#define ConversionContext_h
+
+#include "Common.h"
+#include "MatrixParser.h"
+#include "Pipeline.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// What a ConversionContext converts: IUPAC sequences, or weight matrices when
+// 'matrix_input' is set (in the JASPAR .pfm layout when 'pfm_input' is set
+// too). 'seed' plays the part of '--seed': a record converts to the same
+// bases as record 'record_index' of the input file with key 'file_key' (see
+// FileStreamKey()) of a pwm2base run with that seed.
+//
+struct ConversionOptions {
+    Format output_format{Format::DNA};
+    bool matrix_input{false};
+    bool pfm_input{false};
+    uint64_t seed{0};
+};
+
+//
+// In-process conversion for programs linking libpwm2base. A context owns all
+// of its state, so any number of contexts can be used side by side, and a
+// single context can be shared: concurrent ConvertBatch() calls each borrow a
+// ConverterSet of their own.
+//
+class ConversionContext {
+ public:
+    explicit ConversionContext(const ConversionOptions& options) : options_(options)
+    {
+        if (options_.output_format == Format::PWM)
+            throw std::invalid_argument("Unsupported output format");
+    }
+
+    ConversionContext(const ConversionContext&) = delete;
+    ConversionContext& operator=(const ConversionContext&) = delete;
+
+    const ConversionOptions& options() const
+    {
+        return options_;
+    }
+
+    //
+    // Convert records 'first_record' .. 'first_record + count - 1' of the file
+    // with key 'file_key', record i being 'sequences[i]'. The bases of all
+    // records go to 'output' back to back, 'sizes[i]' bytes for record i (base
+    // codes 0-3 and gaps as they are for Format::Packed). Returns the number
+    // of bytes the batch takes; if that's more than 'capacity' nothing is
+    // written. Output is never longer than the input, so 'capacity' equal to
+    // the total size of 'sequences' always suffices.
+    //
+    // Throws MatrixParseError (naming the record as "#<index>") for a matrix
+    // that can't be parsed.
+    //
+    size_t ConvertBatch(const std::string_view *sequences, size_t count, uint64_t file_key, uint64_t first_record,
+                        char *output, size_t capacity, size_t *sizes)
+    {
+        std::unique_ptr<ConverterSet> converters = Acquire();
+
+        converters->sequences.assign(sequences, sequences + count);
+        if (converters->outputs.size() < count)
+            converters->outputs.resize(count);
+        converters->record_indices.clear();
+        for (size_t i = 0; i < count; ++i)
+            converters->record_indices.push_back(first_record + i);
+
+        size_t converted = 0;
+        try {
+            converters->For(options_.pfm_input).ConvertBatch(converters->sequences.data(), count, converters->seed,
+                                                             file_key, converters->record_indices.data(),
+                                                             converters->outputs.data(), converted);
+        } catch (MatrixParseError& error) {
+            error.SetRecord("#" + std::to_string(first_record + converted));
+            Release(std::move(converters));
+            throw;
+        }
+
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            sizes[i] = converters->outputs[i].size();
+            total += sizes[i];
+        }
+        if (total <= capacity) {
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(output, converters->outputs[i].data(), sizes[i]);
+                output += sizes[i];
+            }
+        }
+        Release(std::move(converters));
+        return total;
+    }
+
+ private:
+    ConversionOptions options_;
+    std::mutex mutex_;
+    // Converter sets not in use by a ConvertBatch() call
+    std::vector<std::unique_ptr<ConverterSet>> free_;
+
+    std::unique_ptr<ConverterSet> Acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                auto converters = std::move(free_.back());
+                free_.pop_back();
+                return converters;
+            }
+        }
+        return std::make_unique<ConverterSet>(MakeConverterSet(options_.output_format, options_.matrix_input,
+                                                               options_.seed));
+    }
+
+    void Release(std::unique_ptr<ConverterSet> converters)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.emplace_back(std::move(converters));
+    }
+};
+
+#endif /* ConversionContext_h */
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CorpusGenerator_h
+#define CorpusGenerator_h
+
+#include "RandomBits.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+//
+// Synthetic inputs for benchmarking. 'degeneracy' is the fraction of positions
+// that make the converters draw random bases: degenerate IUPAC codes in
+// sequences, all-zero columns in matrices. The same options and seed always
+// produce the same corpus.
+//
+struct CorpusOptions {
+    uint64_t records{20000};
+    size_t length{20};
+    double degeneracy{0.3};
+    uint64_t seed{1};
+};
+
+class CorpusGenerator {
+ public:
+    explicit CorpusGenerator(const CorpusOptions& options)
+    : options_(options), generator_(options.seed)
+    { }
+
+    // FASTA of IUPAC sequences, wrapped at 60 columns
+    void WriteIupac(const std::string& path)
+    {
+        static const char kBases[] = "ACGT";
+        static const char kDegenerate[] = "RYSWKMBDHVN";
+
+        Open(path);
+        for (uint64_t i = 0; i < options_.records; ++i) {
+            Append(">seq_" + std::to_string(i + 1) + " synthetic\n");
+            for (size_t column = 0; column < options_.length; ++column) {
+                if (column != 0 && column % 60 == 0)
+                    buffer_ += '\n';
+                buffer_ += Degenerate() ? kDegenerate[Below(sizeof(kDegenerate) - 1)] : kBases[Below(4)];
+            }
+            buffer_ += '\n';
+        }
+        Close();
+    }
+
+    // Weight matrices (FASTA records with one tab-separated A C G T column per line)
+    void WriteWeights(const std::string& path)
+    {
+        Open(path);
+        for (uint64_t i = 0; i < options_.records; ++i) {
+            Append(">MOTIF" + std::to_string(i + 1) + "_SYNTH.H10MO.A\n");
+            for (size_t column = 0; column < options_.length; ++column) {
+                bool zero = Degenerate();
+                for (int base = 0; base < 4; ++base) {
+                    if (base != 0)
+                        buffer_ += '\t';
+                    Append(zero ? "0" : std::to_string(static_cast<double>(Below(1000000)) / 1000.0));
+                }
+                buffer_ += '\n';
+            }
+        }
+        Close();
+    }
+
+    // JASPAR .pfm count matrices
+    void WritePfm(const std::string& path)
+    {
+        Open(path);
+        for (uint64_t i = 0; i < options_.records; ++i) {
+            char id[32];
+            snprintf(id, sizeof(id), ">MA%04llu.1", static_cast<unsigned long long>(i + 1));
+            Append(std::string(id) + " SYNTH" + std::to_string(i + 1) + "\n");
+
+            std::string rows[4] = {"A  [", "C  [", "G  [", "T  ["};
+            for (size_t column = 0; column < options_.length; ++column) {
+                bool zero = Degenerate();
+                for (auto& row : rows)
+                    row += ' ' + std::to_string(zero ? 0 : Below(100));
+            }
+            for (auto& row : rows)
+                Append(row + " ]\n");
+        }
+        Close();
+    }
+
+ private:
+    CorpusOptions options_;
+    Xoshiro256 generator_;
+    FILE *file_{nullptr};
+    std::string path_;
+    std::string buffer_;
+
+    uint64_t Below(uint64_t bound)
+    {
+        return generator_() % bound;
+    }
+
+    bool Degenerate()
+    {
+        return static_cast<double>(generator_() >> 11) * 0x1.0p-53 < options_.degeneracy;
+    }
+
+    void Open(const std::string& path)
+    {
+        if (!(file_ = fopen(path.c_str(), "wb")))
+            throw std::runtime_error("Couldn't create the corpus file '" + path + "'");
+        path_ = path;
+        buffer_.clear();
+    }
+
+    void Append(const std::string& text)
+    {
+        buffer_ += text;
+        if (buffer_.size() >= (size_t{1} << 20))
+            Flush();
+    }
+
+    void Flush()
+    {
+        if (fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size())
+            throw std::runtime_error("Couldn't write the corpus file '" + path_ + "'");
+        buffer_.clear();
+    }
+
+    void Close()
+    {
+        Flush();
+        if (fclose(file_) != 0)
+            throw std::runtime_error("Couldn't write the corpus file '" + path_ + "'");
+        file_ = nullptr;
+    }
+};
+
+#endif /* CorpusGenerator_h */
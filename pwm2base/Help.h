@@ -18,9 +18,17 @@
 #define Help_h
 
 #include "Common.h"
+#include "Compression.h"
 
 #include <string>
 #include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
 
 inline void PrintHelp(FILE *destination)
 {
@@ -31,14 +39,71 @@ Build date: %s\n\
 \n", __DATE__);
     fprintf(destination, "\
 USAGE: pwm2base [options] <input path> [-o <output path>]\n\
+       <command> | pwm2base [options] - [-o <output path>] | <command>\n\
+       pwm2base compile <matrix file or directory> [-o <cache path>]\n\
+       pwm2base bench [benchmark options] [-t <threads>] [--seed <number>] [-o <results.json>]\n\
+       pwm2base scan -m <matrix file or directory> -g <genome.fasta> [scan options] [-t <threads>] [-o <hits path>]\n\
+       pwm2base serve [--socket <path>] [--load <name>=<matrix file or directory> ...] [-t <threads>]\n\
+\n\
+COMMANDS:\n\
+compile                - Parse weight/.pfm matrices once and store them in a binary '.pwmbin' cache. Pass the cache (or\n\
+                         a directory containing it) to '-m' to skip parsing; it is rebuilt when its source file changes\n\
+bench                  - Generate IUPAC, weight matrix and JASPAR .pfm corpora and time every converter, end to end\n\
+                         and per stage. Results are written as JSON to '-o' (or stdout), a summary goes to stderr\n\
+scan                   - Find the motif hits of every matrix on both strands of a genome FASTA. Matrices with negative\n\
+                         values are used as log-odds scores, others (counts, frequencies) are converted to log2 odds\n\
+                         against a uniform background. Hits go to '-o' (default '<genome>-hits.bed') as BED, or as TSV\n\
+                         with p-values and the matched sequence when the path ends with '.tsv'\n\
+serve                  - Keep named matrix collections parsed in memory and answer 'convert', 'sample' and 'consensus'\n\
+                         requests on them from '-t' threads, one request per line on a Unix domain socket or on stdin\n\
+                         (responses go to stdout). Send '<tag> stats' for p50/p99 latencies; see Server.h for the protocol\n\
+\n\
+SERVE OPTIONS:\n\
+--socket <path>        - Listen on the Unix domain socket <path> instead of reading requests from stdin\n\
+--load <name>=<path>   - Load the matrices of <path> as the collection <name> before serving (may be repeated)\n\
+\n\
+SCAN OPTIONS:\n\
+-g <genome path>       - Genome FASTA to scan (uncompressed)\n\
+--pvalue <p>           - Report windows whose score has a p-value of at most <p> (default 1e-4)\n\
+--threshold <score>    - Report windows scoring at least <score> instead\n\
+\n\
+BENCHMARK OPTIONS:\n\
+--records <count>      - Records (sequences or matrices) per corpus (default 20000)\n\
+--length <count>       - Sequence length / matrix columns (default 20)\n\
+--degeneracy <0..1>    - Fraction of degenerate IUPAC codes and all-zero matrix columns (default 0.3)\n\
+--iterations <count>   - Runs of every stage; the JSON has the minimum and the median (default 5)\n\
+--corpus-dir <path>    - Keep the corpora and outputs in this directory instead of a temporary one\n\
 \n\
 OPTIONS:\n\
 -h                     - Show this message\n\
 -v                     – Verbose output (print the random seed used for sequence generation)\n\
+--seed <number>        - Seed the random generator to get reproducible output\n\
+-t <threads>           - Number of conversion threads (0 - one per CPU core). The output doesn't depend on it\n\
 -s <input path>        - Path to PWM sequences file\n\
 -m <input path>        - Path to PWM weights file\n\
--o <output path>       - Assign a custom output name instead of an auto-generated one\n\
+-n <count>             - Sample <count> sequences from the base distributions of every matrix column instead of taking\n\
+                         the most likely base (negative weights count as zero). Requires '-m'\n\
+--top-k <k>            - Write the <k> highest-scoring sequences of every matrix with their log-odds scores (as in\n\
+                         'scan'), best first, instead of the most likely one. Requires '-m'\n\
+--memo                 - Remember the consensus of every matrix converted, so a matrix that comes up again (under any id,\n\
+                         in any input file) isn't parsed again. The output is the same; '-v' reports the hits. Requires '-m'\n\
+--memo-file <path>     - Like '--memo', and keep the memo in <path> between runs\n\
+-o <output path>       - Assign a custom output name instead of an auto-generated one ('-' for stdout)\n\
+-                      - Read the input from stdin (may be gzip or zstd compressed) and write the output to stdout\n\
+                         unless '-o' says otherwise. Records are converted as they arrive. Without '-s' or '-m' the\n\
+                         input kind is told by its first record: IUPAC sequences, tab-separated weights or JASPAR .pfm\n\
 -f                     - Always override output file\n\
+--split-output         - Write one output file per input file (next to it, or into the '-o' directory)\n\
+--incremental          - Convert a directory into the same output as a full run, but only convert the files that are new\n\
+                         or changed since the last '--incremental' run and copy the lines of the rest. What the output\n\
+                         was made of is kept in '<output>.manifest'. Requires '--seed'; the bases of a file depend only\n\
+                         on its path within the directory, so adding or removing a file converts only that file\n\
+--output-format <kind> - 'tsv' (default) or 'packed': a .pwmpack file with 2-bit bases, a gap mask and an id table,\n\
+                         indexed for memory-mapped reading (see PackedSequences.h)\n\
+--compress gz|zst      - Compress the output in independent blocks on the conversion threads. gzip output is BGZF.\n\
+                         (gzip and zstd compressed inputs are always decompressed as they are read)\n\
+--stats[=json]         - Print run statistics to stderr when done: time and CPU per phase, throughput, peak memory,\n\
+                         record lengths and the IUPAC symbols / all-zero matrix columns that made random draws\n\
 -dna (default)         - Produce DNA output sequences\n\
 -rna                   - Produce RNA output sequences\n\
 \n\
@@ -58,6 +123,35 @@ pwm2base -m ~/Example_3_HUMAN_PWM.fasta -rna   - Convert a PWM .fasta (or .txt)
 pwm2base -s ~/Documents/pwm_file.fasta         - Convert PWM FASTA file '~/Documents/pwm_file.fasta' into DNA/RNA bases. The output will be in FASTA format as well\n\
                                                  and it will be located in the same folder as the input, but with '-bases' suffix appended to its name.\n\
 \n\
+pwm2base compile ~/jaspar2016.pfm              - Compile '~/jaspar2016.pfm' into '~/jaspar2016.pfm.pwmbin'. 'pwm2base -m ~/jaspar2016.pfm.pwmbin'\n\
+                                                 then produces the same output as 'pwm2base -m ~/jaspar2016.pfm'.\n\
+\n\
+pwm2base -n 1000 -m ~/jaspar2016.pfm           - Write 1000 sequences sampled from every matrix of '~/jaspar2016.pfm'.\n\
+\n\
+pwm2base --top-k 100 -m ~/jaspar2016.pfm       - Write the 100 best-scoring sequences of every matrix of '~/jaspar2016.pfm'.\n\
+\n\
+pwm2base scan -t 0 -m ~/hocomoco.txt -g ~/hg38.fa -o hits.bed\n\
+                                               - Scan both strands of '~/hg38.fa' for every HOCOMOCO motif on all CPU cores.\n\
+\n\
+pwm2base serve -t 8 --socket /tmp/pwm2base.sock --load jaspar=~/jaspar2016.pfm\n\
+                                               - Serve '~/jaspar2016.pfm' on 8 threads; 'echo \"1 sample jaspar 10 seed=5\" | nc -U /tmp/pwm2base.sock'\n\
+                                                 returns the lines of 'pwm2base --seed 5 -n 10 -m ~/jaspar2016.pfm'.\n\
+\n\
+pwm2base bench --records 100000 -o bench.json  - Benchmark the converters on 100000-record corpora and save the results in 'bench.json'.\n\
+\n\
+pwm2base -t 4 --compress gz -m ~/hocomoco.txt.gz\n\
+                                               - Convert the gzip-compressed '~/hocomoco.txt.gz' into '~/hocomoco-bases.tsv.gz'.\n\
+\n\
+pwm2base --output-format packed -s ~/iupac.fa   - Convert '~/iupac.fa' into the packed file '~/iupac-bases.pwmpack'.\n\
+\n\
+zcat ~/jaspar2016.pfm.gz | pwm2base --seed 5 - | cut -f 2\n\
+                                               - Convert JASPAR counts read from a pipe and pass the bases on, without temporary files.\n\
+\n\
+pwm2base -t 0 -m ~/PWM_Matrices/               - Convert all files in the directory '~/PWM_Matrices/' using all CPU cores.\n\
+\n\
+pwm2base -t 8 --split-output -m ~/PWM_Matrices/ -o ~/Bases/\n\
+                                               - Convert every file in '~/PWM_Matrices/' into its own '<name>-bases.tsv' file in '~/Bases/'.\n\
+\n\
 pwm2base -s ~/Documents/pwm_file.txt -o ./output.tsv        - Convert PWM .txt file '~/Documents/pwm_file.txt' into the file containing DNA bases.\n\
                                                                The output will be located in the current directory with a name 'output.tsv'.\n\
 \n\
@@ -68,13 +162,54 @@ pwm2base -rna -m ~/Example_3_HUMAN_PWM.txt  -o ./output.tsv - Convert PWM .txt (
 
 class ArgumentsParser {
  public:
+    enum class Command {
+        Convert,
+        Compile,
+        Bench,
+        Scan,
+        Serve
+    };
+
+    Command command{Command::Convert};
     std::string input_path;
     std::string output_path;
     
     Format output_format{Format::DNA};
+    bool sequence_file_provided{false};
     bool matrix_file_provided{false};
     bool verbose{false};
     bool override_output{false};
+    bool seed_provided{false};
+    uint64_t seed{0};
+    unsigned threads{1};
+    bool split_output{false};
+    bool incremental{false};
+    bool memo{false};
+    std::string memo_path;
+    uint64_t samples{0};
+    uint64_t top_k{0};
+    bool stats{false};
+    bool stats_json{false};
+    Compression compression{Compression::None};
+    bool packed_output{false};
+
+    // bench
+    uint64_t bench_records{20000};
+    uint64_t bench_length{20};
+    double bench_degeneracy{0.3};
+    uint64_t bench_iterations{5};
+    std::string corpus_directory;
+
+    // scan
+    std::string genome_path;
+    double scan_pvalue{1e-4};
+    bool scan_threshold_provided{false};
+    double scan_threshold{0.0};
+
+    // serve
+    std::string socket_path;
+    // Collections to load at startup: name, path
+    std::vector<std::pair<std::string, std::string>> preload;
     
     ArgumentsParser(int argc, const char *argv[])
     {
@@ -86,11 +221,144 @@ class ArgumentsParser {
         for (int i = 1; i < argc; ++i) {
             std::string arg{argv[i]};
 
-            if (arg == "-v") {
+            if (i == 1 && arg == "compile") {
+                command = Command::Compile;
+                matrix_file_provided = true;
+            } else if (i == 1 && arg == "bench") {
+                command = Command::Bench;
+            } else if (i == 1 && arg == "scan") {
+                command = Command::Scan;
+            } else if (i == 1 && arg == "serve") {
+                command = Command::Serve;
+            } else if (arg == "--socket") {
+                i++;
+                if (i == argc || argv[i][0] == '-') {
+                    std::cerr << "No socket path provided. Aborting\n";
+                    std::exit(1);
+                }
+                socket_path.assign(argv[i]);
+            } else if (arg == "--load") {
+                i++;
+                std::string collection = (i < argc) ? argv[i] : "";
+                size_t equals = collection.find('=');
+                if (equals == std::string::npos || equals == 0 || equals + 1 == collection.size()) {
+                    std::cerr << "Invalid value for '--load' (expected <name>=<path>). Aborting\n";
+                    std::exit(1);
+                }
+                preload.emplace_back(collection.substr(0, equals), collection.substr(equals + 1));
+            } else if (arg == "-g") {
+                i++;
+                if (i == argc || argv[i][0] == '-') {
+                    std::cerr << "No genome file provided. Aborting\n";
+                    std::exit(1);
+                }
+                genome_path.assign(argv[i]);
+            } else if (arg == "--pvalue" || arg == "--threshold") {
+                i++;
+                char *end = nullptr;
+                double value = 0.0;
+                if (i < argc)
+                    value = std::strtod(argv[i], &end);
+                if (i == argc || end == argv[i] || *end != '\0' ||
+                    (arg == "--pvalue" && !(value > 0.0 && value <= 1.0))) {
+                    std::cerr << "Invalid value for '" << arg << "'. Aborting\n";
+                    std::exit(1);
+                }
+                if (arg == "--pvalue") {
+                    scan_pvalue = value;
+                } else {
+                    scan_threshold = value;
+                    scan_threshold_provided = true;
+                }
+            } else if (arg == "--records" || arg == "--length" || arg == "--iterations") {
+                uint64_t& value = (arg == "--records") ? bench_records
+                                : (arg == "--length") ? bench_length : bench_iterations;
+                i++;
+                char *end = nullptr;
+                errno = 0;
+                if (i < argc)
+                    value = std::strtoull(argv[i], &end, 10);
+                if (i == argc || errno != 0 || end == argv[i] || *end != '\0' || argv[i][0] == '-' || value == 0) {
+                    std::cerr << "Invalid value for '" << arg << "'. Aborting\n";
+                    std::exit(1);
+                }
+            } else if (arg == "--degeneracy") {
+                i++;
+                char *end = nullptr;
+                if (i < argc)
+                    bench_degeneracy = std::strtod(argv[i], &end);
+                if (i == argc || end == argv[i] || *end != '\0' || !(bench_degeneracy >= 0.0 && bench_degeneracy <= 1.0)) {
+                    std::cerr << "Invalid degeneracy, expected a number between 0 and 1. Aborting\n";
+                    std::exit(1);
+                }
+            } else if (arg == "--corpus-dir") {
+                i++;
+                if (i == argc || argv[i][0] == '-') {
+                    std::cerr << "No corpus directory provided. Aborting\n";
+                    std::exit(1);
+                }
+                corpus_directory.assign(argv[i]);
+            } else if (arg == "-v") {
                 verbose = true;
-            } else if (arg == "-s") {
+            } else if (arg == "--seed") {
+                i++;
+                if (i == argc) {
+                    std::cerr << "No seed value provided. Aborting\n";
+                    std::exit(1);
+                }
+
+                char *end = nullptr;
+                errno = 0;
+                seed = std::strtoull(argv[i], &end, 10);
+                if (errno != 0 || end == argv[i] || *end != '\0' || argv[i][0] == '-') {
+                    std::cerr << "Invalid seed value '" << argv[i] << "'. Aborting\n";
+                    std::exit(1);
+                }
+                seed_provided = true;
+            } else if (arg == "-t") {
+                i++;
+                if (i == argc || argv[i][0] == '-') {
+                    std::cerr << "No thread count provided. Aborting\n";
+                    std::exit(1);
+                }
+
+                char *end = nullptr;
+                errno = 0;
+                unsigned long value = std::strtoul(argv[i], &end, 10);
+                if (errno != 0 || end == argv[i] || *end != '\0' || value > 4096) {
+                    std::cerr << "Invalid thread count '" << argv[i] << "'. Aborting\n";
+                    std::exit(1);
+                }
+                threads = static_cast<unsigned>(value);
+                if (threads == 0)
+                    threads = std::max(1u, std::thread::hardware_concurrency());
+            } else if (arg == "--top-k") {
+                i++;
+                char *end = nullptr;
+                errno = 0;
+                if (i < argc)
+                    top_k = std::strtoull(argv[i], &end, 10);
+                if (i == argc || errno != 0 || end == argv[i] || *end != '\0' || argv[i][0] == '-' || top_k == 0) {
+                    std::cerr << "Invalid value for '--top-k'. Aborting\n";
+                    std::exit(1);
+                }
+            } else if (arg == "-n") {
                 i++;
                 if (i == argc || argv[i][0] == '-') {
+                    std::cerr << "No sample count provided. Aborting\n";
+                    std::exit(1);
+                }
+
+                char *end = nullptr;
+                errno = 0;
+                samples = std::strtoull(argv[i], &end, 10);
+                if (errno != 0 || end == argv[i] || *end != '\0' || samples == 0) {
+                    std::cerr << "Invalid sample count '" << argv[i] << "'. Aborting\n";
+                    std::exit(1);
+                }
+            } else if (arg == "-s") {
+                i++;
+                if (i == argc || IsFlag(argv[i])) {
                     std::cerr << "No input sequence file file provided. Aborting\n";
                     std::exit(1);
                 }
@@ -99,10 +367,11 @@ class ArgumentsParser {
                     std::cerr << "Can't provide both '-s' and '-m' files. Aborting\n";
                     std::exit(1);
                 }
+                sequence_file_provided = true;
                 input_path.assign(argv[i]);
             } else if (arg == "-m") {
                 i++;
-                if (i == argc || argv[i][0] == '-') {
+                if (i == argc || IsFlag(argv[i])) {
                     std::cerr << "No weights matrix file provided. Aborting\n";
                     std::exit(1);
                 }
@@ -115,7 +384,7 @@ class ArgumentsParser {
                 input_path.assign(argv[i]);
             } else if (arg == "-o") {
                 i++;
-                if (i == argc || argv[i][0] == '-') {
+                if (i == argc || IsFlag(argv[i])) {
                     std::cerr << "No valid output path entered. Aborting\n";
                     std::exit(1);
                 }
@@ -129,7 +398,54 @@ class ArgumentsParser {
                 output_format = Format::DNA;
             } else if (arg == "-f") {
                 override_output = true;
-            } else if (!arg.empty() && arg[0] != '-') {
+            } else if (arg == "--split-output") {
+                split_output = true;
+            } else if (arg == "--incremental") {
+                incremental = true;
+            } else if (arg == "--memo") {
+                memo = true;
+            } else if (arg == "--memo-file") {
+                i++;
+                if (i == argc || IsFlag(argv[i])) {
+                    std::cerr << "No memo file provided. Aborting\n";
+                    std::exit(1);
+                }
+                memo = true;
+                memo_path.assign(argv[i]);
+            } else if (arg == "--output-format") {
+                i++;
+                std::string kind = (i < argc) ? argv[i] : "";
+                if (kind == "tsv") {
+                    packed_output = false;
+                } else if (kind == "packed") {
+                    packed_output = true;
+                } else {
+                    std::cerr << "Invalid value for '--output-format' (expected 'tsv' or 'packed'). Aborting\n";
+                    std::exit(1);
+                }
+            } else if (arg == "--compress") {
+                i++;
+                std::string kind = (i < argc) ? argv[i] : "";
+                if (kind == "gz" || kind == "gzip") {
+                    compression = Compression::Gzip;
+                } else if (kind == "zst" || kind == "zstd") {
+                    compression = Compression::Zstd;
+                } else {
+                    std::cerr << "Invalid value for '--compress' (expected 'gz' or 'zst'). Aborting\n";
+                    std::exit(1);
+                }
+#ifndef PWM2BASE_ZSTD
+                if (compression == Compression::Zstd) {
+                    std::cerr << "This build of pwm2base has no zstd support. Aborting\n";
+                    std::exit(1);
+                }
+#endif
+            } else if (arg == "--stats") {
+                stats = true;
+            } else if (arg == "--stats=json") {
+                stats = true;
+                stats_json = true;
+            } else if (!arg.empty() && !IsFlag(argv[i])) {
                 input_path.assign(argv[i]);
             } else {
                 PrintHelp(stderr);
@@ -137,6 +453,58 @@ class ArgumentsParser {
                 std::exit(1);
             }
         }
+
+        // What stdin holds is only known once it's read
+        bool sniffed_input = input_path == "-" && !sequence_file_provided && !matrix_file_provided;
+        if (samples != 0 && !input_path.empty() && !matrix_file_provided && !sniffed_input) {
+            std::cerr << "Sampling ('-n') requires a weights matrix file ('-m'). Aborting\n";
+            std::exit(1);
+        }
+        if (top_k != 0 && !input_path.empty() && !matrix_file_provided && !sniffed_input) {
+            std::cerr << "'--top-k' requires a weights matrix file ('-m'). Aborting\n";
+            std::exit(1);
+        }
+        if (memo && !input_path.empty() && !matrix_file_provided && !sniffed_input) {
+            std::cerr << "'--memo' requires a weights matrix file ('-m'). Aborting\n";
+            std::exit(1);
+        }
+        if (top_k != 0 && samples != 0) {
+            std::cerr << "Can't use both '-n' and '--top-k'. Aborting\n";
+            std::exit(1);
+        }
+        if (packed_output && (samples != 0 || top_k != 0)) {
+            std::cerr << "'--output-format packed' holds one sequence per record; it can't be used with '-n' or '--top-k'. Aborting\n";
+            std::exit(1);
+        }
+        if (packed_output && compression != Compression::None) {
+            std::cerr << "'--output-format packed' files are read memory-mapped and can't be compressed. Aborting\n";
+            std::exit(1);
+        }
+        if (incremental && !seed_provided) {
+            std::cerr << "'--incremental' requires '--seed': the output of a random seed can't be reproduced. Aborting\n";
+            std::exit(1);
+        }
+        if (incremental && (split_output || packed_output || compression != Compression::None || input_path == "-" ||
+                            output_path == "-")) {
+            std::cerr << "'--incremental' writes a plain merged .tsv of a directory; it can't be used with '--split-output',\n"
+                         "'--output-format packed', '--compress', stdin or stdout. Aborting\n";
+            std::exit(1);
+        }
+        if (input_path == "-" && split_output) {
+            std::cerr << "'--split-output' needs input files; it can't be used with stdin ('-'). Aborting\n";
+            std::exit(1);
+        }
+        if (packed_output && (output_path == "-" || (output_path.empty() && input_path == "-"))) {
+            std::cerr << "'--output-format packed' files can't be written to stdout. Aborting\n";
+            std::exit(1);
+        }
+    }
+
+ private:
+    // A lone '-' is a path: stdin or stdout
+    static bool IsFlag(const char *arg)
+    {
+        return arg[0] == '-' && arg[1] != '\0';
     }
 };
 
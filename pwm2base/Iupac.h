@@ -0,0 +1,99 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Iupac_h
+#define Iupac_h
+
+#include "Common.h"
+
+#include <array>
+#include <cstdint>
+
+//
+// Candidate bases for a single input byte. 'size' is the number of valid
+// entries in 'bases'; a size of 1 means the byte maps to a fixed output.
+//
+struct IupacEntry {
+    char bases[4];
+    uint8_t size;
+};
+
+using IupacTable = std::array<IupacEntry, 256>;
+
+//
+// Build the byte -> candidate set table for the given output format. The order
+// of bases inside each set matches the order used by the original switch-based
+// converter, so the same random draw produces the same base.
+//
+constexpr
+IupacTable MakeIupacTable(Format output_format)
+{
+    IupacTable table{};
+    const bool packed = (output_format == Format::Packed);
+    const char a = OutputBasesFor(output_format)[0];
+    const char c = OutputBasesFor(output_format)[1];
+    const char g = OutputBasesFor(output_format)[2];
+    const char t = OutputBasesFor(output_format)[3];
+
+    // Every byte that isn't an IUPAC code stays the same ('A', 'C', 'G', gaps, etc.)
+    for (int i = 0; i < 256; ++i)
+        table[i] = IupacEntry{{static_cast<char>(i), 0, 0, 0}, 1};
+
+    if (packed) {
+        // Only base codes may come out as 0-3; lowercase bases lose their soft-masking
+        for (int i = 0; i < 4; ++i)
+            table[i] = IupacEntry{{'-', 0, 0, 0}, 1};
+        table['a'] = IupacEntry{{a, 0, 0, 0}, 1};
+        table['c'] = IupacEntry{{c, 0, 0, 0}, 1};
+        table['g'] = IupacEntry{{g, 0, 0, 0}, 1};
+        table['t'] = IupacEntry{{t, 0, 0, 0}, 1};
+        table['u'] = IupacEntry{{t, 0, 0, 0}, 1};
+    }
+    table['A'] = IupacEntry{{a, 0, 0, 0}, 1};
+    table['C'] = IupacEntry{{c, 0, 0, 0}, 1};
+    table['G'] = IupacEntry{{g, 0, 0, 0}, 1};
+    table['T'] = IupacEntry{{t, 0, 0, 0}, 1};
+    table['U'] = IupacEntry{{t, 0, 0, 0}, 1};
+
+    table['R'] = IupacEntry{{a, g, 0, 0}, 2};   // A or G
+    table['Y'] = IupacEntry{{c, t, 0, 0}, 2};   // C or T
+    table['S'] = IupacEntry{{g, c, 0, 0}, 2};   // G or C
+    table['W'] = IupacEntry{{a, t, 0, 0}, 2};   // A or T
+    table['K'] = IupacEntry{{g, t, 0, 0}, 2};   // G or T
+    table['M'] = IupacEntry{{a, c, 0, 0}, 2};   // A or C
+    table['B'] = IupacEntry{{c, g, t, 0}, 3};   // C or G or T
+    table['D'] = IupacEntry{{a, g, t, 0}, 3};   // A or G or T
+    table['H'] = IupacEntry{{a, c, t, 0}, 3};   // A or C or T
+    table['V'] = IupacEntry{{a, c, g, 0}, 3};   // A or C or G
+    table['N'] = IupacEntry{{a, t, g, c}, 4};   // any base
+    return table;
+}
+
+constexpr IupacTable kIupacTableDna = MakeIupacTable(Format::DNA);
+constexpr IupacTable kIupacTableRna = MakeIupacTable(Format::RNA);
+constexpr IupacTable kIupacTablePacked = MakeIupacTable(Format::Packed);
+
+constexpr
+const IupacTable& IupacTableFor(Format output_format)
+{
+    switch (output_format) {
+        case Format::DNA: return kIupacTableDna;
+        case Format::Packed: return kIupacTablePacked;
+        default: return kIupacTableRna;
+    }
+}
+
+#endif /* Iupac_h */
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// libpwm2base: the C interface of pwm2base.h. C++ programs may use
+// ConversionContext.h directly.
+//
+
+#include "pwm2base.h"
+#include "ConversionContext.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <vector>
+
+struct pwm2base_context {
+    explicit pwm2base_context(const ConversionOptions& options) : context(options) {}
+
+    ConversionContext context;
+};
+
+static void CopyError(const char *message, char *error, size_t error_capacity)
+{
+    if (error == nullptr || error_capacity == 0)
+        return;
+    size_t size = std::min(strlen(message), error_capacity - 1);
+    memcpy(error, message, size);
+    error[size] = '\0';
+}
+
+extern "C" pwm2base_context *pwm2base_context_create(pwm2base_format format, pwm2base_input input, uint64_t seed)
+{
+    ConversionOptions options;
+    switch (format) {
+        case PWM2BASE_DNA: options.output_format = Format::DNA; break;
+        case PWM2BASE_RNA: options.output_format = Format::RNA; break;
+        case PWM2BASE_CODES: options.output_format = Format::Packed; break;
+        default: return nullptr;
+    }
+    switch (input) {
+        case PWM2BASE_IUPAC: break;
+        case PWM2BASE_WEIGHTS: options.matrix_input = true; break;
+        case PWM2BASE_PFM: options.matrix_input = options.pfm_input = true; break;
+        default: return nullptr;
+    }
+    options.seed = seed;
+
+    try {
+        return new pwm2base_context(options);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+extern "C" void pwm2base_context_destroy(pwm2base_context *context)
+{
+    delete context;
+}
+
+extern "C" uint64_t pwm2base_file_key(const char *relative_path)
+{
+    return relative_path ? FileStreamKey(relative_path) : 0;
+}
+
+extern "C" pwm2base_status pwm2base_convert_batch(pwm2base_context *context,
+                                                  const char *const *sequences, const size_t *sequence_sizes,
+                                                  size_t count, uint64_t file_key, uint64_t first_record,
+                                                  char *output, size_t capacity, size_t *output_sizes,
+                                                  size_t *output_total, char *error, size_t error_capacity)
+{
+    if (context == nullptr || (count != 0 && (sequences == nullptr || sequence_sizes == nullptr ||
+                                              output_sizes == nullptr)) ||
+        (output == nullptr && capacity != 0)) {
+        return PWM2BASE_INVALID_ARGUMENT;
+    }
+
+    try {
+        std::vector<std::string_view> views;
+        views.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+            views.emplace_back(sequences[i], sequence_sizes[i]);
+
+        size_t total = context->context.ConvertBatch(views.data(), count, file_key, first_record,
+                                                     output, capacity, output_sizes);
+        if (output_total != nullptr)
+            *output_total = total;
+        return (total <= capacity) ? PWM2BASE_OK : PWM2BASE_BUFFER_TOO_SMALL;
+    } catch (const MatrixParseError& err) {
+        CopyError(err.what(), error, error_capacity);
+        return PWM2BASE_PARSE_ERROR;
+    } catch (const std::bad_alloc&) {
+        return PWM2BASE_OUT_OF_MEMORY;
+    } catch (const std::exception& err) {
+        CopyError(err.what(), error, error_capacity);
+        return PWM2BASE_INTERNAL_ERROR;
+    } catch (...) {
+        return PWM2BASE_INTERNAL_ERROR;
+    }
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Manifest_h
+#define Manifest_h
+
+#include "MappedFile.h"
+#include "MatrixCache.h"
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//
+// Manifest of an '--incremental' directory conversion, kept next to the
+// output as '<output>.manifest'. It records what every input file was like
+// when it was converted and where its lines are in the output, so the next
+// run only converts the files that changed and copies the lines of the rest.
+//
+// A text file with tab-separated fields:
+//
+//    pwm2base-manifest  kVersion  <options>  <output size>  <output mtime ns>
+//    <offset>  <length>  <size>  <mtime ns>  <hash>  <path>
+//    ...
+//
+// with one line per input file in output (directory) order. <options> sums up
+// the arguments the output depends on; <hash> is pwmbin::Checksum() of the
+// file in hex.
+//
+struct ManifestEntry {
+    std::string path;
+    uint64_t size{0};
+    int64_t mtime_ns{0};
+    uint64_t hash{0};
+    // Lines of the file in the output
+    uint64_t offset{0};
+    uint64_t length{0};
+};
+
+class Manifest {
+ public:
+    static constexpr const char *kSuffix = ".manifest";
+    // 2: records draw from streams keyed by file path rather than position
+    static constexpr uint32_t kVersion = 2;
+
+    std::string options;
+    uint64_t output_size{0};
+    int64_t output_mtime_ns{0};
+    std::vector<ManifestEntry> files;
+
+    // Returns false if there's no manifest at 'path' or it can't be read
+    bool Load(const std::string& path)
+    {
+        FILE *file = fopen(path.c_str(), "r");
+        if (file == nullptr)
+            return false;
+
+        std::string line;
+        bool ok = ReadLine(file, line) && ParseHeader(line);
+        files.clear();
+        while (ok && ReadLine(file, line)) {
+            ManifestEntry entry;
+            int path_start = 0;
+            ok = sscanf(line.c_str(), "%" SCNu64 "\t%" SCNu64 "\t%" SCNu64 "\t%" SCNd64 "\t%" SCNx64 "\t%n",
+                        &entry.offset, &entry.length, &entry.size, &entry.mtime_ns, &entry.hash, &path_start) == 5 &&
+                 path_start > 0;
+            if (ok) {
+                entry.path = line.substr(path_start);
+                files.push_back(std::move(entry));
+            }
+        }
+        ok = ok && !ferror(file);
+        fclose(file);
+        return ok;
+    }
+
+    // Write the manifest atomically (see WriteFileAtomically())
+    bool Save(const std::string& path, std::string& error) const
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "pwm2base-manifest\t%u\t", kVersion);
+        std::string text = line + options;
+        snprintf(line, sizeof(line), "\t%" PRIu64 "\t%" PRId64 "\n", output_size, output_mtime_ns);
+        text += line;
+        for (const auto& entry : files) {
+            snprintf(line, sizeof(line), "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\t%" PRIx64 "\t",
+                     entry.offset, entry.length, entry.size, entry.mtime_ns, entry.hash);
+            text += line;
+            text += entry.path;
+            text += '\n';
+        }
+        return WriteFileAtomically(path, text, error);
+    }
+
+ private:
+    static bool ReadLine(FILE *file, std::string& line)
+    {
+        line.clear();
+        int c;
+        while ((c = fgetc(file)) != EOF && c != '\n')
+            line += static_cast<char>(c);
+        return c != EOF || !line.empty();
+    }
+
+    bool ParseHeader(const std::string& line)
+    {
+        const std::string magic = "pwm2base-manifest\t";
+        if (line.compare(0, magic.size(), magic) != 0)
+            return false;
+        // <options> has no tabs: version, options, output size, output mtime
+        size_t options_start = line.find('\t', magic.size());
+        size_t options_end = line.find('\t', options_start + 1);
+        unsigned version = 0;
+        if (options_start == std::string::npos || options_end == std::string::npos ||
+            sscanf(line.c_str() + magic.size(), "%u", &version) != 1 || version != kVersion ||
+            sscanf(line.c_str() + options_end, "\t%" SCNu64 "\t%" SCNd64, &output_size, &output_mtime_ns) != 2) {
+            return false;
+        }
+        options = line.substr(options_start + 1, options_end - options_start - 1);
+        return true;
+    }
+};
+
+//
+// pwmbin::Checksum() of the contents of a file. Returns false if it can't be read.
+//
+inline bool FileContentHash(const std::string& path, uint64_t& hash)
+{
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    if (!GetFileStamp(path, mtime_ns, size))
+        return false;
+    if (size == 0) {
+        hash = pwmbin::Checksum(nullptr, 0);
+        return true;
+    }
+    auto mapping = MappedFile::Open(path);
+    if (!mapping)
+        return false;
+    hash = pwmbin::Checksum(mapping->data(), mapping->size());
+    return true;
+}
+
+#endif /* Manifest_h */
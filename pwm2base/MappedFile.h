@@ -0,0 +1,153 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+//
+// Modification time (in nanoseconds) and size of a file. Returns false if the
+// file can't be stat'ed.
+//
+inline bool GetFileStamp(const std::string& path, int64_t& mtime_ns, uint64_t& size)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+
+#ifdef __APPLE__
+    mtime_ns = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    mtime_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+    size = static_cast<uint64_t>(info.st_size);
+    return true;
+}
+
+//
+// Create a temporary file next to 'path' (named after it, with a unique
+// suffix) for a new version of it that is then renamed over it. Returns the
+// descriptor, or -1 with 'temporary_path' set to the name tried.
+//
+inline int CreateTemporaryFile(const std::string& path, std::string& temporary_path)
+{
+    temporary_path = path + ".XXXXXX";
+    int fd = mkstemp(&temporary_path[0]);
+    // mkstemp() creates the file for the owner only; the others are made as output files are
+    if (fd >= 0)
+        fchmod(fd, 0644);
+    return fd;
+}
+
+//
+// Replace the file 'path' with 'contents' atomically: they're written to a
+// temporary file of its own (see CreateTemporaryFile()) that is then renamed,
+// so concurrent runs writing the same file never mix their contents. Returns
+// false (with 'error' set) if they couldn't be written; 'path' is left as it
+// was then.
+//
+inline bool WriteFileAtomically(const std::string& path, const std::string& contents, std::string& error)
+{
+    std::string temporary_path;
+    int fd = CreateTemporaryFile(path, temporary_path);
+    FILE *file = (fd >= 0) ? fdopen(fd, "wb") : nullptr;
+    if (file == nullptr) {
+        if (fd >= 0) {
+            close(fd);
+            remove(temporary_path.c_str());
+        }
+        error = "Couldn't create '" + temporary_path + "'";
+        return false;
+    }
+    bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(temporary_path.c_str(), path.c_str()) != 0) {
+        remove(temporary_path.c_str());
+        error = "Couldn't write '" + path + "'";
+        return false;
+    }
+    return true;
+}
+
+//
+// Read-only mapping of a whole file
+//
+class MappedFile {
+ public:
+    static std::unique_ptr<MappedFile> Open(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        size_t size = static_cast<size_t>(info.st_size);
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return nullptr;
+
+        madvise(data, size, MADV_SEQUENTIAL);
+        return std::unique_ptr<MappedFile>(new MappedFile(static_cast<const char *>(data), size));
+    }
+
+    ~MappedFile()
+    {
+        munmap(const_cast<char *>(data_), size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+    //
+    // Drop the pages of ['begin', 'end') that are no longer needed from memory.
+    // The mapping stays valid; they're read from the file again if touched.
+    //
+    void Release(const char *begin, const char *end) const
+    {
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t first = (reinterpret_cast<uintptr_t>(begin) + page - 1) & ~(page - 1);
+        uintptr_t last = reinterpret_cast<uintptr_t>(end) & ~(page - 1);
+        if (first < last)
+            madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+    }
+
+ private:
+    const char *data_;
+    size_t size_;
+
+    MappedFile(const char *data, size_t size) : data_(data), size_(size) {}
+};
+
+#endif /* MappedFile_h */
@@ -0,0 +1,855 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MappedSequenceFile_h
+#define MappedSequenceFile_h
+
+#include "../libgene/source/file/sequence/SequenceFile.hpp"
+#include "../libgene/source/file/sequence/SequenceRecord.hpp"
+#include "../libgene/source/utils/FileUtils.hpp"
+#include "../libgene/source/def/Flags.hpp"
+
+#include "Compression.h"
+#include "MappedFile.h"
+#include "MatrixCache.h"
+#include "MatrixParser.h"
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// A record as a set of spans. For memory-mapped files the spans point straight
+// into the mapping; 'seq' may then still contain the line breaks of a
+// multi-line FASTA record. Records of a .pwmbin cache carry no text, only the
+// 'matrix' and the precomputed 'consensus' of their 'columns' matrix columns.
+//
+// In sampling mode a record is converted in chunks; 'first_sample' and
+// 'sample_count' select the samples of one chunk.
+//
+// A RecordReader told to SplitRecords() hands out a long record in pieces:
+// every piece carries the record's name and desc, 'seq' is the next part of
+// its sequence and 'partial' is set on all pieces but the last.
+//
+struct RecordView {
+    std::string_view name;
+    std::string_view desc;
+    std::string_view seq;
+    const uint8_t *consensus{nullptr};
+    const float *matrix{nullptr};
+    size_t columns{0};
+    uint64_t first_sample{0};
+    uint64_t sample_count{0};
+    bool partial{false};
+};
+
+bool CompileMatrixCache(const std::string& source_path, const std::string& cache_path, std::string& error);
+
+//
+// Record source for the converters. FASTA and plain-text inputs are memory
+// mapped and handed out as spans without any copying; every other format (and
+// any file that can't be mapped) is read through libgene. Compiled .pwmbin
+// matrix caches are recognized by their extension or magic number.
+//
+// gzip and zstd compressed FASTA and plain-text inputs (recognized by their
+// magic number) are decompressed as they're read: records are parsed out of a
+// window of decompressed text that only has to hold the current record.
+// Streams (stdin) are read the same way, compressed or not.
+//
+class RecordReader {
+ public:
+    //
+    // 'fasta_input' forces FASTA parsing regardless of the extension (that's
+    // how matrix files are read). Returns nullptr and sets 'error' if the file
+    // can't be opened.
+    //
+    static std::unique_ptr<RecordReader> Open(const std::string& path, bool fasta_input, std::string& error);
+
+    //
+    // Reader that doesn't open 'path' until Load() (or the first Next()), so
+    // a directory of any size costs no descriptors or buffers up front.
+    // 'on_load' is called as it's opened. Open errors are thrown by Load().
+    //
+    static std::unique_ptr<RecordReader> OpenLazily(const std::string& path, bool fasta_input,
+                                                    std::function<void()> on_load = {});
+
+    //
+    // A new reader of the same file from its first record, opened lazily, with
+    // the same file key and pieces. Only for readers of a file, not a stream.
+    //
+    std::unique_ptr<RecordReader> Reopen() const
+    {
+        auto reader = OpenLazily(path_, fasta_input_);
+        reader->file_key_ = file_key_;
+        reader->piece_size_ = piece_size_;
+        return reader;
+    }
+
+    //
+    // Reader of a stream such as stdin, which has no extension to go by: the
+    // compression and the layout of the records are sniffed from its first
+    // bytes (see matrices()). Takes ownership of 'fd'; 'name' stands in for
+    // the file name.
+    //
+    static std::unique_ptr<RecordReader> OpenStream(int fd, const std::string& name, bool fasta_input,
+                                                    std::string& error);
+
+    //
+    // Open a reader of OpenLazily(). Throws std::runtime_error if the file
+    // can't be opened; does nothing if it's open already.
+    //
+    void Load()
+    {
+        if (!pending_)
+            return;
+        pending_ = false;
+        if (on_load_)
+            on_load_();
+        std::string error;
+        if (!OpenFile(fasta_input_, error)) {
+            closed_ = true;
+            throw std::runtime_error(error);
+        }
+    }
+
+    //
+    // Let go of the file (its mapping, descriptor and buffers) once its
+    // records are no longer needed. Next() returns false from then on.
+    //
+    void Close()
+    {
+        pending_ = false;
+        closed_ = true;
+        file_.reset();
+        mapping_.reset();
+        cache_.reset();
+        stream_.reset();
+        std::string().swap(buffer_);
+        position_ = end_ = nullptr;
+    }
+
+    //
+    // Spans of mapped records stay valid until the reader is closed,
+    // otherwise they're only valid until the next call. Like pfm(), only
+    // known once the reader is loaded.
+    //
+    bool mapped() const
+    {
+        return mapping_ != nullptr || cache_ != nullptr;
+    }
+
+    bool cached() const
+    {
+        return cache_ != nullptr;
+    }
+
+    // Records are JASPAR .pfm counts rather than weights
+    bool pfm() const
+    {
+        return pfm_;
+    }
+
+    //
+    // For a stream: the first record looked like a weight matrix (its first
+    // line is a row of numbers) or JASPAR counts ('A [ 4 19 0 ]') rather
+    // than an IUPAC sequence
+    //
+    bool matrices() const
+    {
+        return matrices_;
+    }
+
+    const std::string& fileName() const
+    {
+        return path_;
+    }
+
+    // Selects the random streams of the file's records (see FileStreamKey())
+    uint64_t file_key() const
+    {
+        return file_key_;
+    }
+
+    void set_file_key(uint64_t file_key)
+    {
+        file_key_ = file_key;
+    }
+
+    //
+    // Hand out FASTA and plain-text records whose sequence is longer than
+    // 'piece_size' in pieces of about that size (see RecordView), so a record
+    // of any length is read through a bounded window: the pages of a mapped
+    // file are released once their piece has been handed out. Only for IUPAC
+    // sequences; a matrix has to be parsed whole.
+    //
+    void SplitRecords(size_t piece_size)
+    {
+        piece_size_ = piece_size;
+    }
+
+    bool Next(RecordView& record)
+    {
+        record.consensus = nullptr;
+        record.matrix = nullptr;
+        record.partial = false;
+        if (pending_)
+            Load();
+        if (closed_)
+            return false;
+        if (cache_)
+            return NextCached(record);
+        if (stream_)
+            return NextStreamed(record);
+        if (!mapping_) {
+            if ((record_ = file_->Read()).Empty())
+                return false;
+            record.name = record_.name;
+            record.desc = record_.desc;
+            record.seq = record_.seq;
+            return true;
+        }
+        if (piece_size_ != 0)
+            return NextMappedPiece(record);
+        return (format_ == InputFormat::Fasta) ? NextFasta(record) : NextLine(record);
+    }
+
+ private:
+    enum class InputFormat {
+        Fasta,
+        Txt,
+        Other
+    };
+
+    std::string path_;
+    uint64_t file_key_{0};
+    // OpenLazily(): the file is opened by Load()
+    bool pending_{false};
+    bool closed_{false};
+    bool fasta_input_{false};
+    std::function<void()> on_load_;
+    InputFormat format_{InputFormat::Other};
+    bool pfm_{false};
+    bool matrices_{false};
+    std::unique_ptr<SequenceFile> file_;
+    std::unique_ptr<MappedFile> mapping_;
+    std::unique_ptr<MatrixCache> cache_;
+    size_t next_motif_{0};
+    const char *position_{nullptr};
+    const char *end_{nullptr};
+    SequenceRecord record_;
+
+    // Compressed input: decompressed text from 'offset_' on is still unread
+    static constexpr size_t kStreamChunkSize = size_t{1} << 20;
+    // Text a stream's layout is sniffed from
+    static constexpr size_t kSniffSize = size_t{64} << 10;
+    std::unique_ptr<Decompressor> stream_;
+    std::string buffer_;
+    size_t offset_{0};
+    // No record ends before 'scanned_'
+    size_t scanned_{0};
+    bool stream_done_{false};
+
+    // Records split in pieces: the sequence of the current one continues at 'position_'
+    size_t piece_size_{0};
+    bool in_pieces_{false};
+    // The last piece ended with a line break, so a '>' at 'position_' starts a header
+    bool piece_line_start_{false};
+    std::string piece_name_;
+    std::string piece_desc_;
+    // Pages of the mapping before this have been released
+    const char *released_{nullptr};
+
+    explicit RecordReader(const std::string& path) : path_(path) {}
+
+    // Open 'path_' for a reader of Open() or OpenLazily()
+    bool OpenFile(bool fasta_input, std::string& error);
+    bool OpenCache(std::string& error);
+
+    static bool IsLineBreak(char c)
+    {
+        return c == '\n' || c == '\r';
+    }
+
+    const char *FindLineEnd(const char *from) const
+    {
+        for (const char *p = from; p < end_; ++p) {
+            if (IsLineBreak(*p))
+                return p;
+        }
+        return end_;
+    }
+
+    void SkipLineBreaks()
+    {
+        while (position_ < end_ && IsLineBreak(*position_))
+            ++position_;
+    }
+
+    // Plain text: every non-empty line is a record without an id
+    bool NextLine(RecordView& record)
+    {
+        SkipLineBreaks();
+        if (position_ == end_)
+            return false;
+
+        const char *line_end = FindLineEnd(position_);
+        record.name = {};
+        record.desc = {};
+        record.seq = std::string_view(position_, line_end - position_);
+        position_ = line_end;
+        return true;
+    }
+
+    // Name and description of the header line ['header', 'header_end') (after the '>')
+    static void ParseHeader(const char *header, const char *header_end, RecordView& record)
+    {
+        const char *name_end = header;
+        while (name_end < header_end && *name_end != ' ' && *name_end != '\t')
+            ++name_end;
+        const char *desc = name_end;
+        while (desc < header_end && (*desc == ' ' || *desc == '\t'))
+            ++desc;
+
+        record.name = std::string_view(header, name_end - header);
+        record.desc = std::string_view(desc, header_end - desc);
+    }
+
+    bool NextFasta(RecordView& record)
+    {
+        // Skip anything before the next header
+        for (;;) {
+            SkipLineBreaks();
+            if (position_ == end_)
+                return false;
+            if (*position_ == '>')
+                break;
+            position_ = FindLineEnd(position_);
+        }
+
+        const char *header = position_ + 1;
+        const char *header_end = FindLineEnd(header);
+        ParseHeader(header, header_end, record);
+
+        // The sequence runs up to the next line starting with '>'
+        const char *seq = header_end;
+        while (seq < end_ && IsLineBreak(*seq))
+            ++seq;
+        if (seq < end_ && *seq == '>') {
+            // Header without a sequence
+            record.seq = std::string_view(seq, 0);
+            position_ = seq;
+            return true;
+        }
+
+        const char *seq_end = seq;
+        while (seq_end < end_) {
+            const char *line_end = FindLineEnd(seq_end);
+            const char *next = line_end;
+            while (next < end_ && IsLineBreak(*next))
+                ++next;
+            seq_end = line_end;
+            if (next == end_ || *next == '>') {
+                position_ = next;
+                break;
+            }
+            seq_end = next;
+        }
+        if (seq_end == end_)
+            position_ = end_;
+
+        record.seq = std::string_view(seq, seq_end - seq);
+        return true;
+    }
+
+    //
+    // The end of the sequence that continues at 'position_', if it's before
+    // 'limit': the next header of a FASTA file, the line break of a text file
+    //
+    const char *FindSequenceEnd(const char *limit) const
+    {
+        if (format_ == InputFormat::Txt) {
+            const char *line_end = std::find_if(position_, limit, IsLineBreak);
+            return (line_end == limit) ? nullptr : line_end;
+        }
+        for (const char *p = position_; p < limit; ++p) {
+            p = static_cast<const char *>(memchr(p, '>', limit - p));
+            if (p == nullptr)
+                break;
+            if (p == position_ ? piece_line_start_ : IsLineBreak(p[-1]))
+                return p;
+        }
+        return nullptr;
+    }
+
+    //
+    // Hand out the next piece of the record being split, from the text in
+    // ['position_', 'end_'). 'more_text' is set if the window isn't all
+    // there is: a piece then only ends the record where its end is seen.
+    //
+    void NextPiece(RecordView& record, bool more_text)
+    {
+        const char *limit = (static_cast<size_t>(end_ - position_) > piece_size_) ? position_ + piece_size_ : end_;
+        const char *piece_end = FindSequenceEnd(limit);
+        record.name = piece_name_;
+        record.desc = piece_desc_;
+        record.partial = piece_end == nullptr && (limit != end_ || more_text);
+        if (piece_end == nullptr)
+            piece_end = limit;
+
+        record.seq = std::string_view(position_, piece_end - position_);
+        if (piece_end > position_)
+            piece_line_start_ = IsLineBreak(piece_end[-1]);
+        in_pieces_ = record.partial;
+        position_ = piece_end;
+    }
+
+    //
+    // Start splitting the record at 'position_' (at or before its header)
+    // and hand out its first piece. Returns false if the window doesn't reach
+    // past the header yet.
+    //
+    bool StartPieces(RecordView& record, bool more_text)
+    {
+        SkipLineBreaks();
+        if (format_ == InputFormat::Fasta) {
+            const char *header = static_cast<const char *>(memchr(position_, '>', end_ - position_));
+            // Text before the first header isn't part of any record
+            while (header != nullptr && header > position_ && !IsLineBreak(header[-1]))
+                header = static_cast<const char *>(memchr(header + 1, '>', end_ - header - 1));
+            if (header == nullptr) {
+                position_ = end_;
+                return false;
+            }
+            const char *header_end = std::find_if(header + 1, end_, IsLineBreak);
+            const char *seq = std::find_if_not(header_end, end_, IsLineBreak);
+            if (seq == end_ && more_text) {
+                position_ = header;
+                return false;
+            }
+            ParseHeader(header + 1, header_end, record);
+            piece_name_.assign(record.name.data(), record.name.size());
+            piece_desc_.assign(record.desc.data(), record.desc.size());
+            position_ = seq;
+        } else {
+            piece_name_.clear();
+            piece_desc_.clear();
+        }
+        piece_line_start_ = true;
+        NextPiece(record, more_text);
+        return true;
+    }
+
+    //
+    // A record whose sequence may end within 'piece_size_' of 'position_'
+    // is read whole, so only long records are split
+    //
+    bool NextMappedPiece(RecordView& record)
+    {
+        if (released_ == nullptr)
+            released_ = mapping_->data();
+        if (!in_pieces_) {
+            SkipLineBreaks();
+            const char *limit = (static_cast<size_t>(end_ - position_) > piece_size_ + 1) ? position_ + piece_size_ + 1 : end_;
+            piece_line_start_ = false;
+            if (position_ == end_ || limit == end_ || (*position_ == '>') != (format_ == InputFormat::Fasta) ||
+                FindSequenceEnd(limit) != nullptr) {
+                return (format_ == InputFormat::Fasta) ? NextFasta(record) : NextLine(record);
+            }
+            StartPieces(record, false);
+        } else {
+            NextPiece(record, false);
+        }
+
+        // The text of the pieces before this one isn't needed again
+        mapping_->Release(released_, record.seq.data());
+        released_ = std::max(released_, record.seq.data());
+        return true;
+    }
+
+    bool NextStreamedPiece(RecordView& record)
+    {
+        while (!stream_done_ && buffer_.size() - offset_ < piece_size_)
+            Refill();
+        position_ = buffer_.data() + offset_;
+        end_ = buffer_.data() + buffer_.size();
+        NextPiece(record, !stream_done_);
+        offset_ = position_ - buffer_.data();
+        scanned_ = offset_;
+        return true;
+    }
+
+    bool NextStreamed(RecordView& record)
+    {
+        if (in_pieces_)
+            return NextStreamedPiece(record);
+
+        size_t record_end;
+        while ((record_end = StreamedRecordEnd()) == std::string::npos && !stream_done_) {
+            if (piece_size_ != 0 && buffer_.size() - offset_ > piece_size_) {
+                // Too long to be read whole
+                position_ = buffer_.data() + offset_;
+                end_ = buffer_.data() + buffer_.size();
+                bool started = StartPieces(record, true);
+                offset_ = position_ - buffer_.data();
+                scanned_ = std::max(scanned_, offset_);
+                if (started) {
+                    scanned_ = offset_;
+                    return true;
+                }
+            }
+            Refill();
+        }
+
+        // Parse the complete record as if it were mapped
+        position_ = buffer_.data() + offset_;
+        end_ = buffer_.data() + (record_end == std::string::npos ? buffer_.size() : record_end);
+        bool found = (format_ == InputFormat::Fasta) ? NextFasta(record) : NextLine(record);
+        offset_ = position_ - buffer_.data();
+        scanned_ = offset_;
+        return found;
+    }
+
+    // End of the record at 'offset_' in the buffer, or npos if more text is needed
+    size_t StreamedRecordEnd()
+    {
+        size_t end;
+        if (format_ == InputFormat::Txt) {
+            size_t start = buffer_.find_first_not_of("\r\n", offset_);
+            end = (start == std::string::npos) ? start : buffer_.find_first_of("\r\n", std::max(start, scanned_));
+        } else {
+            // The record runs from its header up to the next header
+            size_t header = FindHeader(offset_);
+            end = (header == std::string::npos) ? header : FindHeader(std::max(header + 1, scanned_));
+        }
+        if (end == std::string::npos)
+            scanned_ = buffer_.size();
+        return end;
+    }
+
+    // The first '>' at the start of a line from 'from' on
+    size_t FindHeader(size_t from) const
+    {
+        for (size_t p = buffer_.find('>', from); p != std::string::npos; p = buffer_.find('>', p + 1)) {
+            if (p == offset_ || IsLineBreak(buffer_[p - 1]))
+                return p;
+        }
+        return std::string::npos;
+    }
+
+    // Drop the text already parsed and decompress the next chunk
+    void Refill()
+    {
+        if (offset_ > 0) {
+            buffer_.erase(0, offset_);
+            scanned_ -= offset_;
+            offset_ = 0;
+        }
+        size_t size = buffer_.size();
+        buffer_.resize(size + kStreamChunkSize);
+        size_t read = stream_->Read(&buffer_[size], kStreamChunkSize);
+        buffer_.resize(size + read);
+        stream_done_ = (read == 0);
+    }
+
+    // Set 'format_', 'matrices_' and 'pfm_' by the start of the stream
+    void SniffStream(bool fasta_input)
+    {
+        while (!stream_done_ && buffer_.size() < kSniffSize)
+            Refill();
+
+        bool fasta = false;
+        size_t line = buffer_.find_first_not_of("\r\n");
+        if (line != std::string::npos && buffer_[line] == '>') {
+            // The first line of the record after the header
+            fasta = true;
+            line = buffer_.find_first_of("\r\n", line);
+            if (line != std::string::npos)
+                line = buffer_.find_first_not_of("\r\n", line);
+            if (line != std::string::npos && buffer_[line] == '>')
+                line = std::string::npos;
+        }
+
+        if (line != std::string::npos) {
+            char first = buffer_[line];
+            char second = (line + 1 < buffer_.size()) ? buffer_[line + 1] : '\n';
+            size_t token_end = std::min(buffer_.find_first_of(" \t\r\n", line), buffer_.size());
+            std::string_view token(buffer_.data() + line, token_end - line);
+            if (first == '[' || (strchr("ACGTacgt", first) && strchr(" \t[:", second))) {
+                matrices_ = pfm_ = true;
+            } else if (token.find_first_of("0123456789") != std::string_view::npos &&
+                       token.find_first_not_of("0123456789.+-eE") == std::string_view::npos) {
+                matrices_ = true;
+            }
+        }
+        format_ = (fasta_input || fasta || matrices_) ? InputFormat::Fasta : InputFormat::Txt;
+    }
+
+    bool NextCached(RecordView& record)
+    {
+        if (next_motif_ == cache_->size())
+            return false;
+
+        record.name = cache_->id(next_motif_);
+        record.desc = {};
+        record.seq = {};
+        record.consensus = cache_->consensus(next_motif_);
+        record.matrix = cache_->matrix(next_motif_);
+        record.columns = cache_->columns(next_motif_);
+        ++next_motif_;
+        return true;
+    }
+};
+
+inline
+std::unique_ptr<RecordReader> RecordReader::Open(const std::string& path, bool fasta_input, std::string& error)
+{
+    std::unique_ptr<RecordReader> reader(new RecordReader(path));
+    reader->fasta_input_ = fasta_input;
+    if (!reader->OpenFile(fasta_input, error))
+        return nullptr;
+    return reader;
+}
+
+inline
+std::unique_ptr<RecordReader> RecordReader::OpenLazily(const std::string& path, bool fasta_input,
+                                                       std::function<void()> on_load)
+{
+    std::unique_ptr<RecordReader> reader(new RecordReader(path));
+    reader->pending_ = true;
+    reader->fasta_input_ = fasta_input;
+    reader->on_load_ = std::move(on_load);
+    reader->pfm_ = utils::GetExtension(WithoutCompressionExtension(path)) == "pfm";
+    return reader;
+}
+
+inline
+bool RecordReader::OpenFile(bool fasta_input, std::string& error)
+{
+    const std::string& path = path_;
+    std::string extension = utils::GetExtension(WithoutCompressionExtension(path));
+    if (extension == pwmbin::kExtension || pwmbin::HasMagic(path))
+        return OpenCache(error);
+
+    pfm_ = extension == "pfm";
+    if (fasta_input || extension == "fasta" || extension == "fa" || extension == "pfm")
+        format_ = InputFormat::Fasta;
+    else if (extension == "txt")
+        format_ = InputFormat::Txt;
+
+    Compression compression = DetectCompression(path);
+    if (compression != Compression::None) {
+        if (format_ == InputFormat::Other) {
+            error = "Can't read '" + path + "': only FASTA (.fa, .fasta, .pfm) and plain text (.txt) inputs may be compressed";
+            return false;
+        }
+        return (stream_ = Decompressor::Open(path, compression, error)) != nullptr;
+    }
+
+    if (format_ != InputFormat::Other && (mapping_ = MappedFile::Open(path))) {
+        position_ = mapping_->data();
+        end_ = position_ + mapping_->size();
+        return true;
+    }
+
+    auto flags = std::make_unique<CommandLineFlags>();
+    if (fasta_input)
+        flags->SetSetting(Flags::kInputFormat, "fasta");
+    if (!(file_ = SequenceFile::FileWithName(path, flags, OpenMode::Read))) {
+        error = "Couldn't open input file '" + path + "'. Either it doesn't exist, or you don't have permissions to read it";
+        return false;
+    }
+    return true;
+}
+
+inline
+std::unique_ptr<RecordReader> RecordReader::OpenStream(int fd, const std::string& name, bool fasta_input,
+                                                       std::string& error)
+{
+    std::unique_ptr<RecordReader> reader(new RecordReader(name));
+    if (!(reader->stream_ = Decompressor::OpenStream(fd, name, error)))
+        return nullptr;
+    try {
+        reader->SniffStream(fasta_input);
+    } catch (const std::exception& err) {
+        error = err.what();
+        return nullptr;
+    }
+    return reader;
+}
+
+//
+// A cache whose source file has changed since it was compiled is rebuilt in
+// place. If that fails the source file is read instead.
+//
+inline
+bool RecordReader::OpenCache(std::string& error)
+{
+    const std::string path = path_;
+    auto cache = MatrixCache::Open(path, error);
+    if (!cache)
+        return false;
+
+    std::string source_path = cache->source_path();
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    if (!source_path.empty() && GetFileStamp(source_path, mtime_ns, size) &&
+        (mtime_ns != cache->source_mtime_ns() || size != cache->source_size())) {
+        cache.reset();
+        std::string rebuild_error;
+        if (!CompileMatrixCache(source_path, path, rebuild_error) ||
+            !(cache = MatrixCache::Open(path, rebuild_error))) {
+            std::cerr << "Couldn't rebuild the outdated cache '" << path << "': " << rebuild_error
+                      << ". Reading '" << source_path << "' instead\n";
+            path_ = source_path;
+            return OpenFile(true, error);
+        }
+    }
+
+    cache_ = std::move(cache);
+    return true;
+}
+
+//
+// The files of 'directory' (ending with '/') that are converted, in the order
+// they are: those with an input extension, except the sources of compiled
+// caches that are in the directory too (the cache is read instead).
+//
+inline
+std::vector<std::string> DirectoryInputs(const std::string& directory, bool report_skipped)
+{
+    auto directory_contents = utils::GetDirectoryContents(directory);
+    std::set<std::string> contents(directory_contents.begin(), directory_contents.end());
+    std::vector<std::string> inputs;
+    for (const auto& path: directory_contents) {
+        std::string extension = utils::GetExtension(WithoutCompressionExtension(path));
+
+        if (extension != "txt" &&
+            extension != "pfm" &&
+            extension != "fasta" &&
+            extension != "fa" &&
+            extension != "fq" &&
+            extension != pwmbin::kExtension) {
+            // If the extension is none of those skip this file
+            if (report_skipped)
+                std::cerr << "Urecognized file extension '" << extension << "'. Skipping this file\n";
+            continue;
+        }
+        if (contents.count(path + "." + pwmbin::kExtension)) {
+            // The compiled cache next to it is used instead
+            continue;
+        }
+        inputs.push_back(path);
+    }
+    return inputs;
+}
+
+//
+// Parse every matrix of 'reader' (weights, JASPAR counts if it's a .pfm file,
+// or a compiled cache) into 'matrices'. Throws MatrixParseError naming the
+// record that couldn't be parsed.
+//
+inline
+void ReadMatrices(RecordReader& reader, MatrixSet& matrices)
+{
+    pwmbin::MotifKind kind = reader.pfm() ? pwmbin::MotifKind::Pfm : pwmbin::MotifKind::Weights;
+    RecordView record;
+    std::string id;
+    std::vector<std::array<double, 4>> columns;
+    PfmCounts counts;
+
+    try {
+        while (reader.Next(record)) {
+            if (record.matrix) {
+                matrices.Add(record.name, kind, record.matrix, record.consensus, record.columns);
+                continue;
+            }
+            columns.clear();
+
+            if (kind == pwmbin::MotifKind::Pfm) {
+                ParsePfmMatrix(record.seq, counts);
+                for (size_t i = 0; i < counts.columns(); ++i) {
+                    columns.push_back({static_cast<double>(counts.at(0, i)), static_cast<double>(counts.at(1, i)),
+                                       static_cast<double>(counts.at(2, i)), static_cast<double>(counts.at(3, i))});
+                }
+            } else {
+                ParseWeightsMatrix(record.seq, columns);
+            }
+
+            // Same id as the converters print: "<name> <desc>"
+            id.assign(record.name.data(), record.name.size());
+            if (!record.desc.empty()) {
+                id += ' ';
+                id.append(record.desc.data(), record.desc.size());
+            }
+            matrices.Add(id, kind, columns);
+        }
+    } catch (MatrixParseError& parse_error) {
+        parse_error.SetRecord(record.name);
+        throw;
+    }
+}
+
+//
+// Parse every matrix of 'source_path' (a weights file, or JASPAR counts if
+// its extension is .pfm) and store them in the .pwmbin file 'cache_path'.
+//
+inline
+bool CompileMatrixCache(const std::string& source_path, const std::string& cache_path, std::string& error)
+{
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    if (!GetFileStamp(source_path, mtime_ns, size)) {
+        error = "Couldn't open '" + source_path + "'";
+        return false;
+    }
+
+    auto reader = RecordReader::Open(source_path, true, error);
+    if (!reader)
+        return false;
+    if (reader->cached()) {
+        error = "'" + source_path + "' is already compiled";
+        return false;
+    }
+
+    // The absolute path lets the cache find its source from any directory
+    std::string absolute_path = source_path;
+    if (char *resolved = realpath(source_path.c_str(), nullptr)) {
+        absolute_path = resolved;
+        free(resolved);
+    }
+
+    MatrixCacheWriter writer;
+    try {
+        ReadMatrices(*reader, writer);
+    } catch (MatrixParseError& parse_error) {
+        parse_error.SetFile(source_path);
+        error = parse_error.what();
+        return false;
+    }
+    return writer.Write(cache_path, absolute_path, mtime_ns, size, error);
+}
+
+#endif /* MappedSequenceFile_h */
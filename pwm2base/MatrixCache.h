@@ -0,0 +1,394 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MatrixCache_h
+#define MatrixCache_h
+
+#include "MappedFile.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// .pwmbin -- precompiled matrices of one weight/.pfm source file.
+//
+// All integers are little-endian. The file is laid out as:
+//
+//    Header
+//    MotifEntry[motif_count]
+//    float[column_count][4]     column-major A, C, G, T values of every motif
+//    uint8_t[column_count]      argmax (0-3) of every column, kNoConsensus if all <= 0
+//    char[]                     ids, followed by the source path
+//
+// The checksum covers everything after the header. The source file's mtime
+// and size are recorded, so a stale cache can be detected and rebuilt.
+//
+namespace pwmbin {
+
+constexpr char kMagic[8] = {'P', 'W', 'M', 'B', 'I', 'N', '\r', '\n'};
+constexpr uint32_t kVersion = 1;
+constexpr uint8_t kNoConsensus = 0xFF;
+constexpr const char *kExtension = "pwmbin";
+
+enum class MotifKind : uint32_t {
+    Weights = 0,
+    Pfm = 1
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t motif_count;
+    uint64_t column_count;
+    int64_t source_mtime_ns;
+    uint64_t source_size;
+    uint64_t motifs_offset;
+    uint64_t matrix_offset;
+    uint64_t consensus_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t source_path_offset;
+    uint64_t source_path_size;
+    uint64_t file_size;
+    uint64_t checksum;
+};
+
+struct MotifEntry {
+    uint64_t id_offset;
+    uint32_t id_size;
+    MotifKind kind;
+    uint64_t first_column;
+    uint64_t column_count;
+};
+
+//
+// 64-bit multiplicative hash over 8-byte words. Not cryptographic; it only has
+// to catch truncated or corrupted caches.
+//
+inline uint64_t Checksum(const char *data, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; ++i)
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 0x100000001B3ULL;
+    return hash;
+}
+
+inline size_t AlignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+inline bool HasMagic(const std::string& path)
+{
+    char magic[sizeof(kMagic)];
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+    bool matches = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                   memcmp(magic, kMagic, sizeof(magic)) == 0;
+    fclose(file);
+    return matches;
+}
+
+} // namespace pwmbin
+
+//
+// Column argmax with the converters' rule: the first strictly greatest
+// positive value wins, and a column without positive values has no consensus.
+//
+template<typename T>
+uint8_t ConsensusIndex(const T *weights)
+{
+    T max_weight = 0;
+    uint8_t arg_max = pwmbin::kNoConsensus;
+    for (uint8_t i = 0; i < 4; ++i) {
+        if (weights[i] > max_weight) {
+            arg_max = i;
+            max_weight = weights[i];
+        }
+    }
+    return arg_max;
+}
+
+//
+// Read-only view of a memory-mapped .pwmbin file
+//
+class MatrixCache {
+ public:
+    static std::unique_ptr<MatrixCache> Open(const std::string& path, std::string& error)
+    {
+        auto mapping = MappedFile::Open(path);
+        if (!mapping) {
+            error = "Couldn't open '" + path + "'";
+            return nullptr;
+        }
+
+        std::unique_ptr<MatrixCache> cache(new MatrixCache(std::move(mapping)));
+        if (!cache->Validate(error)) {
+            error = "'" + path + "' is not a valid ." + pwmbin::kExtension + " file: " + error;
+            return nullptr;
+        }
+        return cache;
+    }
+
+    size_t size() const
+    {
+        return static_cast<size_t>(header_.motif_count);
+    }
+
+    std::string_view id(size_t motif) const
+    {
+        return std::string_view(strings_ + motifs_[motif].id_offset, motifs_[motif].id_size);
+    }
+
+    pwmbin::MotifKind kind(size_t motif) const
+    {
+        return motifs_[motif].kind;
+    }
+
+    size_t columns(size_t motif) const
+    {
+        return static_cast<size_t>(motifs_[motif].column_count);
+    }
+
+    // columns(motif) x 4 values
+    const float *matrix(size_t motif) const
+    {
+        return matrix_ + motifs_[motif].first_column * 4;
+    }
+
+    const uint8_t *consensus(size_t motif) const
+    {
+        return consensus_ + motifs_[motif].first_column;
+    }
+
+    std::string source_path() const
+    {
+        return std::string(strings_ + header_.source_path_offset, header_.source_path_size);
+    }
+
+    int64_t source_mtime_ns() const { return header_.source_mtime_ns; }
+    uint64_t source_size() const { return header_.source_size; }
+
+ private:
+    std::unique_ptr<MappedFile> mapping_;
+    pwmbin::Header header_;
+    const pwmbin::MotifEntry *motifs_{nullptr};
+    const float *matrix_{nullptr};
+    const uint8_t *consensus_{nullptr};
+    const char *strings_{nullptr};
+
+    explicit MatrixCache(std::unique_ptr<MappedFile> mapping) : mapping_(std::move(mapping)) {}
+
+    bool Validate(std::string& error)
+    {
+        const char *data = mapping_->data();
+        const uint64_t size = mapping_->size();
+
+        if (size < sizeof(header_) || memcmp(data, pwmbin::kMagic, sizeof(pwmbin::kMagic)) != 0) {
+            error = "bad magic number";
+            return false;
+        }
+        memcpy(&header_, data, sizeof(header_));
+        if (header_.version != pwmbin::kVersion || header_.header_size != sizeof(header_)) {
+            error = "unsupported version " + std::to_string(header_.version);
+            return false;
+        }
+        if (header_.file_size != size) {
+            error = "truncated file";
+            return false;
+        }
+
+        auto section_fits = [size](uint64_t offset, uint64_t count, uint64_t item_size) {
+            return offset <= size && (item_size == 0 || count <= (size - offset) / item_size);
+        };
+        if (!section_fits(header_.motifs_offset, header_.motif_count, sizeof(pwmbin::MotifEntry)) ||
+            !section_fits(header_.matrix_offset, header_.column_count, 4 * sizeof(float)) ||
+            !section_fits(header_.consensus_offset, header_.column_count, 1) ||
+            !section_fits(header_.strings_offset, header_.strings_size, 1) ||
+            header_.motifs_offset % alignof(pwmbin::MotifEntry) != 0 ||
+            header_.matrix_offset % alignof(float) != 0) {
+            error = "section out of bounds";
+            return false;
+        }
+        if (pwmbin::Checksum(data + sizeof(header_), size - sizeof(header_)) != header_.checksum) {
+            error = "checksum mismatch";
+            return false;
+        }
+
+        motifs_ = reinterpret_cast<const pwmbin::MotifEntry *>(data + header_.motifs_offset);
+        matrix_ = reinterpret_cast<const float *>(data + header_.matrix_offset);
+        consensus_ = reinterpret_cast<const uint8_t *>(data + header_.consensus_offset);
+        strings_ = data + header_.strings_offset;
+
+        if (header_.source_path_offset + header_.source_path_size > header_.strings_size) {
+            error = "section out of bounds";
+            return false;
+        }
+        for (uint64_t i = 0; i < header_.motif_count; ++i) {
+            const auto& motif = motifs_[i];
+            if (motif.id_offset + motif.id_size > header_.strings_size ||
+                motif.first_column + motif.column_count > header_.column_count) {
+                error = "motif " + std::to_string(i) + " out of bounds";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+//
+// Parsed matrices held in memory, laid out as in a .pwmbin file
+//
+class MatrixSet {
+ public:
+    void Add(std::string_view id, pwmbin::MotifKind kind, const std::vector<std::array<double, 4>>& columns)
+    {
+        AddMotif(id, kind, columns.size());
+        for (const auto& column : columns) {
+            for (double value : column)
+                matrix_.push_back(static_cast<float>(value));
+            // Computed on the parsed values, so the cache gives the same consensus as the text
+            consensus_.push_back(ConsensusIndex(column.data()));
+        }
+    }
+
+    // A motif of a MatrixCache, which has its consensus already
+    void Add(std::string_view id, pwmbin::MotifKind kind, const float *matrix, const uint8_t *consensus, size_t columns)
+    {
+        AddMotif(id, kind, columns);
+        matrix_.insert(matrix_.end(), matrix, matrix + 4 * columns);
+        consensus_.insert(consensus_.end(), consensus, consensus + columns);
+    }
+
+    size_t size() const
+    {
+        return motifs_.size();
+    }
+
+    std::string_view id(size_t motif) const
+    {
+        return std::string_view(strings_).substr(motifs_[motif].id_offset, motifs_[motif].id_size);
+    }
+
+    pwmbin::MotifKind kind(size_t motif) const
+    {
+        return motifs_[motif].kind;
+    }
+
+    size_t columns(size_t motif) const
+    {
+        return static_cast<size_t>(motifs_[motif].column_count);
+    }
+
+    size_t column_count() const
+    {
+        return consensus_.size();
+    }
+
+    // columns(motif) x 4 values
+    const float *matrix(size_t motif) const
+    {
+        return matrix_.data() + motifs_[motif].first_column * 4;
+    }
+
+    const uint8_t *consensus(size_t motif) const
+    {
+        return consensus_.data() + motifs_[motif].first_column;
+    }
+
+ protected:
+    std::vector<pwmbin::MotifEntry> motifs_;
+    std::vector<float> matrix_;
+    std::vector<uint8_t> consensus_;
+    std::string strings_;
+
+ private:
+    void AddMotif(std::string_view id, pwmbin::MotifKind kind, size_t columns)
+    {
+        pwmbin::MotifEntry motif{};
+        motif.id_offset = strings_.size();
+        motif.id_size = static_cast<uint32_t>(id.size());
+        motif.kind = kind;
+        motif.first_column = consensus_.size();
+        motif.column_count = columns;
+        motifs_.push_back(motif);
+        strings_.append(id.data(), id.size());
+    }
+};
+
+//
+// Collects parsed matrices and writes them out as a .pwmbin file
+//
+class MatrixCacheWriter : public MatrixSet {
+ public:
+    //
+    // Write the cache atomically (see WriteFileAtomically())
+    //
+    bool Write(const std::string& path, const std::string& source_path,
+               int64_t source_mtime_ns, uint64_t source_size, std::string& error) const
+    {
+        std::string strings = strings_;
+        pwmbin::Header header{};
+        memcpy(header.magic, pwmbin::kMagic, sizeof(header.magic));
+        header.version = pwmbin::kVersion;
+        header.header_size = sizeof(header);
+        header.motif_count = motifs_.size();
+        header.column_count = consensus_.size();
+        header.source_mtime_ns = source_mtime_ns;
+        header.source_size = source_size;
+        header.source_path_offset = strings.size();
+        header.source_path_size = source_path.size();
+        strings += source_path;
+
+        header.motifs_offset = pwmbin::AlignUp(sizeof(header), 64);
+        header.matrix_offset = pwmbin::AlignUp(header.motifs_offset + motifs_.size() * sizeof(pwmbin::MotifEntry), 64);
+        header.consensus_offset = header.matrix_offset + matrix_.size() * sizeof(float);
+        header.strings_offset = header.consensus_offset + consensus_.size();
+        header.strings_size = strings.size();
+        header.file_size = header.strings_offset + strings.size();
+
+        std::string image(header.file_size, '\0');
+        if (!motifs_.empty())
+            memcpy(&image[header.motifs_offset], motifs_.data(), motifs_.size() * sizeof(pwmbin::MotifEntry));
+        if (!matrix_.empty())
+            memcpy(&image[header.matrix_offset], matrix_.data(), matrix_.size() * sizeof(float));
+        if (!consensus_.empty())
+            memcpy(&image[header.consensus_offset], consensus_.data(), consensus_.size());
+        if (!strings.empty())
+            memcpy(&image[header.strings_offset], strings.data(), strings.size());
+        header.checksum = pwmbin::Checksum(image.data() + sizeof(header), image.size() - sizeof(header));
+        memcpy(&image[0], &header, sizeof(header));
+
+        return WriteFileAtomically(path, image, error);
+    }
+};
+
+#endif /* MatrixCache_h */
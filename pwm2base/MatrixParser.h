@@ -0,0 +1,269 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MatrixParser_h
+#define MatrixParser_h
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// Malformed weight or PFM matrix. The parser knows the column; the record id
+// and the file name are filled in by the callers as the error travels up.
+//
+class MatrixParseError : public std::runtime_error {
+ public:
+    MatrixParseError(size_t column, const std::string& reason)
+    : std::runtime_error(reason), column_(column), reason_(reason)
+    {
+        Compose();
+    }
+
+    void SetRecord(std::string_view record)
+    {
+        record_.assign(record.data(), record.size());
+        Compose();
+    }
+
+    void SetFile(const std::string& file)
+    {
+        file_ = file;
+        Compose();
+    }
+
+    const char *what() const noexcept override
+    {
+        return message_.c_str();
+    }
+
+ private:
+    size_t column_;
+    std::string reason_;
+    std::string record_;
+    std::string file_;
+    std::string message_;
+
+    void Compose()
+    {
+        message_.clear();
+        if (!file_.empty())
+            message_ += "File '" + file_ + "', ";
+        if (!record_.empty())
+            message_ += "record '" + record_ + "', ";
+        message_ += "column " + std::to_string(column_) + ": " + reason_;
+    }
+};
+
+namespace matrix_parser {
+
+inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline std::string_view Trim(std::string_view text)
+{
+    while (!text.empty() && IsBlank(text.front()))
+        text.remove_prefix(1);
+    while (!text.empty() && IsBlank(text.back()))
+        text.remove_suffix(1);
+    return text;
+}
+
+//
+// Parse the whole of 'token' as a double. Older standard libraries lack the
+// floating-point std::from_chars overloads; strtod on a bounded stack copy
+// is used there instead.
+//
+inline bool ParseDouble(std::string_view token, double& value)
+{
+    if (!token.empty() && token.front() == '+')
+        token.remove_prefix(1);
+    if (token.empty())
+        return false;
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    return result.ec == std::errc() && result.ptr == token.data() + token.size();
+#else
+    char buffer[64];
+    if (token.size() >= sizeof(buffer))
+        return false;
+    memcpy(buffer, token.data(), token.size());
+    buffer[token.size()] = '\0';
+
+    char *end = nullptr;
+    value = std::strtod(buffer, &end);
+    return end == buffer + token.size();
+#endif
+}
+
+} // namespace matrix_parser
+
+//
+// Weights separated by tabs or line breaks, four values (A, C, G, T) per
+// matrix column. Values are appended to 'columns'; empty fields are ignored.
+//
+inline void ParseWeightsMatrix(std::string_view text, std::vector<std::array<double, 4>>& columns)
+{
+    std::array<double, 4> column;
+    size_t filled = 0;
+
+    while (!text.empty()) {
+        size_t separator = text.find_first_of("\t\r\n");
+        std::string_view token = matrix_parser::Trim(text.substr(0, separator));
+        text.remove_prefix(separator == std::string_view::npos ? text.size() : separator + 1);
+        if (token.empty())
+            continue;
+
+        if (!matrix_parser::ParseDouble(token, column[filled])) {
+            throw MatrixParseError(columns.size() + 1,
+                                   "expected a number for base " + std::string(1, "ACGT"[filled]) +
+                                   ", got '" + std::string(token) + "'");
+        }
+        if (++filled == 4) {
+            columns.push_back(column);
+            filled = 0;
+        }
+    }
+
+    if (filled != 0) {
+        throw MatrixParseError(columns.size() + 1,
+                               "incomplete column: " + std::to_string(filled) + " of 4 values");
+    }
+}
+
+//
+// The counts of a .pfm matrix in one block, row after row (A, C, G, T).
+// clear() keeps the capacity, so a converter reuses a single PfmCounts for
+// every record it parses.
+//
+class PfmCounts {
+ public:
+    void clear()
+    {
+        values_.clear();
+        row_start_.fill(0);
+    }
+
+    size_t columns() const
+    {
+        return row_start_[1];
+    }
+
+    int at(size_t row, size_t column) const
+    {
+        return values_[row_start_[row] + column];
+    }
+
+    // The columns() counts of a row
+    const int *row(size_t row) const
+    {
+        return values_.data() + row_start_[row];
+    }
+
+ private:
+    friend void ParsePfmMatrix(std::string_view text, PfmCounts& counts);
+
+    std::vector<int> values_;
+    // Row r holds values_[row_start_[r] .. row_start_[r + 1])
+    std::array<size_t, 5> row_start_{};
+
+    size_t RowSize(size_t row) const
+    {
+        return row_start_[row + 1] - row_start_[row];
+    }
+};
+
+//
+// JASPAR .pfm counts:
+//
+//    A  [ 4 19  0 ]
+//    C  [16  0 20 ]
+//    ...
+//
+// The base letters and brackets are optional separators; a ']' closes a row.
+// 'counts' is cleared first.
+//
+inline void ParsePfmMatrix(std::string_view text, PfmCounts& counts)
+{
+    const char *p = text.data();
+    const char *end = p + text.size();
+    std::vector<int>& values = counts.values_;
+
+    counts.clear();
+    for (size_t row = 0; row < 4; ++row) {
+        size_t row_start = values.size();
+        bool opened = false;
+
+        while (p < end) {
+            char c = *p;
+            if (matrix_parser::IsBlank(c)) {
+                ++p;
+            } else if (c == '[') {
+                opened = true;
+                ++p;
+            } else if (c == ']') {
+                ++p;
+                break;
+            } else if (std::isalpha(static_cast<unsigned char>(c)) && !opened && values.size() == row_start) {
+                // Base letter in front of the row ('A', 'C:' ...)
+                ++p;
+                if (p < end && *p == ':')
+                    ++p;
+            } else {
+                int value = 0;
+                auto result = std::from_chars(p + (c == '+'), end, value);
+                if (result.ec != std::errc()) {
+                    const char *token_end = p;
+                    while (token_end < end && !matrix_parser::IsBlank(*token_end) && *token_end != ']')
+                        ++token_end;
+                    throw MatrixParseError(values.size() - row_start + 1,
+                                           "expected a count for base " + std::string(1, "ACGT"[row]) +
+                                           ", got '" + std::string(p, token_end) + "'");
+                }
+                p = result.ptr;
+                // Fractional counts are truncated
+                if (p < end && *p == '.') {
+                    ++p;
+                    while (p < end && std::isdigit(static_cast<unsigned char>(*p)))
+                        ++p;
+                }
+                values.push_back(value);
+            }
+        }
+        counts.row_start_[row + 1] = values.size();
+    }
+
+    for (size_t row = 1; row < 4; ++row) {
+        if (counts.RowSize(row) != counts.RowSize(0)) {
+            throw MatrixParseError(std::min(counts.RowSize(row), counts.RowSize(0)) + 1,
+                                   "row " + std::string(1, "ACGT"[row]) + " has " +
+                                   std::to_string(counts.RowSize(row)) + " counts, row A has " +
+                                   std::to_string(counts.RowSize(0)));
+        }
+    }
+}
+
+#endif /* MatrixParser_h */
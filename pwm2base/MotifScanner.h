@@ -0,0 +1,569 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MotifScanner_h
+#define MotifScanner_h
+
+#include "MappedFile.h"
+#include "PwmConverter.h"
+#include "ThreadPool.h"
+#include "TsvWriter.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace scan {
+
+// Base codes of an encoded genome; every other symbol (N, IUPAC codes) is kOther
+constexpr uint8_t kOther = 4;
+// Score of a kOther base: no window containing one ever passes a threshold
+constexpr float kOtherScore = -1e9f;
+// Score table row of a matrix column: A, C, G, T, then kOther padding
+constexpr size_t kRowSize = 8;
+
+constexpr std::array<uint8_t, 256> MakeBaseCodes()
+{
+    std::array<uint8_t, 256> codes{};
+    for (auto& code : codes)
+        code = kOther;
+    codes['A'] = codes['a'] = 0;
+    codes['C'] = codes['c'] = 1;
+    codes['G'] = codes['g'] = 2;
+    codes['T'] = codes['t'] = 3;
+    codes['U'] = codes['u'] = 3;
+    return codes;
+}
+constexpr std::array<uint8_t, 256> kBaseCodes = MakeBaseCodes();
+
+// Uniform background; weights that aren't log-odds already become log2(p / 0.25)
+constexpr double kBackground = 0.25;
+// Share of the uniform distribution mixed into every column, so no base scores -inf
+constexpr double kPseudoFraction = 0.01;
+// Upper bound of the score distribution size used for p-values
+constexpr size_t kDistributionBins = 10000;
+
+} // namespace scan
+
+//
+// Log-odds score table of one motif. 'forward' and 'reverse' hold kRowSize
+// floats per column; 'reverse' scores the reverse complement strand with the
+// same left-to-right pass over the genome.
+//
+struct ScoreMatrix {
+    std::string id;
+    size_t length{0};
+    std::vector<float> forward;
+    std::vector<float> reverse;
+    float threshold{0.0f};
+    // Hits also need a p-value of at most this
+    double max_p_value{1.0};
+
+    // Scores rounded to 1 / resolution: 'steps' of every column (A, C, G, T)
+    // and P(rounded score >= min_score + i) of uniform random sequences
+    double resolution{0.0};
+    std::vector<std::array<int64_t, 4>> steps;
+    std::vector<double> tail;
+    int64_t min_score{0};
+
+    //
+    // Columns of A, C, G, T weights. A matrix with a negative value is taken
+    // to be log-odds already; any other matrix holds counts or frequencies,
+    // which are normalized per column.
+    //
+    static ScoreMatrix FromColumns(const std::string& id, const std::vector<std::array<double, 4>>& columns)
+    {
+        bool log_odds = false;
+        for (const auto& column : columns) {
+            for (double weight : column)
+                log_odds = log_odds || weight < 0;
+        }
+
+        ScoreMatrix matrix;
+        matrix.id = id;
+        matrix.length = columns.size();
+        matrix.forward.assign(matrix.length * scan::kRowSize, scan::kOtherScore);
+        matrix.reverse.assign(matrix.length * scan::kRowSize, scan::kOtherScore);
+        for (size_t j = 0; j < matrix.length; ++j) {
+            const auto& column = columns[j];
+            double total = column[0] + column[1] + column[2] + column[3];
+            for (size_t base = 0; base < 4; ++base) {
+                double score = column[base];
+                if (!log_odds) {
+                    double p = (total > 0) ? column[base] / total : scan::kBackground;
+                    p = (1 - scan::kPseudoFraction) * p + scan::kPseudoFraction * scan::kBackground;
+                    score = std::log2(p / scan::kBackground);
+                }
+                matrix.forward[j * scan::kRowSize + base] = static_cast<float>(score);
+                matrix.reverse[(matrix.length - 1 - j) * scan::kRowSize + (3 - base)] = static_cast<float>(score);
+            }
+        }
+        return matrix;
+    }
+
+    //
+    // Distribution of the rounded scores of uniform random sequences, on a
+    // grid of at most scan::kDistributionBins steps
+    //
+    void ComputeDistribution()
+    {
+        double low = 0, high = 0;
+        for (size_t j = 0; j < length; ++j) {
+            const float *row = &forward[j * scan::kRowSize];
+            low += *std::min_element(row, row + 4);
+            high += *std::max_element(row, row + 4);
+        }
+        resolution = (high > low) ? std::min(100.0, scan::kDistributionBins / (high - low)) : 100.0;
+
+        steps.resize(length);
+        int64_t range_low = 0, range_high = 0;
+        for (size_t j = 0; j < length; ++j) {
+            for (size_t base = 0; base < 4; ++base)
+                steps[j][base] = std::llround(forward[j * scan::kRowSize + base] * resolution);
+            // Partial sums of the columns stay in the range as well
+            range_low += std::min<int64_t>(0, *std::min_element(steps[j].begin(), steps[j].end()));
+            range_high += std::max<int64_t>(0, *std::max_element(steps[j].begin(), steps[j].end()));
+        }
+
+        // probability[s] = P(score == s + range_low) over the columns so far
+        std::vector<double> probability(static_cast<size_t>(range_high - range_low) + 1, 0.0);
+        std::vector<double> next(probability.size());
+        probability[static_cast<size_t>(-range_low)] = 1.0;
+        for (size_t j = 0; j < length; ++j) {
+            std::fill(next.begin(), next.end(), 0.0);
+            for (size_t s = 0; s < probability.size(); ++s) {
+                if (probability[s] == 0.0)
+                    continue;
+                for (size_t base = 0; base < 4; ++base) {
+                    int64_t target = static_cast<int64_t>(s) + steps[j][base];
+                    if (target >= 0 && target < static_cast<int64_t>(next.size()))
+                        next[static_cast<size_t>(target)] += scan::kBackground * probability[s];
+                }
+            }
+            probability.swap(next);
+        }
+
+        tail.assign(probability.size(), 0.0);
+        double sum = 0.0;
+        for (size_t s = probability.size(); s-- > 0;) {
+            sum += probability[s];
+            tail[s] = std::min(1.0, sum);
+        }
+        min_score = range_low;
+    }
+
+    // Rounded score of the window starting at 'window' on the given strand
+    int64_t RoundedScore(const uint8_t *window, char strand) const
+    {
+        int64_t score = 0;
+        for (size_t j = 0; j < length; ++j) {
+            score += (strand == '+') ? steps[j][window[j]]
+                                     : steps[length - 1 - j][3 - window[j]];
+        }
+        return score;
+    }
+
+    double PValue(int64_t rounded_score) const
+    {
+        int64_t bin = rounded_score - min_score;
+        if (bin < 0)
+            return 1.0;
+        if (bin >= static_cast<int64_t>(tail.size()))
+            return 0.0;
+        return tail[static_cast<size_t>(bin)];
+    }
+
+    //
+    // Report windows with a p-value of at most 'p_value'. The float threshold
+    // lets through every window whose rounded score could pass (rounding moves
+    // a score by up to length / 2 steps); the scanner checks the rest.
+    //
+    void SetPValue(double p_value)
+    {
+        max_p_value = p_value;
+        threshold = std::numeric_limits<float>::infinity();
+        for (size_t s = 0; s < tail.size(); ++s) {
+            if (tail[s] <= p_value) {
+                threshold = static_cast<float>((static_cast<double>(s) + min_score - 0.5 * (length + 1)) / resolution);
+                break;
+            }
+        }
+    }
+};
+
+struct ScanHit {
+    uint64_t position;
+    uint32_t motif;
+    char strand;
+    float score;
+
+    bool operator<(const ScanHit& other) const
+    {
+        if (position != other.position)
+            return position < other.position;
+        if (motif != other.motif)
+            return motif < other.motif;
+        return strand < other.strand;
+    }
+};
+
+//
+// Score every window start in [0, count) of 'codes' against one strand's
+// table and append the windows scoring at least 'threshold' to 'hits'.
+// 'codes' holds count + length - 1 bases.
+//
+using ScanKernel = void (*)(const float *table, size_t length, const uint8_t *codes, size_t count,
+                            float threshold, uint32_t motif, char strand, std::vector<ScanHit>& hits);
+
+// Window starts in [begin, end)
+inline void ScanRange(const float *table, size_t length, const uint8_t *codes, size_t begin, size_t end,
+                      float threshold, uint32_t motif, char strand, std::vector<ScanHit>& hits)
+{
+    for (size_t p = begin; p < end; ++p) {
+        float score = 0.0f;
+        for (size_t j = 0; j < length; ++j)
+            score += table[j * scan::kRowSize + codes[p + j]];
+        if (score >= threshold)
+            hits.push_back(ScanHit{p, motif, strand, score});
+    }
+}
+
+inline void ScanScalar(const float *table, size_t length, const uint8_t *codes, size_t count,
+                       float threshold, uint32_t motif, char strand, std::vector<ScanHit>& hits)
+{
+    ScanRange(table, length, codes, 0, count, threshold, motif, strand, hits);
+}
+
+#if PWM2BASE_X86
+//
+// Eight window starts at a time: the codes of column j of the eight windows
+// are widened to lane indices and looked up in the column's row of the table
+// with one permute.
+//
+__attribute__((target("avx2")))
+inline void ScanAvx2(const float *table, size_t length, const uint8_t *codes, size_t count,
+                     float threshold, uint32_t motif, char strand, std::vector<ScanHit>& hits)
+{
+    const __m256 limit = _mm256_set1_ps(threshold);
+    size_t p = 0;
+    for (; p + 8 <= count; p += 8) {
+        __m256 score = _mm256_setzero_ps();
+        for (size_t j = 0; j < length; ++j) {
+            __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(codes + p + j)));
+            score = _mm256_add_ps(score, _mm256_permutevar8x32_ps(_mm256_loadu_ps(table + j * scan::kRowSize), index));
+        }
+        unsigned passed = static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(score, limit, _CMP_GE_OQ)));
+        if (passed != 0) {
+            alignas(32) float scores[8];
+            _mm256_store_ps(scores, score);
+            while (passed != 0) {
+                unsigned lane = static_cast<unsigned>(__builtin_ctz(passed));
+                hits.push_back(ScanHit{p + lane, motif, strand, scores[lane]});
+                passed &= passed - 1;
+            }
+        }
+    }
+    ScanRange(table, length, codes, p, count, threshold, motif, strand, hits);
+}
+#endif
+
+inline ScanKernel SelectScanKernel()
+{
+#if PWM2BASE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ScanAvx2;
+#endif
+    return ScanScalar;
+}
+
+//
+// Scans a (memory mapped) genome FASTA with a set of motifs on both strands.
+// A reader thread encodes the genome into chunks of kChunkSize window starts
+// (plus the overlap the longest motif needs), pool workers score and format
+// the chunks, and the calling thread writes their hits in genome order.
+//
+class GenomeScanner {
+ public:
+    static constexpr size_t kChunkSize = size_t{1} << 20;
+
+    // 'tsv' selects the TSV output over BED
+    GenomeScanner(std::vector<ScoreMatrix> motifs, unsigned threads, bool tsv)
+    : pool_(threads),
+      motifs_(std::move(motifs)),
+      kernel_(SelectScanKernel()),
+      tsv_(tsv),
+      max_in_flight_(std::max(2u, threads) * 4)
+    {
+        for (const auto& motif : motifs_)
+            overlap_ = std::max(overlap_, motif.length ? motif.length - 1 : 0);
+    }
+
+    // Returns the number of hits written
+    uint64_t Run(const MappedFile& genome, TsvWriter& out_file)
+    {
+        if (tsv_)
+            out_file.Write("#chrom\tstart\tend\tstrand\tmotif\tscore\tp_value\tsequence\n");
+
+        std::thread reader([this, &genome] { Read(genome); });
+
+        size_t next = 0;
+        uint64_t hits = 0;
+        for (;;) {
+            std::shared_ptr<Chunk> chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [&] {
+                    return error_ || done_.count(next) || (reading_finished_ && next == chunks_read_);
+                });
+                if (error_ || !done_.count(next))
+                    break;
+                chunk = std::move(done_[next]);
+                done_.erase(next);
+            }
+
+            out_file.Write(chunk->output);
+            hits += chunk->hit_count;
+            ++next;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --in_flight_;
+            }
+            changed_.notify_all();
+        }
+
+        reader.join();
+        pool_.Wait();
+        if (error_)
+            std::rethrow_exception(error_);
+        return hits;
+    }
+
+ private:
+    struct Chunk {
+        size_t index;
+        std::shared_ptr<const std::string> chromosome;
+        // Chromosome position of codes[0]
+        uint64_t start;
+        // Window starts scanned: [0, owned)
+        size_t owned;
+        std::vector<uint8_t> codes;
+        std::string output;
+        uint64_t hit_count{0};
+    };
+
+    WorkStealingPool pool_;
+    std::vector<ScoreMatrix> motifs_;
+    ScanKernel kernel_;
+    bool tsv_;
+    size_t overlap_{0};
+    size_t max_in_flight_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::map<size_t, std::shared_ptr<Chunk>> done_;
+    size_t in_flight_{0};
+    size_t chunks_read_{0};
+    bool reading_finished_{false};
+    std::exception_ptr error_;
+
+    void Read(const MappedFile& genome)
+    {
+        try {
+            const char *p = genome.data();
+            const char *end = p + genome.size();
+            size_t index = 0;
+            std::shared_ptr<Chunk> chunk;
+
+            while (p < end) {
+                const char *line_end = static_cast<const char *>(memchr(p, '\n', end - p));
+                if (!line_end)
+                    line_end = end;
+
+                if (*p == '>') {
+                    if (chunk && !Dispatch(std::move(chunk)))
+                        return;
+                    // The chromosome name is the first word of the header
+                    const char *name_end = p + 1;
+                    while (name_end < line_end && !isspace(static_cast<unsigned char>(*name_end)))
+                        ++name_end;
+                    chunk = NewChunk(index++, std::make_shared<const std::string>(p + 1, name_end), 0);
+                } else if (chunk) {
+                    for (const char *base = p; base < line_end; ++base) {
+                        if (*base == '\r' || *base == ' ' || *base == '\t')
+                            continue;
+                        chunk->codes.push_back(scan::kBaseCodes[static_cast<uint8_t>(*base)]);
+                        if (chunk->codes.size() == kChunkSize + overlap_) {
+                            auto next = NewChunk(index++, chunk->chromosome, chunk->start + kChunkSize);
+                            next->codes.assign(chunk->codes.end() - overlap_, chunk->codes.end());
+                            chunk->owned = kChunkSize;
+                            if (!Dispatch(std::move(chunk)))
+                                return;
+                            chunk = std::move(next);
+                        }
+                    }
+                }
+                p = line_end + 1;
+            }
+            if (chunk && !Dispatch(std::move(chunk)))
+                return;
+        } catch (...) {
+            Fail(std::current_exception());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reading_finished_ = true;
+        }
+        changed_.notify_all();
+    }
+
+    std::shared_ptr<Chunk> NewChunk(size_t index, std::shared_ptr<const std::string> chromosome, uint64_t start)
+    {
+        auto chunk = std::make_shared<Chunk>();
+        chunk->index = index;
+        chunk->chromosome = std::move(chromosome);
+        chunk->start = start;
+        chunk->owned = 0;
+        chunk->codes.reserve(kChunkSize + overlap_);
+        return chunk;
+    }
+
+    // Hand the chunk over to the pool. Returns false if the scan failed.
+    bool Dispatch(std::shared_ptr<Chunk> chunk)
+    {
+        // The last chunk of a chromosome owns every window start it has
+        if (chunk->owned == 0)
+            chunk->owned = chunk->codes.size();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return error_ || in_flight_ < max_in_flight_; });
+            if (error_)
+                return false;
+            ++in_flight_;
+            ++chunks_read_;
+        }
+
+        pool_.Submit([this, chunk] { Scan(chunk); });
+        return true;
+    }
+
+    void Scan(const std::shared_ptr<Chunk>& chunk)
+    {
+        try {
+            std::vector<ScanHit> hits;
+            for (uint32_t m = 0; m < motifs_.size(); ++m) {
+                const ScoreMatrix& motif = motifs_[m];
+                if (motif.length == 0 || chunk->codes.size() < motif.length)
+                    continue;
+                size_t count = std::min(chunk->owned, chunk->codes.size() - motif.length + 1);
+                kernel_(motif.forward.data(), motif.length, chunk->codes.data(), count,
+                        motif.threshold, m, '+', hits);
+                kernel_(motif.reverse.data(), motif.length, chunk->codes.data(), count,
+                        motif.threshold, m, '-', hits);
+            }
+            hits.erase(std::remove_if(hits.begin(), hits.end(), [this, &chunk](const ScanHit& hit) {
+                const ScoreMatrix& motif = motifs_[hit.motif];
+                return motif.max_p_value < 1.0 &&
+                       motif.PValue(motif.RoundedScore(&chunk->codes[hit.position], hit.strand)) > motif.max_p_value;
+            }), hits.end());
+            std::sort(hits.begin(), hits.end());
+            for (const auto& hit : hits)
+                AppendHit(*chunk, hit, chunk->output);
+            chunk->hit_count = hits.size();
+            // Only the output is needed from here on
+            std::vector<uint8_t>().swap(chunk->codes);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.emplace(chunk->index, chunk);
+            }
+            changed_.notify_all();
+        } catch (...) {
+            Fail(std::current_exception());
+        }
+    }
+
+    //
+    // BED:  chrom  start  end  motif  score  strand
+    // TSV:  chrom  start  end  strand  motif  score  p_value  sequence
+    //
+    void AppendHit(const Chunk& chunk, const ScanHit& hit, std::string& out) const
+    {
+        const ScoreMatrix& motif = motifs_[hit.motif];
+        uint64_t start = chunk.start + hit.position;
+        char number[24];
+
+        out += *chunk.chromosome;
+        out += '\t';
+        out.append(number, std::to_chars(number, number + sizeof(number), start).ptr);
+        out += '\t';
+        out.append(number, std::to_chars(number, number + sizeof(number), start + motif.length).ptr);
+        out += '\t';
+        if (tsv_) {
+            out += hit.strand;
+            out += '\t';
+        }
+        out += motif.id;
+        out += '\t';
+        int size = snprintf(number, sizeof(number), "%.3f", hit.score);
+        out.append(number, static_cast<size_t>(size));
+        out += '\t';
+        if (!tsv_) {
+            out += hit.strand;
+            out += '\n';
+            return;
+        }
+
+        const uint8_t *codes = chunk.codes.data() + hit.position;
+        size = snprintf(number, sizeof(number), "%.3g", motif.PValue(motif.RoundedScore(codes, hit.strand)));
+        out.append(number, static_cast<size_t>(size));
+        out += '\t';
+        for (size_t j = 0; j < motif.length; ++j) {
+            out += (hit.strand == '+') ? "ACGTN"[codes[j]]
+                                       : "TGCAN"[codes[motif.length - 1 - j]];
+        }
+        out += '\n';
+    }
+
+    void Fail(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_)
+                error_ = error;
+        }
+        changed_.notify_all();
+    }
+};
+
+#endif /* MotifScanner_h */
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PackedSequences_h
+#define PackedSequences_h
+
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+//
+// .pwmpack -- the sequences of '--output-format packed', 2 bits per base.
+//
+// All integers are little-endian. The file is laid out as:
+//
+//    Header
+//    for every record:
+//        uint8_t[(length + 3) / 4]  base codes (A 0, C 1, G 2, T/U 3), four per
+//                                   byte, the first base in the top two bits
+//        uint8_t[(length + 7) / 8]  only if the record has gaps: bit (i % 8) of
+//                                   byte i / 8 is set if base i is a gap
+//    RecordEntry[record_count]      8-byte aligned
+//    char[]                         ids ("<name> <desc>")
+//
+// Gaps ('-', '.' and any other character that isn't a base) are stored as
+// code 0 with their mask bit set. This header only needs MappedFile.h, so
+// other tools can include it to read the files.
+//
+namespace packed {
+
+constexpr char kMagic[8] = {'P', 'W', 'M', 'P', 'A', 'C', 'K', '\n'};
+constexpr uint32_t kVersion = 1;
+constexpr const char *kExtension = "pwmpack";
+
+// Header::flags: the T/U code is U
+constexpr uint64_t kFlagRna = 1;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t record_count;
+    uint64_t flags;
+    uint64_t records_offset;
+    uint64_t ids_offset;
+    uint64_t ids_size;
+    uint64_t file_size;
+};
+
+struct RecordEntry {
+    uint64_t id_offset;
+    uint32_t id_size;
+    uint32_t reserved;
+    uint64_t length;
+    uint64_t bases_offset;
+    // 0 if the record has no gaps
+    uint64_t mask_offset;
+};
+
+inline size_t PackedSize(uint64_t length)
+{
+    return static_cast<size_t>((length + 3) / 4);
+}
+
+inline size_t MaskSize(uint64_t length)
+{
+    return static_cast<size_t>((length + 7) / 8);
+}
+
+// Code (0-3) of base 'i' of packed bases
+inline uint8_t BaseCode(const uint8_t *bases, uint64_t i)
+{
+    return (bases[i >> 2] >> (6 - 2 * (i & 3))) & 3;
+}
+
+inline bool IsGap(const uint8_t *mask, uint64_t i)
+{
+    return mask != nullptr && ((mask[i >> 3] >> (i & 7)) & 1) != 0;
+}
+
+} // namespace packed
+
+//
+// Read-only view of a memory-mapped .pwmpack file
+//
+class PackedSequenceFile {
+ public:
+    static std::unique_ptr<PackedSequenceFile> Open(const std::string& path, std::string& error)
+    {
+        auto mapping = MappedFile::Open(path);
+        if (!mapping) {
+            error = "Couldn't open '" + path + "'";
+            return nullptr;
+        }
+
+        std::unique_ptr<PackedSequenceFile> file(new PackedSequenceFile(std::move(mapping)));
+        if (!file->Validate(error)) {
+            error = "'" + path + "' is not a valid ." + packed::kExtension + " file: " + error;
+            return nullptr;
+        }
+        return file;
+    }
+
+    size_t size() const
+    {
+        return static_cast<size_t>(header_.record_count);
+    }
+
+    bool rna() const
+    {
+        return (header_.flags & packed::kFlagRna) != 0;
+    }
+
+    std::string_view id(size_t record) const
+    {
+        return std::string_view(ids_ + records_[record].id_offset, records_[record].id_size);
+    }
+
+    uint64_t length(size_t record) const
+    {
+        return records_[record].length;
+    }
+
+    // packed::PackedSize(length(record)) bytes, read with packed::BaseCode()
+    const uint8_t *bases(size_t record) const
+    {
+        return data() + records_[record].bases_offset;
+    }
+
+    // The gap mask (read with packed::IsGap()), or nullptr if the record has no gaps
+    const uint8_t *mask(size_t record) const
+    {
+        uint64_t offset = records_[record].mask_offset;
+        return (offset == 0) ? nullptr : data() + offset;
+    }
+
+    // The sequence of a record as text, gaps as '-'
+    void Decode(size_t record, std::string& out) const
+    {
+        const char *letters = rna() ? "ACGU" : "ACGT";
+        const uint8_t *codes = bases(record);
+        const uint8_t *gaps = mask(record);
+        uint64_t size = length(record);
+
+        out.resize(static_cast<size_t>(size));
+        for (uint64_t i = 0; i < size; ++i)
+            out[i] = packed::IsGap(gaps, i) ? '-' : letters[packed::BaseCode(codes, i)];
+    }
+
+ private:
+    std::unique_ptr<MappedFile> mapping_;
+    packed::Header header_;
+    const packed::RecordEntry *records_{nullptr};
+    const char *ids_{nullptr};
+
+    explicit PackedSequenceFile(std::unique_ptr<MappedFile> mapping) : mapping_(std::move(mapping)) {}
+
+    const uint8_t *data() const
+    {
+        return reinterpret_cast<const uint8_t *>(mapping_->data());
+    }
+
+    bool Validate(std::string& error)
+    {
+        const char *data = mapping_->data();
+        const uint64_t size = mapping_->size();
+
+        if (size < sizeof(header_) || memcmp(data, packed::kMagic, sizeof(packed::kMagic)) != 0) {
+            error = "bad magic number";
+            return false;
+        }
+        memcpy(&header_, data, sizeof(header_));
+        if (header_.version != packed::kVersion || header_.header_size != sizeof(header_)) {
+            error = "unsupported version " + std::to_string(header_.version);
+            return false;
+        }
+        if (header_.file_size != size) {
+            error = "truncated file";
+            return false;
+        }
+        if (header_.records_offset > size ||
+            header_.record_count > (size - header_.records_offset) / sizeof(packed::RecordEntry) ||
+            header_.records_offset % alignof(packed::RecordEntry) != 0 ||
+            header_.ids_offset > size || header_.ids_size > size - header_.ids_offset) {
+            error = "section out of bounds";
+            return false;
+        }
+
+        records_ = reinterpret_cast<const packed::RecordEntry *>(data + header_.records_offset);
+        ids_ = data + header_.ids_offset;
+
+        // Bases and masks lie between the header and the records: 'per_byte' values fit in a byte
+        const uint64_t data_end = header_.records_offset;
+        auto data_fits = [data_end](uint64_t offset, uint64_t length, uint64_t per_byte) {
+            return offset >= sizeof(packed::Header) && offset <= data_end && length <= (data_end - offset) * per_byte;
+        };
+        for (uint64_t i = 0; i < header_.record_count; ++i) {
+            const auto& record = records_[i];
+            if (record.id_offset + record.id_size > header_.ids_size ||
+                !data_fits(record.bases_offset, record.length, 4) ||
+                (record.mask_offset != 0 && !data_fits(record.mask_offset, record.length, 8))) {
+                error = "record " + std::to_string(i) + " out of bounds";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif /* PackedSequences_h */
@@ -0,0 +1,294 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PackedWriter_h
+#define PackedWriter_h
+
+#include "Common.h"
+#include "MappedSequenceFile.h"
+#include "PackedSequences.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace packed {
+
+//
+// A record on its way from the converter threads to the PackedWriter: the
+// header, the id, the packed bases and (if 'has_mask') the gap mask
+//
+struct RecordChunk {
+    uint64_t length;
+    uint32_t id_size;
+    uint32_t has_mask;
+};
+
+//
+// Pack the base codes of Format::Packed output (0-3; any other byte is a
+// gap) four to a byte. 'bases' and 'mask' must be zeroed. Returns false if
+// there are no gaps, so no mask is needed.
+//
+inline bool PackBases(const char *codes, size_t size, uint8_t *bases, uint8_t *mask)
+{
+    bool gaps = false;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, codes + i, 8);
+        if ((word & 0xFCFCFCFCFCFCFCFCULL) == 0) {
+            // The multiplication moves the 2-bit codes of four bytes next to
+            // each other into the top byte, the first one highest
+            bases[i / 4] = static_cast<uint8_t>((static_cast<uint32_t>(word) * 0x40100401U) >> 24);
+            bases[i / 4 + 1] = static_cast<uint8_t>((static_cast<uint32_t>(word >> 32) * 0x40100401U) >> 24);
+            continue;
+        }
+        for (size_t j = i; j < i + 8; ++j) {
+            uint8_t code = static_cast<uint8_t>(codes[j]);
+            if (code > 3) {
+                mask[j >> 3] |= static_cast<uint8_t>(1 << (j & 7));
+                gaps = true;
+                code = 0;
+            }
+            bases[j >> 2] |= static_cast<uint8_t>(code << (6 - 2 * (j & 3)));
+        }
+    }
+    for (; i < size; ++i) {
+        uint8_t code = static_cast<uint8_t>(codes[i]);
+        if (code > 3) {
+            mask[i >> 3] |= static_cast<uint8_t>(1 << (i & 7));
+            gaps = true;
+            code = 0;
+        }
+        bases[i >> 2] |= static_cast<uint8_t>(code << (6 - 2 * (i & 3)));
+    }
+    return gaps;
+}
+
+} // namespace packed
+
+//
+// One record in the form PackedWriter::Write() takes: packed on the
+// converter thread, so the writer only copies bytes
+//
+inline void AppendPackedRecord(const RecordView& record, std::string_view codes, std::string& out)
+{
+    size_t id_size = record.name.size() + (record.desc.empty() ? 0 : 1 + record.desc.size());
+    packed::RecordChunk chunk{codes.size(), static_cast<uint32_t>(id_size), 0};
+
+    size_t start = out.size();
+    size_t bases_start = start + sizeof(chunk) + id_size;
+    size_t mask_start = bases_start + packed::PackedSize(codes.size());
+    out.resize(mask_start + packed::MaskSize(codes.size()));
+
+    char *id = &out[start + sizeof(chunk)];
+    memcpy(id, record.name.data(), record.name.size());
+    if (!record.desc.empty()) {
+        id[record.name.size()] = ' ';
+        memcpy(id + record.name.size() + 1, record.desc.data(), record.desc.size());
+    }
+
+    uint8_t *bases = reinterpret_cast<uint8_t *>(&out[bases_start]);
+    uint8_t *mask = reinterpret_cast<uint8_t *>(&out[mask_start]);
+    chunk.has_mask = packed::PackBases(codes.data(), codes.size(), bases, mask);
+    if (!chunk.has_mask)
+        out.resize(mask_start);
+    memcpy(&out[start], &chunk, sizeof(chunk));
+}
+
+//
+// Packed records collected in memory (a batch converted ahead of writing)
+//
+class PackedBuffer {
+ public:
+    using Buffer = PackedBuffer;
+
+    void WriteRecord(const RecordView& record, std::string_view codes)
+    {
+        AppendPackedRecord(record, codes, records_);
+    }
+
+    void Write(std::string_view records)
+    {
+        records_.append(records.data(), records.size());
+    }
+
+    std::string& buffer() { return records_; }
+    void Commit() {}
+
+ private:
+    std::string records_;
+};
+
+//
+// Writes a .pwmpack file. Packed bases go out through one large buffer as
+// they come; the record table and the ids are kept in memory and written at
+// the end, followed by the header at the start of the file. A file that
+// isn't closed keeps a zero header and is rejected by PackedSequenceFile.
+//
+class PackedWriter {
+ public:
+    using Buffer = PackedBuffer;
+
+    static constexpr size_t kBufferSize = size_t{4} << 20;
+
+    static std::unique_ptr<PackedWriter> Open(const std::string& path, Format output_format)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return nullptr;
+        return std::unique_ptr<PackedWriter>(new PackedWriter(fd, path, output_format == Format::RNA));
+    }
+
+    ~PackedWriter()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    PackedWriter(const PackedWriter&) = delete;
+    PackedWriter& operator=(const PackedWriter&) = delete;
+
+    const std::string& path() const
+    {
+        return path_;
+    }
+
+    // 'codes' as converted for Format::Packed
+    void WriteRecord(const RecordView& record, std::string_view codes)
+    {
+        AppendPackedRecord(record, codes, pending_);
+        Commit();
+    }
+
+    // Write records packed by AppendPackedRecord()
+    void Write(std::string_view records)
+    {
+        while (!records.empty()) {
+            packed::RecordChunk chunk;
+            if (records.size() < sizeof(chunk))
+                throw std::logic_error("Truncated packed record");
+            memcpy(&chunk, records.data(), sizeof(chunk));
+            records.remove_prefix(sizeof(chunk));
+
+            packed::RecordEntry entry{};
+            entry.id_offset = ids_.size();
+            entry.id_size = chunk.id_size;
+            entry.length = chunk.length;
+            ids_.append(records.data(), chunk.id_size);
+            records.remove_prefix(chunk.id_size);
+
+            size_t bases_size = packed::PackedSize(chunk.length);
+            size_t mask_size = chunk.has_mask ? packed::MaskSize(chunk.length) : 0;
+            entry.bases_offset = offset_ + buffer_.size();
+            entry.mask_offset = chunk.has_mask ? entry.bases_offset + bases_size : 0;
+            buffer_.append(records.data(), bases_size + mask_size);
+            records.remove_prefix(bases_size + mask_size);
+            records_.push_back(entry);
+
+            if (buffer_.size() >= kBufferSize)
+                Flush();
+        }
+    }
+
+    //
+    // Records may also be appended to buffer() with AppendPackedRecord();
+    // Commit() then moves them to the file.
+    //
+    std::string& buffer()
+    {
+        return pending_;
+    }
+
+    void Commit()
+    {
+        Write(pending_);
+        pending_.clear();
+    }
+
+    // Write the record table, the ids and the header, throwing if anything couldn't be written
+    void Close()
+    {
+        Commit();
+        packed::Header header{};
+        memcpy(header.magic, packed::kMagic, sizeof(header.magic));
+        header.version = packed::kVersion;
+        header.header_size = sizeof(header);
+        header.record_count = records_.size();
+        header.flags = rna_ ? packed::kFlagRna : 0;
+
+        buffer_.resize(pwmbin::AlignUp(offset_ + buffer_.size(), alignof(packed::RecordEntry)) - offset_, '\0');
+        header.records_offset = offset_ + buffer_.size();
+        buffer_.append(reinterpret_cast<const char *>(records_.data()), records_.size() * sizeof(packed::RecordEntry));
+        header.ids_offset = offset_ + buffer_.size();
+        header.ids_size = ids_.size();
+        buffer_ += ids_;
+        header.file_size = offset_ + buffer_.size();
+        Flush();
+
+        int fd = fd_;
+        fd_ = -1;
+        bool written = pwrite(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+        if (close(fd) != 0 || !written)
+            throw std::runtime_error("Couldn't write the output file '" + path_ + "'");
+    }
+
+ private:
+    int fd_;
+    std::string path_;
+    bool rna_;
+    // Bytes of the file already written
+    uint64_t offset_{0};
+    std::string buffer_;
+    std::string pending_;
+    std::vector<packed::RecordEntry> records_;
+    std::string ids_;
+
+    PackedWriter(int fd, const std::string& path, bool rna) : fd_(fd), path_(path), rna_(rna)
+    {
+        buffer_.reserve(kBufferSize);
+        // The header is written by Close()
+        buffer_.assign(sizeof(packed::Header), '\0');
+    }
+
+    void Flush()
+    {
+        const char *data = buffer_.data();
+        size_t size = buffer_.size();
+        while (size > 0) {
+            ssize_t written = write(fd_, data, size);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("Couldn't write the output file '" + path_ + "'");
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        offset_ += buffer_.size();
+        buffer_.clear();
+    }
+};
+
+#endif /* PackedWriter_h */
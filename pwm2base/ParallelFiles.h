@@ -0,0 +1,321 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ParallelFiles_h
+#define ParallelFiles_h
+
+#include "PackedWriter.h"
+#include "Pipeline.h"
+#include "Readahead.h"
+#include "ThreadPool.h"
+#include "TsvWriter.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//
+// Converts the files of a directory concurrently, one file per task. RunSplit()
+// schedules them largest first, so a big file found late in the directory
+// doesn't end up running alone at the end of the run. RunMerged() has to hold
+// every file converted ahead of its turn, so it trades some of that balance
+// for memory: files go largest first only within windows of 2 x threads
+// consecutive files, and a big file in the last window may still finish
+// alone. A 'readahead' of the inputs is told the order either way.
+//
+class ParallelFileConverter {
+ public:
+    ParallelFileConverter(unsigned threads, ConverterFactory factory, Readahead *readahead = nullptr)
+    : pool_(threads), factory_(factory), readahead_(readahead)
+    {
+        for (unsigned i = 0; i < pool_.size(); ++i)
+            converters_.emplace_back(factory());
+    }
+
+    //
+    // All files go into 'out_file' (a TsvWriter or a PackedWriter) in directory
+    // order. A file's records are kept in memory until every file before it
+    // has been written, so files are scheduled largest first only within
+    // windows of consecutive files (see MergedSchedule()), and a window is only
+    // started once the writer has reached the one before it. A file whose
+    // lines outgrow kMaxHeldOutput (a chromosome-scale record, say) is given
+    // up and converted again once it's its turn, by a ConversionPipeline
+    // writing straight into 'out_file'.
+    //
+    template<typename Writer>
+    void RunMerged(std::vector<std::unique_ptr<RecordReader>>& inputs, Writer& out_file)
+    {
+        RunMerged(inputs, out_file, [](size_t, Writer&) {}, [](size_t) {});
+    }
+
+    //
+    // RunMerged() for an incremental run: a null input is a file whose output
+    // lines 'reuse(file_index, out_file)' writes instead. 'written(file_index)'
+    // is called once the lines of a file are in 'out_file'.
+    //
+    template<typename Writer, typename Reuse, typename Written>
+    void RunMerged(std::vector<std::unique_ptr<RecordReader>>& inputs, Writer& out_file, Reuse reuse, Written written)
+    {
+        std::vector<std::string> results(inputs.size());
+        std::vector<char> finished(inputs.size(), false);
+        // Files converted on the writer's side, in order
+        std::vector<char> too_large(inputs.size(), false);
+
+        const size_t window = MergedWindow();
+        const auto schedule = MergedSchedule(inputs, window);
+        Follow(inputs, schedule);
+        size_t submitted = 0;
+
+        for (size_t file_index = 0; file_index < inputs.size(); ++file_index) {
+            // Keep the window being written and the one after it in flight
+            for (size_t end = std::min(schedule.size(), (file_index / window + 2) * window); submitted < end; ++submitted) {
+                size_t scheduled = schedule[submitted];
+                if (!inputs[scheduled])
+                    continue;
+                pool_.Submit([&, scheduled] {
+                    HeldOutput<typename Writer::Buffer> output;
+                    bool given_up = false;
+                    bool ok = Guard([&] {
+                        try {
+                            ConvertFile(*inputs[scheduled], output);
+                        } catch (const OutputTooLarge&) {
+                            inputs[scheduled]->Close();
+                            given_up = true;
+                        }
+                    });
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (ok && !given_up)
+                        results[scheduled] = std::move(output.buffer());
+                    too_large[scheduled] = given_up;
+                    finished[scheduled] = true;
+                    changed_.notify_all();
+                });
+            }
+
+            if (!inputs[file_index]) {
+                if (!Guard([&] { reuse(file_index, out_file); }))
+                    break;
+                written(file_index);
+                continue;
+            }
+            std::string output;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [&] { return error_ || finished[file_index]; });
+                if (error_)
+                    break;
+                output = std::move(results[file_index]);
+            }
+            if (too_large[file_index]) {
+                bool ok = Guard([&] {
+                    std::vector<std::unique_ptr<RecordReader>> input;
+                    input.emplace_back(inputs[file_index]->Reopen());
+                    ConversionPipeline pipeline(pool_.size(), factory_);
+                    pipeline.Run(input, out_file);
+                });
+                if (!ok)
+                    break;
+            } else {
+                out_file.Write(output);
+            }
+            written(file_index);
+        }
+
+        Finish();
+    }
+
+    //
+    // Every input file gets its own output file; 'output_paths' is parallel to
+    // 'inputs'. 'open_output(path)' opens a writer (a TsvWriter or a
+    // PackedWriter) and returns nullptr if it can't. The files are already
+    // converted in parallel, so a compressed one is compressed on the thread
+    // converting it.
+    //
+    template<typename OpenOutput>
+    void RunSplit(std::vector<std::unique_ptr<RecordReader>>& inputs,
+                  const std::vector<std::string>& output_paths, OpenOutput open_output)
+    {
+        const auto schedule = LargestFirst(inputs);
+        Follow(inputs, schedule);
+        for (size_t file_index : schedule) {
+            pool_.Submit([&, file_index] {
+                Guard([&] {
+                    auto out_file = open_output(output_paths[file_index]);
+                    if (!out_file)
+                        throw std::runtime_error("Couldn't open the output file '" + output_paths[file_index] + "'");
+
+                    ConvertFile(*inputs[file_index], *out_file);
+                    out_file->Close();
+                });
+            });
+        }
+        Finish();
+    }
+
+ private:
+    // Lines of one file RunMerged() holds in memory at most
+    static constexpr size_t kMaxHeldOutput = 4 * kRecordPieceSize;
+
+    // Thrown by HeldOutput once a file's lines outgrow kMaxHeldOutput
+    struct OutputTooLarge {};
+
+    //
+    // Output of a file converted ahead of its turn in RunMerged(): a 'Buffer'
+    // (the writer's) that throws OutputTooLarge once it holds too much
+    //
+    template<typename Buffer_>
+    class HeldOutput {
+     public:
+        using Buffer = Buffer_;
+
+        void WriteRecord(const RecordView& record, std::string_view bases)
+        {
+            held_.WriteRecord(record, bases);
+            Check();
+        }
+
+        void Write(std::string_view lines)
+        {
+            held_.Write(lines);
+            Check();
+        }
+
+        std::string& buffer() { return held_.buffer(); }
+
+        void Commit()
+        {
+            held_.Commit();
+            Check();
+        }
+
+     private:
+        Buffer held_;
+
+        void Check()
+        {
+            if (held_.buffer().size() > kMaxHeldOutput)
+                throw OutputTooLarge();
+        }
+    };
+
+    WorkStealingPool pool_;
+    std::vector<ConverterSet> converters_;
+    ConverterFactory factory_;
+    Readahead *readahead_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::exception_ptr error_;
+
+    static uint64_t FileSize(const std::string& path)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            return 0;
+        return static_cast<uint64_t>(info.st_size);
+    }
+
+    static std::vector<size_t> LargestFirst(const std::vector<std::unique_ptr<RecordReader>>& inputs)
+    {
+        return MergedSchedule(inputs, inputs.size());
+    }
+
+    // Files merged into one output are scheduled in windows of this many
+    size_t MergedWindow() const
+    {
+        return 2 * pool_.size();
+    }
+
+    //
+    // The files in windows of 'window' consecutive files, window by window,
+    // each window largest first. A window as big as 'inputs' is plain largest
+    // first order.
+    //
+    static std::vector<size_t> MergedSchedule(const std::vector<std::unique_ptr<RecordReader>>& inputs, size_t window)
+    {
+        std::vector<uint64_t> sizes;
+        for (const auto& input : inputs)
+            sizes.push_back(input ? FileSize(input->fileName()) : 0);
+
+        std::vector<size_t> order(inputs.size());
+        std::iota(order.begin(), order.end(), 0);
+        for (size_t begin = 0; begin < order.size(); begin += window) {
+            auto end = order.begin() + std::min(order.size(), begin + window);
+            std::stable_sort(order.begin() + begin, end, [&sizes](size_t lhs, size_t rhs) {
+                return sizes[lhs] > sizes[rhs];
+            });
+        }
+        return order;
+    }
+
+    // Have the readahead follow 'schedule', leaving out the files that aren't converted
+    void Follow(const std::vector<std::unique_ptr<RecordReader>>& inputs, const std::vector<size_t>& schedule)
+    {
+        if (!readahead_)
+            return;
+        std::vector<size_t> order;
+        for (size_t file_index : schedule) {
+            if (inputs[file_index])
+                order.push_back(file_index);
+        }
+        readahead_->Follow(order);
+    }
+
+    template<typename Output>
+    void ConvertFile(RecordReader& reader, Output& output)
+    {
+        ConvertRecords(converters_[WorkStealingPool::CurrentWorker()], reader, output);
+    }
+
+    // Run 'body', remembering the first exception thrown by any task
+    template<typename Body>
+    bool Guard(Body&& body)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (error_)
+                return false;
+        }
+        try {
+            body();
+            return true;
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_)
+                error_ = std::current_exception();
+            changed_.notify_all();
+            return false;
+        }
+    }
+
+    void Finish()
+    {
+        pool_.Wait();
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+};
+
+#endif /* ParallelFiles_h */
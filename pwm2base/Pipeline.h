@@ -0,0 +1,813 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Pipeline_h
+#define Pipeline_h
+
+#include "../libgene/source/file/sequence/SequenceFile.hpp"
+#include "../libgene/source/file/sequence/SequenceRecord.hpp"
+#include "../libgene/source/utils/FileUtils.hpp"
+
+#include "PwmConverterBase.h"
+#include "PwmConverter.h"
+#include "ConsensusMemo.h"
+#include "PwmConverterWithWeights.h"
+#include "PwmPfmConverter.h"
+#include "MappedSequenceFile.h"
+#include "MatrixParser.h"
+#include "PackedWriter.h"
+#include "Sampler.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "TopSequences.h"
+#include "TsvWriter.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Samples per chunk of a record in sampling mode
+constexpr uint64_t kSampleChunk = 256;
+
+// Sequence bytes per piece of a long IUPAC record (see RecordReader::SplitRecords())
+constexpr size_t kRecordPieceSize = size_t{1} << 20;
+
+//
+// Converters for one thread: '.pfm' files go to 'pfm' (when present), every
+// other file goes to 'regular'. 'bases' is the thread's reusable conversion
+// buffer. 'seed' selects the random streams of the records. With 'samples' set
+// every matrix yields that many sequences drawn from its column distributions
+// instead of its consensus; with 'top_k' set it yields its 'top_k'
+// highest-scoring sequences.
+//
+struct ConverterSet {
+    std::unique_ptr<PwmConverter> regular;
+    std::unique_ptr<PwmConverter> pfm;
+    uint64_t seed{0};
+    std::string bases;
+    uint64_t samples{0};
+    MotifSampler sampler;
+    uint64_t top_k{0};
+    TopSequences top;
+    std::vector<std::array<double, 4>> columns;
+    // ConvertBatch() arguments, reused from batch to batch
+    std::vector<std::string_view> sequences;
+    std::vector<uint64_t> record_indices;
+    std::vector<std::string> outputs;
+
+    PwmConverter& For(bool pfm_file)
+    {
+        return (pfm_file && pfm) ? *pfm : *regular;
+    }
+
+    // See PwmConverter::set_memo()
+    void SetMemo(ConsensusMemo *memo)
+    {
+        regular->set_memo(memo);
+        if (pfm)
+            pfm->set_memo(memo);
+    }
+};
+using ConverterFactory = std::function<ConverterSet()>;
+
+template<Format Format_>
+ConverterSet MakeConverterSetFor(bool matrix_input, uint64_t seed)
+{
+    ConverterSet converters;
+    converters.seed = seed;
+    if (matrix_input) {
+        converters.regular = std::make_unique<PwmConverterWithWeights<Format_>>();
+        converters.pfm = std::make_unique<PwmPfmConverter<Format_>>();
+    } else {
+        converters.regular = std::make_unique<PwmConverterRandom<Format_>>();
+    }
+    return converters;
+}
+
+//
+// Converters for weight matrices ('matrix_input') or IUPAC sequences. This is
+// the only place the output format is looked at; the converters are compiled
+// for it.
+//
+inline
+ConverterSet MakeConverterSet(Format output_format, bool matrix_input, uint64_t seed = 0)
+{
+    if (output_format == Format::DNA)
+        return MakeConverterSetFor<Format::DNA>(matrix_input, seed);
+    if (output_format == Format::Packed)
+        return MakeConverterSetFor<Format::Packed>(matrix_input, seed);
+    return MakeConverterSetFor<Format::RNA>(matrix_input, seed);
+}
+
+// Number of chunks a record is converted in
+inline
+uint64_t RecordChunks(uint64_t samples)
+{
+    return (samples == 0) ? 1 : (samples + kSampleChunk - 1) / kSampleChunk;
+}
+
+inline
+void SetSampleChunk(RecordView& record, uint64_t chunk, uint64_t samples)
+{
+    record.first_sample = chunk * kSampleChunk;
+    record.sample_count = (samples == 0) ? 0 : std::min(kSampleChunk, samples - record.first_sample);
+}
+
+//
+// The columns of a record's matrix into 'converters.columns'. 'mode' names the
+// option that needs them for the error about non-matrix input.
+//
+inline
+void RecordColumns(ConverterSet& converters, bool pfm_file, const RecordView& record, const char *mode)
+{
+    if (record.matrix) {
+        converters.columns.clear();
+        for (size_t i = 0; i < record.columns; ++i) {
+            const float *column = record.matrix + 4 * i;
+            converters.columns.push_back({column[0], column[1], column[2], column[3]});
+        }
+        return;
+    }
+    try {
+        if (!converters.For(pfm_file).ParseColumns(record.seq, converters.columns))
+            throw std::runtime_error(std::string(mode) + " requires a weights matrix input");
+    } catch (MatrixParseError& error) {
+        error.SetRecord(record.name);
+        throw;
+    }
+}
+
+//
+// Top-k mode: append one line ("<id> <desc> #<rank>"\t<bases>\t<score>) for
+// each of the record's 'converters.top_k' best sequences to 'out'
+//
+inline
+void TopRecord(ConverterSet& converters, bool pfm_file, const RecordView& record, std::string& out)
+{
+    RecordColumns(converters, pfm_file, record, "Top-k enumeration");
+    converters.top.Build(converters.columns);
+
+    uint64_t rank = 0;
+    auto append = [&](const std::string& sequence, double score) {
+        AppendQuotedId(record, out);
+        out.pop_back();
+
+        char number[32];
+        auto result = std::to_chars(number, number + sizeof(number), ++rank);
+        out += " #";
+        out.append(number, result.ptr);
+        out += "\"\t";
+        out += sequence;
+        int size = snprintf(number, sizeof(number), "\t%.4f\n", score);
+        out.append(number, static_cast<size_t>(size));
+    };
+    if (converters.regular->output_format() == Format::DNA)
+        converters.top.Enumerate<Format::DNA>(converters.top_k, append);
+    else
+        converters.top.Enumerate<Format::RNA>(converters.top_k, append);
+
+    if (stats_enabled) {
+        for (uint64_t i = 0; i < rank; ++i)
+            LocalStats().AddRecord(converters.columns.size());
+    }
+}
+
+//
+// Sampling mode: append one line ("<id> <desc> #<n>"\t<bases>) per sample of
+// the record's chunk to 'out'.
+//
+inline
+void SampleRecord(ConverterSet& converters, bool pfm_file, const RecordView& record,
+                  uint64_t file_key, uint64_t record_index, std::string& out)
+{
+    if (record.matrix) {
+        converters.sampler.Build(record.matrix, record.columns);
+    } else {
+        RecordColumns(converters, pfm_file, record, "Sampling");
+        converters.sampler.Build(converters.columns);
+    }
+
+    SeedSampleStream(converters.seed, file_key, record_index, record.first_sample);
+    Format output_format = converters.regular->output_format();
+    for (uint64_t i = record.first_sample; i < record.first_sample + record.sample_count; ++i) {
+        AppendQuotedId(record, out);
+        out.pop_back();
+
+        char number[24];
+        auto result = std::to_chars(number, number + sizeof(number), i + 1);
+        out += " #";
+        out.append(number, result.ptr);
+        out += "\"\t";
+        converters.sampler.AppendSample(output_format, out);
+        out += '\n';
+    }
+}
+
+//
+// Convert the sequence of a single record into 'converters.bases'. The file
+// key and record index select the random stream, so a record converts to the
+// same bases no matter which thread handles it.
+//
+inline
+void ConvertBases(ConverterSet& converters, bool pfm_file, const RecordView& record,
+                  uint64_t file_key, uint64_t record_index)
+{
+    SeedRecordStream(converters.seed, file_key, record_index);
+    if (record.consensus) {
+        WriteConsensus(record.consensus, record.columns, converters.regular->output_format(), converters.bases);
+    } else {
+        try {
+            converters.For(pfm_file).ConvertInto(record.seq, converters.bases);
+        } catch (MatrixParseError& error) {
+            error.SetRecord(record.name);
+            throw;
+        }
+    }
+}
+
+// '--stats' accounting of a converted record
+inline
+void CountRecord(ConverterSet& converters, const RecordView& record, std::string_view bases)
+{
+    if (stats_enabled) {
+        LocalStats().AddRecord(bases.size());
+        if (!converters.pfm && !record.consensus)
+            LocalStats().CountSymbols(record.seq);
+    }
+}
+
+//
+// Convert a single record and append its output line ("<id> <desc>"\t<bases>),
+// or its lines in sampling mode, to 'output' (a TsvWriter or a TextBuffer)
+//
+template<typename Output>
+void ConvertRecord(ConverterSet& converters, bool pfm_file, const RecordView& record,
+                   uint64_t file_key, uint64_t record_index, Output& output)
+{
+    if (converters.top_k) {
+        TopRecord(converters, pfm_file, record, output.buffer());
+        output.Commit();
+    } else if (record.sample_count) {
+        SampleRecord(converters, pfm_file, record, file_key, record_index, output.buffer());
+        output.Commit();
+        if (stats_enabled) {
+            for (uint64_t i = 0; i < record.sample_count; ++i)
+                LocalStats().AddRecord(converters.sampler.columns());
+        }
+    } else {
+        ConvertBases(converters, pfm_file, record, file_key, record_index);
+        output.WriteRecord(record, converters.bases);
+        CountRecord(converters, record, converters.bases);
+    }
+}
+
+//
+// Convert a record that 'reader' hands out in pieces (see
+// RecordReader::SplitRecords()), 'record' being its first one, and write its
+// output line to 'output' piece by piece. IUPAC bases are drawn in sequence
+// order from the record's stream, so the line is the same as if the record
+// had been converted whole.
+//
+template<typename Output>
+void ConvertRecordPieces(ConverterSet& converters, RecordReader& reader, RecordView& record,
+                         uint64_t file_key, uint64_t record_index, Output& output)
+{
+    if constexpr (!std::is_same_v<typename Output::Buffer, TextBuffer>) {
+        throw std::logic_error("Records are only split for text output");
+    } else {
+        std::string& text = converters.bases;
+        text.clear();
+        AppendQuotedId(record, text);
+        text += '\t';
+        output.Write(text);
+
+        SeedRecordStream(converters.seed, file_key, record_index);
+        uint64_t length = 0;
+        for (bool more = true; more; more = record.partial && reader.Next(record)) {
+            converters.regular->ConvertInto(record.seq, text);
+            output.Write(text);
+            length += text.size();
+            if (stats_enabled && !converters.pfm)
+                LocalStats().CountSymbols(record.seq);
+        }
+        output.Write("\n");
+        if (stats_enabled)
+            LocalStats().AddRecord(length);
+    }
+}
+
+//
+// Convert 'count' records of one file, record i with the random stream of
+// 'record_indices[i]'. Text records are handed to the converter in a single
+// ConvertBatch() call; sampled and compiled records go one by one.
+//
+template<typename Output>
+void ConvertRecordSpan(ConverterSet& converters, bool pfm_file, const RecordView *records,
+                       const uint64_t *record_indices, size_t count, uint64_t file_key, Output& output)
+{
+    if (count == 0)
+        return;
+    if (converters.samples != 0 || converters.top_k != 0 || records[0].consensus) {
+        for (size_t i = 0; i < count; ++i)
+            ConvertRecord(converters, pfm_file, records[i], file_key, record_indices[i], output);
+        return;
+    }
+
+    converters.sequences.clear();
+    for (size_t i = 0; i < count; ++i)
+        converters.sequences.push_back(records[i].seq);
+    if (converters.outputs.size() < count)
+        converters.outputs.resize(count);
+
+    size_t converted = 0;
+    try {
+        converters.For(pfm_file).ConvertBatch(converters.sequences.data(), count, converters.seed, file_key,
+                                              record_indices, converters.outputs.data(), converted);
+    } catch (MatrixParseError& error) {
+        error.SetRecord(records[converted].name);
+        throw;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        output.WriteRecord(records[i], converters.outputs[i]);
+        CountRecord(converters, records[i], converters.outputs[i]);
+    }
+}
+
+//
+// '--stats' variant of ConvertRecords(): records are read, converted and
+// written in blocks, so every phase is timed once per block rather than per
+// record
+//
+template<typename Output>
+void ConvertRecordBlocks(ConverterSet& converters, RecordReader& reader, uint64_t file_key, Output& output)
+{
+    constexpr size_t kBlockSize = 256;
+    bool pfm = reader.pfm();
+    std::vector<RecordView> records;
+    std::vector<uint64_t> record_indices;
+    std::vector<SequenceRecord> storage;
+    typename Output::Buffer lines;
+    RecordView record;
+    uint64_t record_index = 0;
+    bool more = true;
+
+    while (more) {
+        PhaseTimer read_timer(StatsPhase::Read);
+        records.clear();
+        storage.clear();
+        storage.reserve(kBlockSize);
+        bool pieces = false;
+        while (records.size() < kBlockSize && (more = reader.Next(record))) {
+            if (record.partial) {
+                // Converted after the records before it, straight into 'output'
+                pieces = true;
+                break;
+            }
+            if (!reader.mapped()) {
+                storage.emplace_back();
+                storage.back().name.assign(record.name.data(), record.name.size());
+                storage.back().desc.assign(record.desc.data(), record.desc.size());
+                storage.back().seq.assign(record.seq.data(), record.seq.size());
+                record = RecordView{storage.back().name, storage.back().desc, storage.back().seq};
+            }
+            records.push_back(record);
+        }
+        read_timer.Stop();
+
+        PhaseTimer convert_timer(StatsPhase::Convert);
+        lines.buffer().clear();
+        if (converters.samples == 0) {
+            record_indices.clear();
+            for (size_t i = 0; i < records.size(); ++i)
+                record_indices.push_back(record_index++);
+            ConvertRecordSpan(converters, pfm, records.data(), record_indices.data(), records.size(),
+                              file_key, lines);
+        } else {
+            for (auto& view : records) {
+                for (uint64_t chunk = 0; chunk < RecordChunks(converters.samples); ++chunk) {
+                    SetSampleChunk(view, chunk, converters.samples);
+                    ConvertRecord(converters, pfm, view, file_key, record_index, lines);
+                }
+                ++record_index;
+            }
+        }
+        convert_timer.Stop();
+
+        PhaseTimer write_timer(StatsPhase::Write);
+        output.Write(lines.buffer());
+        write_timer.Stop();
+
+        if (pieces) {
+            PhaseTimer pieces_timer(StatsPhase::Convert);
+            ConvertRecordPieces(converters, reader, record, file_key, record_index++, output);
+        }
+    }
+}
+
+//
+// Convert every record of 'reader' into 'output', then close it. The records
+// draw from the random streams of the reader's file key.
+//
+template<typename Output>
+void ConvertRecords(ConverterSet& converters, RecordReader& reader, Output& output)
+{
+    reader.Load();
+    uint64_t file_key = reader.file_key();
+    bool pfm = reader.pfm();
+    RecordView record;
+    uint64_t record_index = 0;
+
+    try {
+        if (stats_enabled) {
+            ConvertRecordBlocks(converters, reader, file_key, output);
+            reader.Close();
+            return;
+        }
+        while (reader.Next(record)) {
+            if (record.partial) {
+                ConvertRecordPieces(converters, reader, record, file_key, record_index++, output);
+                continue;
+            }
+            for (uint64_t chunk = 0; chunk < RecordChunks(converters.samples); ++chunk) {
+                SetSampleChunk(record, chunk, converters.samples);
+                ConvertRecord(converters, pfm, record, file_key, record_index, output);
+            }
+            ++record_index;
+        }
+        reader.Close();
+    } catch (MatrixParseError& error) {
+        error.SetFile(reader.fileName());
+        throw;
+    }
+}
+
+//
+// Reader thread -> work-stealing converter pool -> ordered writer.
+//
+// The reader groups records into batches (a batch never spans two input
+// files), the pool converts batches in any order and the calling thread writes
+// them back in input order. Written batches are recycled, so once the pipeline
+// is warmed up records of mapped files are converted without allocations.
+// Inputs are loaded as the reader gets to them and closed once their records
+// are written (copied ones as soon as they're read).
+//
+// A record the reader hands out in pieces is converted by the reader thread
+// itself, in order, and its output line reaches the writer in batches of
+// about kPieceBatchSize, so it's never held in memory whole.
+//
+class ConversionPipeline {
+ public:
+    ConversionPipeline(unsigned threads, ConverterFactory factory, size_t batch_size = 256)
+    : pool_(threads), batch_size_(batch_size ? batch_size : 1)
+    {
+        // Every worker gets its own converters, so converters may keep state
+        for (unsigned i = 0; i < pool_.size(); ++i)
+            converters_.emplace_back(factory());
+        piece_converters_ = factory();
+        samples_ = converters_[0].samples;
+
+        // Enough batches in flight to keep every worker busy, but bounded memory
+        max_in_flight_ = pool_.size() * 4;
+    }
+
+    // 'out_file' is a TsvWriter or a PackedWriter
+    template<typename Writer>
+    void Run(std::vector<std::unique_ptr<RecordReader>>& inputs, Writer& out_file)
+    {
+        convert_ = &ConversionPipeline::Convert<typename Writer::Buffer>;
+        text_output_ = std::is_same_v<typename Writer::Buffer, TextBuffer>;
+        std::thread reader(&ConversionPipeline::Read, this, std::ref(inputs));
+
+        size_t next = 0;
+        // Inputs before this one have been written
+        size_t open_input = 0;
+        for (;;) {
+            std::shared_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [&] {
+                    return error_ || done_.count(next) || (reading_finished_ && next == batches_read_);
+                });
+                if (error_ || !done_.count(next))
+                    break;
+                batch = std::move(done_[next]);
+                done_.erase(next);
+            }
+            for (; open_input < batch->file_index; ++open_input)
+                inputs[open_input]->Close();
+
+            {
+                PhaseTimer write_timer(StatsPhase::Write);
+                out_file.Write(batch->output);
+            }
+            ++next;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                free_.emplace_back(std::move(batch));
+                --in_flight_;
+            }
+            changed_.notify_all();
+        }
+
+        reader.join();
+        pool_.Wait();
+        for (; open_input < inputs.size(); ++open_input)
+            inputs[open_input]->Close();
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+
+ private:
+    struct Batch {
+        size_t index;
+        uint64_t file_index;
+        bool pfm;
+        std::vector<RecordView> records;
+        std::vector<uint64_t> record_indices;
+        // Copies of the records when the input isn't memory mapped
+        std::vector<SequenceRecord> storage;
+        // Output of all records of the batch, as written by the writer's Buffer
+        std::string output;
+        // Owned by the caller of Run(), so mapped records stay valid
+        RecordReader *reader;
+    };
+
+    static constexpr size_t kPieceBatchSize = size_t{1} << 20;
+
+    //
+    // Output of the reader thread's ConvertRecordPieces(): collected in
+    // batches that go straight to the writer
+    //
+    class PieceOutput {
+     public:
+        using Buffer = TextBuffer;
+
+        PieceOutput(ConversionPipeline& pipeline, size_t& batch_index, uint64_t file_index, RecordReader *reader)
+        : pipeline_(pipeline), batch_index_(batch_index), file_index_(file_index), reader_(reader)
+        { }
+
+        void Write(std::string_view text)
+        {
+            if (!batch_) {
+                batch_ = pipeline_.NewBatch(batch_index_, file_index_, false, reader_);
+                batch_->output.clear();
+            }
+            batch_->output.append(text.data(), text.size());
+            if (batch_->output.size() >= kPieceBatchSize)
+                Deliver();
+        }
+
+        void Finish()
+        {
+            if (batch_)
+                Deliver();
+        }
+
+     private:
+        ConversionPipeline& pipeline_;
+        size_t& batch_index_;
+        uint64_t file_index_;
+        RecordReader *reader_;
+        std::shared_ptr<Batch> batch_;
+
+        void Deliver()
+        {
+            // Fail() keeps the error that stopped the pipeline, this one only ends the reader
+            if (!pipeline_.Deliver(std::move(batch_)))
+                throw std::runtime_error("Conversion stopped");
+            ++batch_index_;
+        }
+    };
+
+    WorkStealingPool pool_;
+    std::vector<ConverterSet> converters_;
+    // Converters of the reader thread, for records in pieces
+    ConverterSet piece_converters_;
+    bool text_output_{true};
+    size_t batch_size_;
+    size_t max_in_flight_;
+    uint64_t samples_;
+    // Convert() for the output buffer type of Run()
+    void (ConversionPipeline::*convert_)(const std::shared_ptr<Batch>&){nullptr};
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::map<size_t, std::shared_ptr<Batch>> done_;
+    std::vector<std::shared_ptr<Batch>> free_;
+    size_t in_flight_{0};
+    size_t batches_read_{0};
+    bool reading_finished_{false};
+    std::exception_ptr error_;
+
+    void Read(std::vector<std::unique_ptr<RecordReader>>& inputs)
+    {
+        size_t batch_index = 0;
+
+        try {
+            for (size_t file_index = 0; file_index < inputs.size(); ++file_index) {
+                RecordReader *reader = inputs[file_index].get();
+                reader->Load();
+                bool pfm = reader->pfm();
+                uint64_t record_index = 0;
+                RecordView record;
+                auto batch = NewBatch(batch_index, file_index, pfm, reader);
+                // Waiting for a free slot in Dispatch() isn't reading
+                PhaseTimer read_timer(StatsPhase::Read);
+
+                while (reader->Next(record)) {
+                    if (record.partial) {
+                        if (!text_output_)
+                            throw std::logic_error("Records are only split for text output");
+                        // The records before it go first
+                        read_timer.Stop();
+                        bool dispatched = !batch->records.empty();
+                        if (dispatched && !Dispatch(std::move(batch)))
+                            return;
+                        batch_index += dispatched;
+
+                        PieceOutput output(*this, batch_index, file_index, reader);
+                        ConvertRecordPieces(piece_converters_, *reader, record, reader->file_key(), record_index++,
+                                            output);
+                        output.Finish();
+                        if (dispatched)
+                            batch = NewBatch(batch_index, file_index, pfm, reader);
+                        else
+                            batch->index = batch_index;
+                        read_timer.Restart();
+                        continue;
+                    }
+                    // In sampling mode a record becomes several chunks, possibly in several batches
+                    RecordView view = record;
+                    bool copied = reader->mapped();
+                    for (uint64_t chunk = 0; chunk < RecordChunks(samples_); ++chunk) {
+                        if (!copied) {
+                            batch->storage.emplace_back();
+                            SequenceRecord& copy = batch->storage.back();
+                            copy.name.assign(record.name.data(), record.name.size());
+                            copy.desc.assign(record.desc.data(), record.desc.size());
+                            copy.seq.assign(record.seq.data(), record.seq.size());
+                            view = RecordView{copy.name, copy.desc, copy.seq};
+                            copied = true;
+                        }
+                        SetSampleChunk(view, chunk, samples_);
+                        batch->records.push_back(view);
+                        batch->record_indices.push_back(record_index);
+                        if (batch->records.size() == batch_size_) {
+                            read_timer.Stop();
+                            if (!Dispatch(std::move(batch)))
+                                return;
+                            read_timer.Restart();
+                            batch = NewBatch(++batch_index, file_index, pfm, reader);
+                            copied = reader->mapped();
+                        }
+                    }
+                    ++record_index;
+                }
+                read_timer.Stop();
+                // The batches hold copies of the records of a file that isn't mapped
+                if (!reader->mapped())
+                    reader->Close();
+                if (!batch->records.empty()) {
+                    if (!Dispatch(std::move(batch)))
+                        return;
+                    ++batch_index;
+                }
+            }
+        } catch (...) {
+            Fail(std::current_exception());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reading_finished_ = true;
+        }
+        changed_.notify_all();
+    }
+
+    std::shared_ptr<Batch> NewBatch(size_t index, uint64_t file_index, bool pfm, RecordReader *reader)
+    {
+        std::shared_ptr<Batch> batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                batch = std::move(free_.back());
+                free_.pop_back();
+            }
+        }
+        if (!batch) {
+            batch = std::make_shared<Batch>();
+            // 'records' may point into 'storage', which therefore must never reallocate
+            batch->storage.reserve(batch_size_);
+        }
+
+        batch->index = index;
+        batch->file_index = file_index;
+        batch->pfm = pfm;
+        batch->records.clear();
+        batch->record_indices.clear();
+        batch->storage.clear();
+        batch->reader = reader;
+        return batch;
+    }
+
+    // Hand the batch over to the pool. Returns false if the pipeline failed.
+    bool Dispatch(std::shared_ptr<Batch> batch)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return error_ || in_flight_ < max_in_flight_; });
+            if (error_)
+                return false;
+            ++in_flight_;
+            ++batches_read_;
+        }
+
+        pool_.Submit([this, batch] { (this->*convert_)(batch); });
+        return true;
+    }
+
+    // Hand a batch converted by the reader straight to the writer. Returns false if the pipeline failed.
+    bool Deliver(std::shared_ptr<Batch> batch)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return error_ || in_flight_ < max_in_flight_; });
+            if (error_)
+                return false;
+            ++in_flight_;
+            ++batches_read_;
+            done_.emplace(batch->index, std::move(batch));
+        }
+        changed_.notify_all();
+        return true;
+    }
+
+    template<typename Buffer>
+    void Convert(const std::shared_ptr<Batch>& batch)
+    {
+        try {
+            ConverterSet& converters = converters_[WorkStealingPool::CurrentWorker()];
+            PhaseTimer convert_timer(StatsPhase::Convert);
+
+            // The buffer takes over the batch's output string, keeping its capacity
+            Buffer output;
+            output.buffer().swap(batch->output);
+            output.buffer().clear();
+            try {
+                ConvertRecordSpan(converters, batch->pfm, batch->records.data(), batch->record_indices.data(),
+                                  batch->records.size(), batch->reader->file_key(), output);
+            } catch (MatrixParseError& error) {
+                error.SetFile(batch->reader->fileName());
+                throw;
+            }
+            batch->output.swap(output.buffer());
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.emplace(batch->index, batch);
+            }
+            changed_.notify_all();
+        } catch (...) {
+            Fail(std::current_exception());
+        }
+    }
+
+    void Fail(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_)
+                error_ = error;
+        }
+        changed_.notify_all();
+    }
+};
+
+#endif /* Pipeline_h */
@@ -20,131 +20,236 @@
 #include <string>
 #include <array>
 #include <random>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PWM2BASE_X86 1
+#include <immintrin.h>
+#else
+#define PWM2BASE_X86 0
+#endif
 
 #include "../libgene/source/log/Logger.hpp"
 
 #include "PwmConverterBase.h"
 #include "Common.h"
+#include "Iupac.h"
+#include "RandomBits.h"
 
-std::mt19937_64 mersenne_generator;
-std::uniform_int_distribution<int> uniform2;
-std::uniform_int_distribution<int> uniform3;
-std::uniform_int_distribution<int> uniform4;
+//
+// The random stream of the calling thread. Every record reseeds it from the
+// seed of its ConverterSet, so threads and conversion contexts never share
+// random state and a record converts to the same bases on any thread.
+//
+inline thread_local RandomBitPool random_bits;
 
-void InitRandom(bool verbose_output)
+//
+// The run seed: 'provided_seed', or a random one
+//
+inline
+uint64_t PickRandomSeed(bool verbose_output, bool seed_provided = false, uint64_t provided_seed = 0)
 {
-    std::random_device rd;
-    auto seed = rd();
+    uint64_t seed = provided_seed;
+    if (!seed_provided) {
+        std::random_device rd;
+        seed = rd();
+    }
     
     if (verbose_output)
         logger::Log("Random seed: " + std::to_string(seed));
-    
-    mersenne_generator = std::mt19937_64{seed};
-    uniform2 = std::uniform_int_distribution<int>{0, 1};
-    uniform3 = std::uniform_int_distribution<int>{0, 2};
-    uniform4 = std::uniform_int_distribution<int>{0, 3};
+    return seed;
 }
 
-// Forward-declarations
-template<int Size_> constexpr
-char PickUniformlyRandomFromSet(const std::string& set) noexcept;
-
-template<> constexpr
-char PickUniformlyRandomFromSet<2>(const std::string& set) noexcept;
-
-template<> constexpr
-char PickUniformlyRandomFromSet<3>(const std::string& set) noexcept;
-
-template<> constexpr
-char PickUniformlyRandomFromSet<4>(const std::string& set) noexcept;
-// End declarations
-
-
-template<int _Size> constexpr
-char PickUniformlyRandomFromSet(const std::string& set) noexcept
+//
+// Switch the calling thread to the random stream of the given record
+//
+inline
+void SeedRecordStream(uint64_t seed, uint64_t file_key, uint64_t record_index)
 {
-    static_assert(_Size > 1 && _Size < 5, "Attempted to instantiate PickUniformlyRandomFromSet with _Size beyound the specified limit");
-    // Should be unreachable
-    std::terminate();
-    return '-';
+    random_bits.Seed(RecordStreamSeed(seed, file_key, record_index));
 }
 
-template <> constexpr
-char PickUniformlyRandomFromSet<2>(const std::string& set) noexcept
+//
+// Switch the calling thread to the random stream of the samples of a record
+// starting at 'first_sample', so chunks of a record can be sampled in parallel
+//
+inline
+void SeedSampleStream(uint64_t seed, uint64_t file_key, uint64_t record_index, uint64_t first_sample)
 {
-    return set[uniform2(mersenne_generator)];
+    random_bits.Seed(MixSeed(RecordStreamSeed(seed, file_key, record_index) ^ MixSeed(first_sample)));
 }
 
-template <> constexpr
-char PickUniformlyRandomFromSet<3>(const std::string& set) noexcept
+template<int Size_>
+char PickUniformlyRandomFromSet(const char *set) noexcept
 {
-    return set[uniform3(mersenne_generator)];
+    return set[random_bits.Uniform<Size_>()];
 }
 
-template <> constexpr
-char PickUniformlyRandomFromSet<4>(const std::string& set) noexcept
+inline
+char PickUniformlyRandomFromEntry(const IupacEntry& entry) noexcept
 {
-    return set[uniform4(mersenne_generator)];
+    switch (entry.size) {
+        case 2: return PickUniformlyRandomFromSet<2>(entry.bases);
+        case 3: return PickUniformlyRandomFromSet<3>(entry.bases);
+        case 4: return PickUniformlyRandomFromSet<4>(entry.bases);
+        default: return entry.bases[0];
+    }
 }
 
-class PwmConverterRandom : public PwmConverter {
+//
+// ConvertBatch() of a final converter class. The calls for every record are
+// resolved at compile time rather than through the vtable.
+//
+template<typename Converter>
+class BatchConverter : public PwmConverter {
  public:
-    explicit PwmConverterRandom(Format output_format) : PwmConverter(output_format) {}
+    using PwmConverter::PwmConverter;
+
+    virtual void ConvertBatch(const std::string_view *sequences, size_t count, uint64_t seed, uint64_t file_key,
+                              const uint64_t *record_indices, std::string *outputs, size_t& converted) override
+    {
+        Converter& converter = static_cast<Converter&>(*this);
+        for (converted = 0; converted < count; ++converted) {
+            SeedRecordStream(seed, file_key, record_indices[converted]);
+            converter.Converter::ConvertInto(sequences[converted], outputs[converted]);
+        }
+    }
+};
+
+template<Format Format_>
+class PwmConverterRandom final : public BatchConverter<PwmConverterRandom<Format_>> {
+ public:
+    PwmConverterRandom()
+    : BatchConverter<PwmConverterRandom<Format_>>(Format_),
+      expand_(SelectKernel())
+    { }
     
     virtual void Convert(std::string& id, std::string& pwm_sequence) override
     {
-        bool should_output_dna = (output_format_ == Format::DNA);
-        for (char& c: pwm_sequence) {
-            switch (c) {
-                case 'R': // A or G
-                    c = PickUniformlyRandomFromSet<2>("AG");
-                    break;
-                case 'Y': // C or T
-                    c = PickUniformlyRandomFromSet<2>(should_output_dna ? "CT" : "CU");
-                    break;
-                case 'S': // G or C
-                    c = PickUniformlyRandomFromSet<2>("GC");
-                    break;
-                case 'W': // A or T
-                    c = PickUniformlyRandomFromSet<2>(should_output_dna ? "AT" : "AU");
-                    break;
-                case 'K': // G or T
-                    c = PickUniformlyRandomFromSet<2>(should_output_dna ? "GT" : "GU");
-                    break;
-                case 'M': // A or C
-                    c = PickUniformlyRandomFromSet<2>("AC");
-                    break;
-                case 'B': // C or G or T
-                    c = PickUniformlyRandomFromSet<3>(should_output_dna ? "CGT" : "CGU");
-                    break;
-                case 'D': // A or G or T
-                    c = PickUniformlyRandomFromSet<3>(should_output_dna ? "AGT" : "AGU");
-                    break;
-                case 'H': // A or C or T
-                    c = PickUniformlyRandomFromSet<3>(should_output_dna ? "ACT" : "ACU");
-                    break;
-                case 'V': // A or C or G
-                    c = PickUniformlyRandomFromSet<3>("ACG");
-                    break;
-                case 'N': // any base
-                    c = PickUniformlyRandomFromSet<4>(should_output_dna ? "ATGC" : "AUGC");
-                    break;
-                case 'T': // fallthrough
-                case 'U':
-                    c = (should_output_dna ? 'T' : 'U');
-                    break;
-                default:
-                    // In this case the base should stay the same
-                    // Those are omitted:
-                    //
-                    //    case 'A': // A (Adenine)  (doesn't change)
-                    //    case 'C': // C (Cytosine) (doesn't change)
-                    //    case 'G': // G (Guanine)  (doesn't change)
-                    //    case '.': // gap
-                    //    case '-': // gap
-                    break;
+        expand_(kTable, &pwm_sequence[0], pwm_sequence.size());
+    }
+
+    virtual void ConvertInto(std::string_view pwm_sequence, std::string& out) override
+    {
+        out.clear();
+        AppendWithoutLineBreaks(pwm_sequence, out);
+        expand_(kTable, &out[0], out.size());
+    }
+
+ private:
+    using Kernel = void (*)(const IupacTable&, char *, size_t);
+
+    static constexpr const IupacTable& kTable = IupacTableFor(Format_);
+    Kernel expand_;
+
+    static void ExpandScalar(const IupacTable& table, char *sequence, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            const IupacEntry& entry = table[static_cast<uint8_t>(sequence[i])];
+            sequence[i] = (entry.size == 1) ? entry.bases[0] : PickUniformlyRandomFromEntry(entry);
+        }
+    }
+
+#if PWM2BASE_X86
+    //
+    // The vector kernels rewrite 'T'/'U' (every base for packed output) in place
+    // and skip over the plain bases (A, C, G, T, U, '-', '.'). Only the remaining
+    // bytes of a block are looked up in the table, in order, so the random draws
+    // happen in the same sequence as in the scalar kernel.
+    //
+    __attribute__((target("avx2")))
+    static void ExpandAvx2(const IupacTable& table, char *sequence, size_t size)
+    {
+        const __m256i a = _mm256_set1_epi8('A');
+        const __m256i c = _mm256_set1_epi8('C');
+        const __m256i g = _mm256_set1_epi8('G');
+        const __m256i t = _mm256_set1_epi8('T');
+        const __m256i u = _mm256_set1_epi8('U');
+        const __m256i dash = _mm256_set1_epi8('-');
+        const __m256i dot = _mm256_set1_epi8('.');
+        const __m256i out_t = _mm256_set1_epi8(table['T'].bases[0]);
+
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sequence + i));
+            __m256i is_t = _mm256_or_si256(_mm256_cmpeq_epi8(block, t), _mm256_cmpeq_epi8(block, u));
+            __m256i base = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, a),
+                                                           _mm256_cmpeq_epi8(block, c)),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(block, g),
+                                                           is_t));
+            __m256i plain = _mm256_or_si256(base, _mm256_or_si256(_mm256_cmpeq_epi8(block, dash),
+                                                                  _mm256_cmpeq_epi8(block, dot)));
+            if constexpr (Format_ == Format::Packed) {
+                // ((c >> 1) ^ (c >> 2)) & 3 is the code of A, C, G, T and U
+                __m256i codes = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi16(block, 1),
+                                                                  _mm256_srli_epi16(block, 2)),
+                                                 _mm256_set1_epi8(3));
+                block = _mm256_blendv_epi8(block, codes, base);
+            } else {
+                block = _mm256_blendv_epi8(block, out_t, is_t);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(sequence + i), block);
+
+            uint32_t rest = ~static_cast<uint32_t>(_mm256_movemask_epi8(plain));
+            while (rest != 0) {
+                ExpandScalar(table, sequence + i + __builtin_ctz(rest), 1);
+                rest &= rest - 1;
             }
         }
+        ExpandScalar(table, sequence + i, size - i);
+    }
+
+    __attribute__((target("sse4.1")))
+    static void ExpandSse41(const IupacTable& table, char *sequence, size_t size)
+    {
+        const __m128i a = _mm_set1_epi8('A');
+        const __m128i c = _mm_set1_epi8('C');
+        const __m128i g = _mm_set1_epi8('G');
+        const __m128i t = _mm_set1_epi8('T');
+        const __m128i u = _mm_set1_epi8('U');
+        const __m128i dash = _mm_set1_epi8('-');
+        const __m128i dot = _mm_set1_epi8('.');
+        const __m128i out_t = _mm_set1_epi8(table['T'].bases[0]);
+
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sequence + i));
+            __m128i is_t = _mm_or_si128(_mm_cmpeq_epi8(block, t), _mm_cmpeq_epi8(block, u));
+            __m128i base = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, a),
+                                                     _mm_cmpeq_epi8(block, c)),
+                                        _mm_or_si128(_mm_cmpeq_epi8(block, g),
+                                                     is_t));
+            __m128i plain = _mm_or_si128(base, _mm_or_si128(_mm_cmpeq_epi8(block, dash),
+                                                            _mm_cmpeq_epi8(block, dot)));
+            if constexpr (Format_ == Format::Packed) {
+                __m128i codes = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(block, 1), _mm_srli_epi16(block, 2)),
+                                              _mm_set1_epi8(3));
+                block = _mm_blendv_epi8(block, codes, base);
+            } else {
+                block = _mm_blendv_epi8(block, out_t, is_t);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(sequence + i), block);
+
+            uint32_t rest = ~static_cast<uint32_t>(_mm_movemask_epi8(plain)) & 0xFFFF;
+            while (rest != 0) {
+                ExpandScalar(table, sequence + i + __builtin_ctz(rest), 1);
+                rest &= rest - 1;
+            }
+        }
+        ExpandScalar(table, sequence + i, size - i);
+    }
+#endif
+
+    static Kernel SelectKernel()
+    {
+#if PWM2BASE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return ExpandAvx2;
+        if (__builtin_cpu_supports("sse4.1"))
+            return ExpandSse41;
+#endif
+        return ExpandScalar;
     }
 };
 
@@ -19,15 +19,102 @@
 
 #include "Common.h"
 
+#include <array>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+//
+// Append 'text' to 'out' without line breaks (a multi-line FASTA record read
+// straight from a file mapping still contains them).
+//
+inline void AppendWithoutLineBreaks(std::string_view text, std::string& out)
+{
+    while (!text.empty()) {
+        const char *line_break = static_cast<const char *>(memchr(text.data(), '\n', text.size()));
+        size_t line_size = line_break ? line_break - text.data() : text.size();
+        std::string_view line = text.substr(0, line_size);
+
+        if (memchr(line.data(), '\r', line.size())) {
+            for (char c : line) {
+                if (c != '\r')
+                    out += c;
+            }
+        } else {
+            out.append(line.data(), line.size());
+        }
+        text.remove_prefix(line_break ? line_size + 1 : line_size);
+    }
+}
+
+class ConsensusMemo;
 
 class PwmConverter {
  public:
     PwmConverter(Format output_format) : output_format_(output_format) {}
+    virtual ~PwmConverter() = default;
+
     virtual void Convert(std::string& id, std::string& pwm_sequence) = 0;
 
+    Format output_format() const
+    {
+        return output_format_;
+    }
+
+    //
+    // Share the consensus of converted matrices through 'memo' (nullptr: no
+    // memo). Only the matrix converters use it.
+    //
+    void set_memo(ConsensusMemo *memo)
+    {
+        memo_ = memo;
+    }
+
+    //
+    // Convert 'pwm_sequence' into 'out', reusing the capacity 'out' already has.
+    //
+    // The matrix converters override this: line breaks separate matrix values,
+    // so a matrix is parsed as it is rather than joined into one line first.
+    // It's parsed into a buffer that keeps its capacity from record to record
+    // and its consensus (see Consensus.h) is written straight into 'out'; with
+    // a memo, a matrix seen before isn't parsed again.
+    //
+    virtual void ConvertInto(std::string_view pwm_sequence, std::string& out)
+    {
+        out.clear();
+        AppendWithoutLineBreaks(pwm_sequence, out);
+        Convert(id_, out);
+    }
+
+    //
+    // Convert a span of 'count' records with one virtual call. Record i is
+    // 'sequences[i]', its bases go to 'outputs[i]' and it draws from the random
+    // stream of record 'record_indices[i]' of the file 'file_key' (see
+    // FileStreamKey()) under 'seed'. 'converted' counts the records done, so
+    // after an exception it's the index of the record that failed.
+    //
+    virtual void ConvertBatch(const std::string_view *sequences, size_t count, uint64_t seed, uint64_t file_key,
+                              const uint64_t *record_indices, std::string *outputs, size_t& converted) = 0;
+
+    //
+    // Parse the matrix in 'pwm_sequence' into columns of A, C, G, T weights.
+    // Returns false for converters that don't work on matrices.
+    //
+    virtual bool ParseColumns(std::string_view pwm_sequence, std::vector<std::array<double, 4>>& columns)
+    {
+        (void)pwm_sequence;
+        (void)columns;
+        return false;
+    }
+
  protected:
     Format output_format_{Format::DNA};
+    ConsensusMemo *memo_{nullptr};
+
+ private:
+    std::string id_;
 };
 
 #endif /* PwmConverterBase_h */
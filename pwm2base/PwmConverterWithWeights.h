@@ -25,65 +25,59 @@
 
 #include "../libgene/source/file/sequence/SequenceRecord.hpp"
 #include "../libgene/source/file/sequence/SequenceFile.hpp"
-#include "../libgene/source/utils/Tokenizer.hpp"
-
 #include "PwmConverterBase.h"
+#include "PwmConverter.h"
+#include "Consensus.h"
+#include "ConsensusMemo.h"
+#include "MatrixParser.h"
+#include "Stats.h"
 
-class PwmConverterWithWeights : public PwmConverter {
- private:
-    struct PwmBlock {
-        std::string id;
-        std::vector<std::array<double, 4>> stats;
-    };
-    
+//
+// Consensus of weights matrices (see ParseWeightsMatrix()), written the way
+// ConvertInto() describes for matrix converters
+//
+template<Format Format_>
+class PwmConverterWithWeights final : public BatchConverter<PwmConverterWithWeights<Format_>> {
  public:
-    explicit PwmConverterWithWeights(Format output_format)
-    : PwmConverter(output_format)
+    PwmConverterWithWeights()
+    : BatchConverter<PwmConverterWithWeights<Format_>>(Format_)
     { }
     
-    template<int Size_> constexpr
-    int PickFromSetBasedOnMatrix(const std::array<double, 4>& weights)
-    {
-        double max_weight = 0.0;
-        int arg_max = -1;
-        for (int i = 0; i < 4; ++i) {
-            if (weights[i] > max_weight) {
-                arg_max = i;
-                max_weight = weights[i];
-            }
-        }
-        
-        if (arg_max == -1) {
-            // Coludn't select the base based on the matrix (all weights are zeroes, for example)
-            return BaseToNumber(PickUniformlyRandomFromSet<Size_>(output_format_ == Format::DNA ?
-                                                                  "ACGT" : "ACGU"));
-        }
-        return arg_max;
-    }
-    
     virtual void Convert(std::string& id, std::string& pwm_sequence) override
     {
-        PwmBlock block;
-        block.id = id;
-        std::string result;
-        Tokenizer splitter(pwm_sequence, '\t');
-        
-        int i = 0;
-        std::array<double, 4> statistics;
+        (void)id;
+        columns_.clear();
+        ParseWeightsMatrix(pwm_sequence, columns_);
+        ComputeConsensus(columns_, consensus_);
+        WriteConsensus(consensus_.data(), consensus_.size(), Format_, pwm_sequence);
+    }
 
-        while (splitter.ReadNext()) {
-            statistics[i++] = std::stod(splitter.GetNextToken());
-            if (i == 4) {
-                block.stats.push_back(statistics);
-                i = 0;
-            }
-        }
-        
-        for (const auto& weights : block.stats) {
-            result += NumberToBase(PickFromSetBasedOnMatrix<4>(weights), output_format_);
+    virtual void ConvertInto(std::string_view pwm_sequence, std::string& out) override
+    {
+        ConsensusMemo *memo = this->memo_;
+        if (memo && memo->Find(pwmbin::MotifKind::Weights, pwm_sequence, consensus_)) {
+            WriteConsensus(consensus_.data(), consensus_.size(), Format_, out);
+            return;
         }
-        pwm_sequence = std::move(result);
+
+        columns_.clear();
+        ParseWeightsMatrix(pwm_sequence, columns_);
+        ComputeConsensus(columns_, consensus_);
+        if (memo)
+            memo->Insert(pwmbin::MotifKind::Weights, pwm_sequence, consensus_);
+        WriteConsensus(consensus_.data(), consensus_.size(), Format_, out);
+    }
+
+    virtual bool ParseColumns(std::string_view pwm_sequence, std::vector<std::array<double, 4>>& columns) override
+    {
+        columns.clear();
+        ParseWeightsMatrix(pwm_sequence, columns);
+        return true;
     }
+
+ private:
+    std::vector<std::array<double, 4>> columns_;
+    std::vector<uint8_t> consensus_;
 };
 
 #endif /* PwmConverterWithMeights_h */
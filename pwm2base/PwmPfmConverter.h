@@ -25,98 +25,62 @@
 
 #include "../libgene/source/file/sequence/SequenceRecord.hpp"
 #include "../libgene/source/file/sequence/SequenceFile.hpp"
-#include "../libgene/source/utils/Tokenizer.hpp"
-
 #include "PwmConverterBase.h"
+#include "PwmConverter.h"
+#include "Consensus.h"
+#include "ConsensusMemo.h"
+#include "MatrixParser.h"
+#include "Stats.h"
 
-class PwmPfmConverter : public PwmConverter {
- private:
-    struct PwmPfmBlock {
-        std::string id;
-        
-        std::vector<int> a;
-        std::vector<int> c;
-        std::vector<int> g;
-        std::vector<int> t;
-    };
-    
+//
+// Consensus of .pfm count matrices (see ParsePfmMatrix()), written the way
+// ConvertInto() describes for matrix converters
+//
+template<Format Format_>
+class PwmPfmConverter final : public BatchConverter<PwmPfmConverter<Format_>> {
  public:
-    explicit PwmPfmConverter(Format output_format)
-    : PwmConverter(output_format)
+    PwmPfmConverter()
+    : BatchConverter<PwmPfmConverter<Format_>>(Format_)
     { }
     
-    template<int Size_> constexpr
-    int PickFromSetBasedOnMatrix(const std::array<int, 4>& weights)
+    virtual void Convert(std::string& id, std::string& pfm_sequence) override
     {
-        double max_weight = 0.0;
-        int arg_max = -1;
-        for (int i = 0; i < 4; ++i) {
-            if (weights[i] > max_weight) {
-                arg_max = i;
-                max_weight = weights[i];
-            }
-        }
-        
-        if (arg_max == -1) {
-            // Coludn't select the base based on the matrix (all weights are zeroes, for example)
-            return BaseToNumber(PickUniformlyRandomFromSet<Size_>(output_format_ == Format::DNA ?
-                                                                  "ACGT" : "ACGU"));
-        }
-        return arg_max;
+        (void)id;
+        ParsePfmMatrix(pfm_sequence, counts_);
+        ComputeConsensus(counts_, consensus_);
+        WriteConsensus(consensus_.data(), consensus_.size(), Format_, pfm_sequence);
     }
-    
-    virtual void Convert(std::string& id, std::string& pfm_sequence) override
+
+    virtual void ConvertInto(std::string_view pfm_sequence, std::string& out) override
     {
-        PwmPfmBlock pfm_block;
-        std::string result;
-        Tokenizer splitter(pfm_sequence, ' ');
-        
-        auto FillWithInts = [&splitter](std::vector<int>& v) {
-            while (splitter.ReadNext()) {
-                std::string value = splitter.GetNextToken();
-                if (value.empty())
-                    continue;
-                
-                if (value.size() == 1 && isalpha(value[0]))
-                    continue;
-                
-                if (!value.empty()) {
-                    if (value[0] == '[') {
-                        if (value.size() > 1) {
-                            value.erase(0, 1);
-                        } else {
-                            continue;
-                        }
-                    }
+        ConsensusMemo *memo = this->memo_;
+        if (memo && memo->Find(pwmbin::MotifKind::Pfm, pfm_sequence, consensus_)) {
+            WriteConsensus(consensus_.data(), consensus_.size(), Format_, out);
+            return;
+        }
 
-                    if (value[0] == ']')
-                        break;
-                }
-                v.push_back(std::stoi(value));
-            }
-        };
-        
-        // Read 'A's
-        FillWithInts(pfm_block.a);
-        // Read 'C's
-        FillWithInts(pfm_block.c);
-        // Read 'G's
-        FillWithInts(pfm_block.g);
-        // Read 'T's
-        FillWithInts(pfm_block.t);
+        ParsePfmMatrix(pfm_sequence, counts_);
+        ComputeConsensus(counts_, consensus_);
+        if (memo)
+            memo->Insert(pwmbin::MotifKind::Pfm, pfm_sequence, consensus_);
+        WriteConsensus(consensus_.data(), consensus_.size(), Format_, out);
+    }
 
-        for (int i = 0; i < pfm_block.a.size(); ++i) {
-            std::array<int, 4> weights;
+    virtual bool ParseColumns(std::string_view pfm_sequence, std::vector<std::array<double, 4>>& columns) override
+    {
+        ParsePfmMatrix(pfm_sequence, counts_);
 
-            weights[0] = pfm_block.a[i];
-            weights[1] = pfm_block.c[i];
-            weights[2] = pfm_block.g[i];
-            weights[3] = pfm_block.t[i];
-            result += NumberToBase(PickFromSetBasedOnMatrix<4>(weights),
-                                   output_format_);
+        columns.clear();
+        for (size_t i = 0; i < counts_.columns(); ++i) {
+            columns.push_back({static_cast<double>(counts_.at(0, i)), static_cast<double>(counts_.at(1, i)),
+                               static_cast<double>(counts_.at(2, i)), static_cast<double>(counts_.at(3, i))});
         }
-        pfm_sequence = std::move(result);
+        return true;
     }
+
+ private:
+    PfmCounts counts_;
+    std::vector<uint8_t> consensus_;
 };
 
 #endif /* PwmPfmConverter_h */
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RandomBits_h
+#define RandomBits_h
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+//
+// SplitMix64 finalizer. Used to expand seeds and to derive independent
+// per-record streams from the run seed.
+//
+constexpr
+uint64_t MixSeed(uint64_t value) noexcept
+{
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+//
+// Seed of the random stream used for record number 'record_index' of the input
+// file 'file_key' of a run. Every record gets its own stream, so the output
+// doesn't depend on which thread converts a record or in which order records
+// and files are converted.
+//
+constexpr
+uint64_t RecordStreamSeed(uint64_t run_seed, uint64_t file_key, uint64_t record_index) noexcept
+{
+    return MixSeed(run_seed ^ MixSeed(record_index ^ MixSeed(file_key)));
+}
+
+//
+// Key of the file 'relative_path' (its path within the input directory) for
+// RecordStreamSeed(). It depends on the path alone, so adding or removing
+// other files doesn't change the bases of a file. A single input file has
+// key 0.
+//
+inline
+uint64_t FileStreamKey(std::string_view relative_path) noexcept
+{
+    // FNV-1a
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (char c : relative_path)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+    return MixSeed(hash);
+}
+
+//
+// xoshiro256** generator. Unlike std::mt19937_64 it is seeded with four words,
+// which makes it cheap enough to reseed for every record.
+//
+class Xoshiro256 {
+ public:
+    using result_type = uint64_t;
+
+    explicit Xoshiro256(uint64_t seed = 0)
+    {
+        this->seed(seed);
+    }
+
+    void seed(uint64_t seed) noexcept
+    {
+        for (auto& word : state_) {
+            seed += 0x9E3779B97F4A7C15ULL;
+            word = MixSeed(seed);
+        }
+    }
+
+    uint64_t operator()() noexcept
+    {
+        const uint64_t result = Rotl(state_[1] * 5, 7) * 9;
+        const uint64_t t = state_[1] << 17;
+
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = Rotl(state_[3], 45);
+        return result;
+    }
+
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return UINT64_MAX; }
+
+ private:
+    uint64_t state_[4];
+
+    static constexpr uint64_t Rotl(uint64_t x, int k) noexcept
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+//
+// Hands out random bits from 64-bit generator words, one word at a time.
+// A 2-way choice consumes one bit, a 4-way choice two bits, and a 3-way choice
+// draws two bits and rejects '3', so every choice stays exactly uniform while
+// one generator call serves ~20-60 choices.
+//
+// Streams are reseeded for every record, so Seed() only notes the seed: the
+// generator is seeded on the first draw, and a record that draws nothing
+// costs nothing.
+//
+class RandomBitPool {
+ public:
+    explicit RandomBitPool(uint64_t seed = 0)
+    {
+        Seed(seed);
+    }
+
+    void Seed(uint64_t seed) noexcept
+    {
+        seed_ = seed;
+        seeded_ = false;
+        bits_ = 0;
+        available_ = 0;
+    }
+
+    // Uniformly distributed value in [0, 2^count), count <= 32
+    uint32_t Bits(int count) noexcept
+    {
+        if (available_ < count)
+            NextWord();
+
+        uint32_t value = static_cast<uint32_t>(bits_ & ((uint64_t{1} << count) - 1));
+        bits_ >>= count;
+        available_ -= count;
+        return value;
+    }
+
+    template<int Size_>
+    int Uniform() noexcept
+    {
+        static_assert(Size_ > 1 && Size_ < 5, "RandomBitPool::Uniform supports sets of 2, 3 or 4 elements");
+
+        if constexpr (Size_ == 2) {
+            return static_cast<int>(Bits(1));
+        } else if constexpr (Size_ == 4) {
+            return static_cast<int>(Bits(2));
+        } else {
+            for (;;) {
+                uint32_t value = Bits(2);
+                if (value < 3)
+                    return static_cast<int>(value);
+            }
+        }
+    }
+
+ private:
+    Xoshiro256 generator_;
+    uint64_t seed_{0};
+    bool seeded_{false};
+    uint64_t bits_{0};
+    int available_{0};
+
+    void NextWord() noexcept
+    {
+        if (!seeded_) {
+            generator_.seed(seed_);
+            seeded_ = true;
+        }
+        // Leftover bits (if any) are dropped: they're never split across two draws
+        bits_ = generator_();
+        available_ = 64;
+    }
+};
+
+#endif /* RandomBits_h */
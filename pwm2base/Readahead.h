@@ -0,0 +1,151 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Readahead_h
+#define Readahead_h
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Reads the next few input files of a run into the page cache on a thread
+// of its own, so a lazily opened file (see RecordReader::OpenLazily()) is
+// usually in memory by the time it's converted. Files are expected in
+// directory order unless Follow() gives the order they're scheduled in, and
+// nothing is read before either Follow() or the first Opened(). Opened(i)
+// tells it file i is being read: the window files scheduled after it are
+// then asked for, each only for the time it takes to pass on the hint, and
+// at most kMaxBytes of each.
+//
+class Readahead {
+ public:
+    static constexpr size_t kWindow = 8;
+    static constexpr uint64_t kMaxBytes = uint64_t{64} << 20;
+
+    explicit Readahead(std::vector<std::string> paths, size_t window = kWindow)
+    : paths_(std::move(paths)), order_(paths_.size()), positions_(paths_.size()), window_(window)
+    {
+        std::iota(order_.begin(), order_.end(), 0);
+        std::iota(positions_.begin(), positions_.end(), 0);
+        thread_ = std::thread(&Readahead::Run, this);
+    }
+
+    ~Readahead()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        thread_.join();
+    }
+
+    Readahead(const Readahead&) = delete;
+    Readahead& operator=(const Readahead&) = delete;
+
+    //
+    // The files (indices into the paths) will be opened in the order of
+    // 'order'. Files left out aren't read ahead.
+    //
+    void Follow(const std::vector<size_t>& order)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            order_ = order;
+            positions_.assign(paths_.size(), kNotScheduled);
+            for (size_t position = 0; position < order_.size(); ++position)
+                positions_[order_[position]] = position;
+            next_ = 0;
+            limit_ = std::min(order_.size(), window_);
+        }
+        changed_.notify_all();
+    }
+
+    void Opened(size_t index)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t position = positions_[index];
+            if (position == kNotScheduled)
+                return;
+            // Parallel runs open several files at once; the window follows the one furthest in the order
+            limit_ = std::max(limit_, std::min(order_.size(), position + 1 + window_));
+            next_ = std::max(next_, position + 1);
+        }
+        changed_.notify_all();
+    }
+
+ private:
+    static constexpr size_t kNotScheduled = SIZE_MAX;
+
+    std::vector<std::string> paths_;
+    // The paths in the order they're opened, and the position of every path in it
+    std::vector<size_t> order_;
+    std::vector<size_t> positions_;
+    size_t window_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    // Files at positions [next_, limit_) of the order are yet to be read ahead
+    size_t next_{0};
+    size_t limit_{0};
+    bool stopping_{false};
+
+    void Run()
+    {
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this] { return stopping_ || next_ < limit_; });
+                if (stopping_)
+                    return;
+                index = order_[next_++];
+            }
+            Hint(paths_[index]);
+        }
+    }
+
+    static void Hint(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+            off_t length = static_cast<off_t>(std::min(static_cast<uint64_t>(info.st_size), kMaxBytes));
+#if defined(__APPLE__)
+            radvisory advice{0, static_cast<int>(length)};
+            fcntl(fd, F_RDADVISE, &advice);
+#elif defined(POSIX_FADV_WILLNEED)
+            posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+#endif
+        }
+        close(fd);
+    }
+};
+
+#endif /* Readahead_h */
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Sampler_h
+#define Sampler_h
+
+#include "Common.h"
+#include "PwmConverter.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Walker alias table of one matrix column. A draw takes 32 random bits: the
+// low two pick a slot, the other 30 are compared against the slot's threshold
+// to choose between the slot's own base and its alias.
+//
+struct AliasTable {
+    static constexpr uint32_t kOne = uint32_t{1} << 30;
+
+    std::array<uint32_t, 4> threshold;
+    std::array<uint8_t, 4> alias;
+};
+
+//
+// Build the table of a column of A, C, G, T weights (Vose's method, in integer
+// arithmetic so the probabilities are exact to 2^-32). Negative weights count
+// as zero; a column without positive weights gets a uniform distribution.
+//
+inline AliasTable BuildAliasTable(const std::array<float, 4>& weights)
+{
+    double total = 0.0;
+    for (float weight : weights) {
+        if (weight > 0)
+            total += weight;
+    }
+
+    AliasTable table;
+    std::array<uint64_t, 4> scaled;
+    if (total > 0) {
+        // Probabilities scaled to 4 * kOne = 2^32; the rounding error goes to the heaviest base
+        uint64_t sum = 0;
+        size_t heaviest = 0;
+        for (size_t i = 0; i < 4; ++i) {
+            scaled[i] = (weights[i] > 0) ? static_cast<uint64_t>(weights[i] / total * 4.0 * AliasTable::kOne) : 0;
+            sum += scaled[i];
+            if (scaled[i] > scaled[heaviest])
+                heaviest = i;
+        }
+        scaled[heaviest] = scaled[heaviest] + 4ULL * AliasTable::kOne - sum;
+    } else {
+        scaled.fill(AliasTable::kOne);
+    }
+
+    uint8_t small[4], large[4];
+    int small_count = 0, large_count = 0;
+    for (uint8_t i = 0; i < 4; ++i) {
+        table.alias[i] = i;
+        if (scaled[i] < AliasTable::kOne)
+            small[small_count++] = i;
+        else
+            large[large_count++] = i;
+    }
+    while (small_count > 0 && large_count > 0) {
+        uint8_t less = small[--small_count];
+        uint8_t more = large[large_count - 1];
+
+        table.threshold[less] = static_cast<uint32_t>(scaled[less]);
+        table.alias[less] = more;
+        scaled[more] -= AliasTable::kOne - scaled[less];
+        if (scaled[more] < AliasTable::kOne) {
+            --large_count;
+            small[small_count++] = more;
+        }
+    }
+    while (large_count > 0)
+        table.threshold[large[--large_count]] = AliasTable::kOne;
+    while (small_count > 0)
+        table.threshold[small[--small_count]] = AliasTable::kOne;
+    return table;
+}
+
+//
+// Draws sequences from the per-column base distributions of one matrix. The
+// tables are built once per matrix; every base then costs one 32-bit draw from
+// the thread's random bit pool.
+//
+class MotifSampler {
+ public:
+    //
+    // Weights are rounded to float first, so text matrices and their .pwmbin
+    // caches give the same samples.
+    //
+    void Build(const std::vector<std::array<double, 4>>& columns)
+    {
+        tables_.clear();
+        for (const auto& column : columns) {
+            tables_.push_back(BuildAliasTable({static_cast<float>(column[0]), static_cast<float>(column[1]),
+                                               static_cast<float>(column[2]), static_cast<float>(column[3])}));
+        }
+    }
+
+    // 'matrix' holds 'columns' x 4 values
+    void Build(const float *matrix, size_t columns)
+    {
+        tables_.clear();
+        for (size_t i = 0; i < columns; ++i, matrix += 4)
+            tables_.push_back(BuildAliasTable({matrix[0], matrix[1], matrix[2], matrix[3]}));
+    }
+
+    size_t columns() const
+    {
+        return tables_.size();
+    }
+
+    // Append one sampled sequence to 'out'
+    void AppendSample(Format output_format, std::string& out) const
+    {
+        const char *bases = OutputBasesFor(output_format);
+        size_t start = out.size();
+        out.resize(start + tables_.size());
+        char *p = &out[start];
+
+        for (const auto& table : tables_) {
+            uint32_t bits = random_bits.Bits(32);
+            uint32_t slot = bits & 3;
+            *p++ = bases[(bits >> 2) < table.threshold[slot] ? slot : table.alias[slot]];
+        }
+    }
+
+ private:
+    std::vector<AliasTable> tables_;
+};
+
+#endif /* Sampler_h */
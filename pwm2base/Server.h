@@ -0,0 +1,681 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Server_h
+#define Server_h
+
+#include "../libgene/source/utils/FileUtils.hpp"
+
+#include "Common.h"
+#include "MappedSequenceFile.h"
+#include "MatrixCache.h"
+#include "Pipeline.h"
+#include "ThreadPool.h"
+#include "TsvWriter.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//
+// 'pwm2base serve' -- motif collections kept parsed in memory, answering
+// requests from a thread pool.
+//
+// Requests are single lines, on a Unix domain socket or on stdin. The first
+// word is a tag of the client's choosing that the response repeats: requests
+// are answered concurrently and in any order, so a client may send more of
+// them before the earlier ones are answered (but should wait for a 'load' to
+// be answered before using the collection):
+//
+//    <tag> load <name> <path>         parse a matrix file or directory (as '-m'
+//                                     reads it) into the collection <name>
+//    <tag> unload <name>
+//    <tag> list                       "<name>\t<files>\t<motifs>\t<path>" lines
+//    <tag> convert <name> [options]   the lines 'pwm2base -m <path>' writes
+//    <tag> sample <name> <count> [options]
+//                                     the lines of 'pwm2base -n <count> -m <path>'
+//    <tag> consensus <name> [options] "<id>"\t<argmax bases>, 'N' for columns
+//                                     without a positive value
+//    <tag> stats                      request counts and latencies
+//    <tag> shutdown
+//
+// Options are 'seed=<number>' (a random seed if missing, as without
+// '--seed'), 'rna' and 'motif=<name>' to answer for one motif only. The
+// response is "<tag> OK <size>\n" followed by <size> bytes of payload, or
+// "<tag> ERR <message>\n".
+//
+namespace serve {
+
+// Longest request line accepted
+constexpr size_t kMaxRequestSize = size_t{1} << 20;
+
+//
+// The matrices of a 'load' request, one MatrixSet per file. Records are
+// numbered per file as in a conversion run, so a collection converts to the
+// same bases as its source files.
+//
+struct MotifCollection {
+    std::string path;
+    std::vector<std::string> files;
+    // Random stream keys of the files, as in a conversion run (see FileStreamKey())
+    std::vector<uint64_t> file_keys;
+    std::vector<MatrixSet> matrices;
+    size_t motifs{0};
+};
+
+inline std::shared_ptr<const MotifCollection> LoadCollection(const std::string& path, std::string& error)
+{
+    auto collection = std::make_shared<MotifCollection>();
+    collection->path = path;
+    if (utils::IsDirectory(path)) {
+        std::string directory = path.back() == '/' ? path : path + '/';
+        collection->files = DirectoryInputs(directory, false);
+        for (const auto& file : collection->files)
+            collection->file_keys.push_back(FileStreamKey(std::string_view(file).substr(directory.size())));
+    } else {
+        collection->files.push_back(path);
+        collection->file_keys.push_back(0);
+    }
+    if (collection->files.empty()) {
+        error = "No matrix files in '" + path + "'";
+        return nullptr;
+    }
+
+    collection->matrices.resize(collection->files.size());
+    for (size_t i = 0; i < collection->files.size(); ++i) {
+        auto reader = RecordReader::Open(collection->files[i], true, error);
+        if (!reader)
+            return nullptr;
+        try {
+            ReadMatrices(*reader, collection->matrices[i]);
+        } catch (MatrixParseError& parse_error) {
+            parse_error.SetFile(collection->files[i]);
+            error = parse_error.what();
+            return nullptr;
+        }
+        collection->motifs += collection->matrices[i].size();
+    }
+    return collection;
+}
+
+//
+// Latencies of the last kWindow requests of one kind, for percentiles, and
+// counts of all of them
+//
+class LatencyLog {
+ public:
+    static constexpr size_t kWindow = 4096;
+
+    void Add(double microseconds, bool failed)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        window_[count_ % kWindow] = microseconds;
+        ++count_;
+        if (failed)
+            ++errors_;
+    }
+
+    // Nearest-rank percentiles of the window; 0 if there were no requests
+    void Summary(uint64_t& count, uint64_t& errors, double& p50, double& p99) const
+    {
+        std::vector<double> latencies;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            count = count_;
+            errors = errors_;
+            latencies.assign(window_.begin(), window_.begin() + std::min<uint64_t>(count_, kWindow));
+        }
+        p50 = Percentile(latencies, 0.50);
+        p99 = Percentile(latencies, 0.99);
+    }
+
+ private:
+    mutable std::mutex mutex_;
+    std::array<double, kWindow> window_{};
+    uint64_t count_{0};
+    uint64_t errors_{0};
+
+    static double Percentile(std::vector<double>& values, double fraction)
+    {
+        if (values.empty())
+            return 0.0;
+        size_t rank = static_cast<size_t>(fraction * values.size() + 0.999999);
+        size_t index = std::min(values.size(), std::max<size_t>(rank, 1)) - 1;
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+};
+
+//
+// Buffered reader of request lines from a file descriptor. If 'wake_fd' is
+// given, the reader stops waiting for input once it becomes readable.
+//
+class LineReader {
+ public:
+    explicit LineReader(int fd, int wake_fd = -1) : fd_(fd), wake_fd_(wake_fd) {}
+
+    // false at the end of the input, on a wake-up, or if a line is longer than kMaxRequestSize
+    bool Next(std::string& line)
+    {
+        for (;;) {
+            size_t end = buffer_.find('\n', scanned_);
+            if (end != std::string::npos) {
+                line.assign(buffer_, 0, end);
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                buffer_.erase(0, end + 1);
+                scanned_ = 0;
+                return true;
+            }
+            scanned_ = buffer_.size();
+            if (buffer_.size() > kMaxRequestSize)
+                return false;
+
+            if (wake_fd_ >= 0) {
+                pollfd fds[2] = {{fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+                if (poll(fds, 2, -1) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                if (fds[1].revents != 0)
+                    return false;
+            }
+
+            char chunk[64 << 10];
+            ssize_t size = read(fd_, chunk, sizeof(chunk));
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size <= 0) {
+                // A last line without a line break still counts
+                if (buffer_.empty())
+                    return false;
+                line.swap(buffer_);
+                buffer_.clear();
+                scanned_ = 0;
+                return true;
+            }
+            buffer_.append(chunk, static_cast<size_t>(size));
+        }
+    }
+
+ private:
+    int fd_;
+    int wake_fd_;
+    std::string buffer_;
+    size_t scanned_{0};
+};
+
+//
+// The file descriptor responses of one client go to. Responses are written
+// whole, one at a time; the descriptor is closed (if 'owned') once the
+// client's reader and every response in flight are done with it.
+//
+class Client {
+ public:
+    Client(int fd, bool owned) : fd_(fd), owned_(owned) {}
+
+    ~Client()
+    {
+        if (owned_)
+            close(fd_);
+    }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    int fd() const
+    {
+        return fd_;
+    }
+
+    // Returns false once the client has gone away
+    bool Send(const std::string& response)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const char *data = response.data();
+        size_t size = response.size();
+        while (size > 0 && !broken_) {
+            ssize_t written = write(fd_, data, size);
+            if (written < 0) {
+                if (errno != EINTR)
+                    broken_ = true;
+                continue;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return !broken_;
+    }
+
+ private:
+    int fd_;
+    bool owned_;
+    std::mutex mutex_;
+    bool broken_{false};
+};
+
+} // namespace serve
+
+class MotifServer {
+ public:
+    explicit MotifServer(unsigned threads)
+    : pool_(threads), converters_(pool_.size()), started_(std::chrono::steady_clock::now())
+    {
+        for (const char *command : {"load", "unload", "list", "convert", "sample", "consensus", "stats", "shutdown"})
+            latencies_[command];
+        latencies_["invalid"];
+    }
+
+    ~MotifServer()
+    {
+        pool_.Wait();
+    }
+
+    MotifServer(const MotifServer&) = delete;
+    MotifServer& operator=(const MotifServer&) = delete;
+
+    bool Load(const std::string& name, const std::string& path, std::string& error)
+    {
+        auto collection = serve::LoadCollection(path, error);
+        if (!collection)
+            return false;
+        std::lock_guard<std::mutex> lock(collections_mutex_);
+        collections_[name] = std::move(collection);
+        return true;
+    }
+
+    //
+    // Answer the requests of stdin on stdout until the input ends or a
+    // 'shutdown' request
+    //
+    void ServeStream(int in_fd, int out_fd)
+    {
+        // 'shutdown' wakes the reader through the pipe; without one it ends with the input
+        if (pipe(wake_pipe_) != 0)
+            wake_pipe_[0] = wake_pipe_[1] = -1;
+
+        auto client = std::make_shared<serve::Client>(out_fd, false);
+        serve::LineReader reader(in_fd, wake_pipe_[0]);
+        std::string line;
+        while (!stopping_ && reader.Next(line))
+            Submit(std::move(line), client);
+        pool_.Wait();
+
+        if (wake_pipe_[0] >= 0) {
+            close(wake_pipe_[0]);
+            close(wake_pipe_[1]);
+        }
+    }
+
+    //
+    // Accept clients on the Unix domain socket 'path' until a 'shutdown'
+    // request. Returns false (with 'error' set) if the socket can't be set up.
+    //
+    bool ServeSocket(const std::string& path, std::string& error)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            error = "Socket path '" + path + "' is too long";
+            return false;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            error = "Couldn't create a socket: " + std::string(strerror(errno));
+            return false;
+        }
+        unlink(path.c_str());
+        if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listener, 64) != 0 || pipe(wake_pipe_) != 0) {
+            error = "Couldn't listen on '" + path + "': " + strerror(errno);
+            close(listener);
+            return false;
+        }
+        // A client that disconnects early mustn't take the server down
+        signal(SIGPIPE, SIG_IGN);
+
+        while (!stopping_) {
+            pollfd fds[2] = {{listener, POLLIN, 0}, {wake_pipe_[0], POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            if (fds[1].revents != 0)
+                break;
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+
+            // Every client gets a thread reading its requests
+            auto client = std::make_shared<serve::Client>(fd, true);
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex_);
+                clients_.insert(fd);
+            }
+            std::thread([this, client] {
+                serve::LineReader reader(client->fd());
+                std::string line;
+                while (!stopping_ && reader.Next(line))
+                    Submit(std::move(line), client);
+                // Notified under the lock: once the set is empty the server may be gone
+                std::lock_guard<std::mutex> lock(clients_mutex_);
+                clients_.erase(client->fd());
+                clients_changed_.notify_all();
+            }).detach();
+        }
+
+        {
+            // Wake up the readers still waiting for requests and wait for them to finish
+            std::unique_lock<std::mutex> lock(clients_mutex_);
+            for (int fd : clients_)
+                shutdown(fd, SHUT_RD);
+            clients_changed_.wait(lock, [this] { return clients_.empty(); });
+        }
+        pool_.Wait();
+
+        close(listener);
+        close(wake_pipe_[0]);
+        close(wake_pipe_[1]);
+        unlink(path.c_str());
+        return true;
+    }
+
+    // The response to a request line
+    std::string Answer(const std::string& line)
+    {
+        auto started = std::chrono::steady_clock::now();
+        std::vector<std::string_view> words = Split(line);
+        std::string tag = words.empty() ? std::string("-") : std::string(words[0]);
+        std::string command = (words.size() < 2) ? std::string() : std::string(words[1]);
+        auto log = latencies_.find(command);
+        if (log == latencies_.end())
+            log = latencies_.find("invalid");
+
+        std::string response;
+        bool failed = false;
+        try {
+            std::string payload;
+            if (log->first == "invalid")
+                throw std::invalid_argument("Unknown request '" + command + "'");
+            Run(command, words, line, payload);
+            response = tag + " OK " + std::to_string(payload.size()) + "\n";
+            response += payload;
+        } catch (const std::exception& err) {
+            std::string message = err.what();
+            std::replace(message.begin(), message.end(), '\n', ' ');
+            response = tag + " ERR " + message + "\n";
+            failed = true;
+        }
+
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - started;
+        log->second.Add(elapsed.count(), failed);
+        return response;
+    }
+
+ private:
+    struct RequestOptions {
+        uint64_t seed{0};
+        bool seed_provided{false};
+        Format output_format{Format::DNA};
+        std::string motif;
+    };
+
+    WorkStealingPool pool_;
+    // Converters of every pool worker: DNA, RNA
+    std::vector<std::array<std::unique_ptr<ConverterSet>, 2>> converters_;
+    std::chrono::steady_clock::time_point started_;
+
+    std::mutex collections_mutex_;
+    std::map<std::string, std::shared_ptr<const serve::MotifCollection>> collections_;
+    // Every request kind is in the map from the start, so lookups need no lock
+    std::map<std::string, serve::LatencyLog> latencies_;
+
+    std::atomic<bool> stopping_{false};
+    int wake_pipe_[2]{-1, -1};
+    std::mutex clients_mutex_;
+    std::condition_variable clients_changed_;
+    // Sockets of the clients whose reader threads are running
+    std::set<int> clients_;
+
+    void Submit(std::string line, const std::shared_ptr<serve::Client>& client)
+    {
+        if (line.find_first_not_of(" \t") == std::string::npos)
+            return;
+        pool_.Submit([this, line = std::move(line), client] {
+            client->Send(Answer(line));
+        });
+    }
+
+    static std::vector<std::string_view> Split(std::string_view line)
+    {
+        std::vector<std::string_view> words;
+        size_t position = 0;
+        while ((position = line.find_first_not_of(" \t", position)) != std::string_view::npos) {
+            size_t end = std::min(line.find_first_of(" \t", position), line.size());
+            words.push_back(line.substr(position, end - position));
+            position = end;
+        }
+        return words;
+    }
+
+    static uint64_t ParseCount(std::string_view text, const char *what)
+    {
+        uint64_t value = 0;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size())
+            throw std::invalid_argument("Invalid " + std::string(what) + " '" + std::string(text) + "'");
+        return value;
+    }
+
+    static RequestOptions ParseOptions(const std::vector<std::string_view>& words, size_t first)
+    {
+        RequestOptions options;
+        for (size_t i = first; i < words.size(); ++i) {
+            std::string_view word = words[i];
+            if (word.substr(0, 5) == "seed=") {
+                options.seed = ParseCount(word.substr(5), "seed");
+                options.seed_provided = true;
+            } else if (word == "rna") {
+                options.output_format = Format::RNA;
+            } else if (word == "dna") {
+                options.output_format = Format::DNA;
+            } else if (word.substr(0, 6) == "motif=") {
+                options.motif.assign(word.data() + 6, word.size() - 6);
+            } else {
+                throw std::invalid_argument("Unknown option '" + std::string(word) + "'");
+            }
+        }
+        if (!options.seed_provided)
+            options.seed = PickRandomSeed(false);
+        return options;
+    }
+
+    std::shared_ptr<const serve::MotifCollection> Find(const std::vector<std::string_view>& words)
+    {
+        if (words.size() < 3)
+            throw std::invalid_argument("No collection name given");
+        std::string name(words[2]);
+        std::lock_guard<std::mutex> lock(collections_mutex_);
+        auto collection = collections_.find(name);
+        if (collection == collections_.end())
+            throw std::invalid_argument("No collection named '" + name + "'");
+        return collection->second;
+    }
+
+    // A motif id "<name> <desc>" is selected by its whole id or its name
+    static bool Selected(const RequestOptions& options, std::string_view id)
+    {
+        if (options.motif.empty())
+            return true;
+        return id.substr(0, options.motif.size()) == options.motif &&
+               (id.size() == options.motif.size() || id[options.motif.size()] == ' ');
+    }
+
+    ConverterSet& WorkerConverters(Format output_format)
+    {
+        int worker = WorkStealingPool::CurrentWorker();
+        if (worker < 0)
+            throw std::logic_error("Conversion outside of the server's pool");
+        auto& converters = converters_[static_cast<size_t>(worker)][output_format == Format::RNA ? 1 : 0];
+        if (!converters)
+            converters = std::make_unique<ConverterSet>(MakeConverterSet(output_format, true));
+        return *converters;
+    }
+
+    void Run(const std::string& command, const std::vector<std::string_view>& words, const std::string& line,
+             std::string& payload)
+    {
+        if (command == "load") {
+            if (words.size() < 4)
+                throw std::invalid_argument("Usage: <tag> load <name> <path>");
+            // The path is the rest of the line, so it may contain spaces
+            std::string path(line, static_cast<size_t>(words[3].data() - line.data()));
+            std::string error;
+            if (!Load(std::string(words[2]), path, error))
+                throw std::runtime_error(error);
+        } else if (command == "unload") {
+            Find(words);
+            std::lock_guard<std::mutex> lock(collections_mutex_);
+            collections_.erase(std::string(words[2]));
+        } else if (command == "list") {
+            std::lock_guard<std::mutex> lock(collections_mutex_);
+            for (const auto& entry : collections_) {
+                payload += entry.first + "\t" + std::to_string(entry.second->files.size()) + "\t" +
+                           std::to_string(entry.second->motifs) + "\t" + entry.second->path + "\n";
+            }
+        } else if (command == "convert" || command == "sample") {
+            auto collection = Find(words);
+            bool sampling = (command == "sample");
+            if (sampling && words.size() < 4)
+                throw std::invalid_argument("Usage: <tag> sample <name> <count> [options]");
+            uint64_t samples = sampling ? ParseCount(words[3], "sample count") : 0;
+            if (sampling && samples == 0)
+                throw std::invalid_argument("Invalid sample count '0'");
+            Convert(*collection, ParseOptions(words, sampling ? 4 : 3), samples, payload);
+        } else if (command == "consensus") {
+            auto collection = Find(words);
+            Consensus(*collection, ParseOptions(words, 3), payload);
+        } else if (command == "stats") {
+            Stats(payload);
+        } else if (command == "shutdown") {
+            stopping_ = true;
+            if (wake_pipe_[1] >= 0 && write(wake_pipe_[1], "", 1) < 0)
+                throw std::runtime_error("Couldn't stop the server");
+        }
+    }
+
+    void Convert(const serve::MotifCollection& collection, const RequestOptions& options, uint64_t samples,
+                 std::string& payload)
+    {
+        ConverterSet& converters = WorkerConverters(options.output_format);
+        converters.seed = options.seed;
+        converters.samples = samples;
+
+        TextBuffer output;
+        output.buffer().swap(payload);
+        for (size_t file_index = 0; file_index < collection.matrices.size(); ++file_index) {
+            const MatrixSet& matrices = collection.matrices[file_index];
+            for (size_t motif = 0; motif < matrices.size(); ++motif) {
+                if (!Selected(options, matrices.id(motif)))
+                    continue;
+                RecordView record;
+                record.name = matrices.id(motif);
+                record.matrix = matrices.matrix(motif);
+                record.consensus = matrices.consensus(motif);
+                record.columns = matrices.columns(motif);
+                for (uint64_t chunk = 0; chunk < RecordChunks(samples); ++chunk) {
+                    SetSampleChunk(record, chunk, samples);
+                    ConvertRecord(converters, false, record, collection.file_keys[file_index], motif, output);
+                }
+            }
+        }
+        payload.swap(output.buffer());
+    }
+
+    static void Consensus(const serve::MotifCollection& collection, const RequestOptions& options,
+                          std::string& payload)
+    {
+        const char *bases = OutputBasesFor(options.output_format);
+        std::string sequence;
+        for (const MatrixSet& matrices : collection.matrices) {
+            for (size_t motif = 0; motif < matrices.size(); ++motif) {
+                if (!Selected(options, matrices.id(motif)))
+                    continue;
+                const uint8_t *consensus = matrices.consensus(motif);
+                sequence.resize(matrices.columns(motif));
+                for (size_t i = 0; i < sequence.size(); ++i)
+                    sequence[i] = (consensus[i] == pwmbin::kNoConsensus) ? 'N' : bases[consensus[i]];
+
+                RecordView record;
+                record.name = matrices.id(motif);
+                AppendLine(record, sequence, payload);
+            }
+        }
+    }
+
+    void Stats(std::string& payload)
+    {
+        std::chrono::duration<double> uptime = std::chrono::steady_clock::now() - started_;
+        char line[256];
+        size_t collections = 0;
+        {
+            std::lock_guard<std::mutex> lock(collections_mutex_);
+            collections = collections_.size();
+        }
+        snprintf(line, sizeof(line), "uptime_seconds\t%.1f\ncollections\t%zu\nthreads\t%u\n",
+                 uptime.count(), collections, pool_.size());
+        payload += line;
+
+        payload += "request\tcount\terrors\tp50_us\tp99_us\n";
+        for (const auto& entry : latencies_) {
+            uint64_t count = 0;
+            uint64_t errors = 0;
+            double p50 = 0.0;
+            double p99 = 0.0;
+            entry.second.Summary(count, errors, p50, p99);
+            snprintf(line, sizeof(line), "%s\t%llu\t%llu\t%.1f\t%.1f\n", entry.first.c_str(),
+                     static_cast<unsigned long long>(count), static_cast<unsigned long long>(errors), p50, p99);
+            payload += line;
+        }
+    }
+};
+
+#endif /* Server_h */
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef Stats_h
+#define Stats_h
+
+#include "Common.h"
+#include "Iupac.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// '--stats' instrumentation. Every thread counts into its own StatsCounters,
+// which are only added up for the report, so counting takes no locks. With
+// '--stats' off the hot paths check 'stats_enabled' once per record at most.
+//
+enum class StatsPhase {
+    Open,
+    Read,
+    Convert,
+    Write
+};
+constexpr size_t kStatsPhaseCount = 4;
+
+// Record lengths are counted in power-of-two buckets: [0], [1], [2-3], [4-7] ...
+constexpr size_t kLengthBuckets = 48;
+
+struct StatsCounters {
+    // Thread time spent in every phase
+    std::array<double, kStatsPhaseCount> wall_seconds{};
+    std::array<double, kStatsPhaseCount> cpu_seconds{};
+
+    uint64_t records{0};
+    uint64_t bases{0};
+    std::array<uint64_t, kLengthBuckets> length_histogram{};
+    // Input symbols of IUPAC sequences
+    std::array<uint64_t, 256> symbols{};
+    // Matrix columns without positive weights, converted to a random base
+    uint64_t random_fallbacks{0};
+
+    void AddRecord(uint64_t length)
+    {
+        ++records;
+        bases += length;
+        size_t bucket = 0;
+        while (length != 0 && bucket + 1 < kLengthBuckets) {
+            length >>= 1;
+            ++bucket;
+        }
+        ++length_histogram[bucket];
+    }
+
+    void CountSymbols(std::string_view sequence)
+    {
+        for (unsigned char c : sequence)
+            ++symbols[c];
+        // Line breaks of multi-line records aren't input symbols
+        symbols['\n'] = 0;
+        symbols['\r'] = 0;
+    }
+
+    void Add(const StatsCounters& other)
+    {
+        for (size_t i = 0; i < kStatsPhaseCount; ++i) {
+            wall_seconds[i] += other.wall_seconds[i];
+            cpu_seconds[i] += other.cpu_seconds[i];
+        }
+        records += other.records;
+        bases += other.bases;
+        for (size_t i = 0; i < kLengthBuckets; ++i)
+            length_histogram[i] += other.length_histogram[i];
+        for (size_t i = 0; i < symbols.size(); ++i)
+            symbols[i] += other.symbols[i];
+        random_fallbacks += other.random_fallbacks;
+    }
+};
+
+inline bool stats_enabled = false;
+
+//
+// Owns the counters of every thread that has counted anything, so they
+// outlive pool threads that exit before the report is printed.
+//
+class StatsRegistry {
+ public:
+    static StatsRegistry& Instance()
+    {
+        static StatsRegistry registry;
+        return registry;
+    }
+
+    StatsCounters& Register()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counters_.emplace_back(std::make_unique<StatsCounters>());
+        return *counters_.back();
+    }
+
+    StatsCounters Total()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        StatsCounters total;
+        for (const auto& counters : counters_)
+            total.Add(*counters);
+        return total;
+    }
+
+ private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<StatsCounters>> counters_;
+};
+
+inline StatsCounters& LocalStats()
+{
+    thread_local StatsCounters& counters = StatsRegistry::Instance().Register();
+    return counters;
+}
+
+inline double ThreadCpuSeconds()
+{
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+//
+// Adds the wall and CPU time between Restart() (or construction) and Stop()
+// (or destruction) to a phase of the calling thread. Does nothing unless
+// '--stats' is on.
+//
+class PhaseTimer {
+ public:
+    explicit PhaseTimer(StatsPhase phase) : phase_(static_cast<size_t>(phase)), enabled_(stats_enabled)
+    {
+        Restart();
+    }
+
+    ~PhaseTimer()
+    {
+        Stop();
+    }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    void Restart()
+    {
+        if (enabled_) {
+            wall_start_ = std::chrono::steady_clock::now();
+            cpu_start_ = ThreadCpuSeconds();
+            running_ = true;
+        }
+    }
+
+    void Stop()
+    {
+        if (running_) {
+            StatsCounters& counters = LocalStats();
+            counters.wall_seconds[phase_] +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start_).count();
+            counters.cpu_seconds[phase_] += ThreadCpuSeconds() - cpu_start_;
+            running_ = false;
+        }
+    }
+
+ private:
+    size_t phase_;
+    bool enabled_;
+    bool running_{false};
+    std::chrono::steady_clock::time_point wall_start_;
+    double cpu_start_{0.0};
+};
+
+//
+// The '--stats' report: the counters of all threads plus process-wide
+// elapsed time, CPU time and peak RSS
+//
+class StatsReport {
+ public:
+    StatsReport() : start_(std::chrono::steady_clock::now()) {}
+
+    void Print(FILE *out, bool json, unsigned threads) const
+    {
+        static const char *kPhases[kStatsPhaseCount] = {"open", "read", "convert", "write"};
+
+        StatsCounters total = StatsRegistry::Instance().Total();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+                     usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#ifdef __APPLE__
+        uint64_t peak_rss = static_cast<uint64_t>(usage.ru_maxrss);
+#else
+        uint64_t peak_rss = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+        double records_per_second = elapsed > 0 ? total.records / elapsed : 0.0;
+        double bases_per_second = elapsed > 0 ? total.bases / elapsed : 0.0;
+
+        // Draws by the size of the IUPAC set: 2 (R, Y, ...), 3 (B, D, H, V), 4 (N)
+        std::array<uint64_t, 5> draws{};
+        for (size_t c = 0; c < 256; ++c) {
+            if (total.symbols[c] != 0)
+                draws[kIupacTableDna[c].size] += total.symbols[c];
+        }
+
+        size_t last_bucket = 0;
+        for (size_t i = 0; i < kLengthBuckets; ++i) {
+            if (total.length_histogram[i] != 0)
+                last_bucket = i;
+        }
+
+        if (json) {
+            fprintf(out, "{\n");
+            fprintf(out, "  \"elapsed_s\": %.6f,\n  \"cpu_s\": %.6f,\n  \"peak_rss_bytes\": %llu,\n  \"threads\": %u,\n",
+                    elapsed, cpu, static_cast<unsigned long long>(peak_rss), threads);
+            fprintf(out, "  \"records\": %llu,\n  \"bases\": %llu,\n",
+                    static_cast<unsigned long long>(total.records), static_cast<unsigned long long>(total.bases));
+            fprintf(out, "  \"records_per_s\": %.1f,\n  \"bases_per_s\": %.1f,\n", records_per_second, bases_per_second);
+            fprintf(out, "  \"phases\": {");
+            for (size_t i = 0; i < kStatsPhaseCount; ++i) {
+                fprintf(out, "%s\n    \"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f}", i ? "," : "",
+                        kPhases[i], total.wall_seconds[i], total.cpu_seconds[i]);
+            }
+            fprintf(out, "\n  },\n  \"record_length_histogram\": [");
+            for (size_t i = 0; i <= last_bucket && total.records != 0; ++i) {
+                fprintf(out, "%s\n    {\"min\": %llu, \"max\": %llu, \"count\": %llu}", i ? "," : "",
+                        BucketMin(i), BucketMax(i), static_cast<unsigned long long>(total.length_histogram[i]));
+            }
+            fprintf(out, "\n  ],\n  \"iupac_symbols\": {");
+            bool first = true;
+            for (size_t c = 0; c < 256; ++c) {
+                if (total.symbols[c] == 0)
+                    continue;
+                fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", SymbolName(c).c_str(),
+                        static_cast<unsigned long long>(total.symbols[c]));
+                first = false;
+            }
+            fprintf(out, "},\n  \"iupac_draws\": {\"2\": %llu, \"3\": %llu, \"4\": %llu},\n",
+                    static_cast<unsigned long long>(draws[2]), static_cast<unsigned long long>(draws[3]),
+                    static_cast<unsigned long long>(draws[4]));
+            fprintf(out, "  \"random_fallbacks\": %llu\n}\n", static_cast<unsigned long long>(total.random_fallbacks));
+            return;
+        }
+
+        fprintf(out, "Elapsed %.3f s, CPU %.3f s, peak RSS %.1f MiB, %u thread(s)\n",
+                elapsed, cpu, peak_rss / 1048576.0, threads);
+        fprintf(out, "%llu records (%.0f records/s), %llu bases (%.0f bases/s)\n",
+                static_cast<unsigned long long>(total.records), records_per_second,
+                static_cast<unsigned long long>(total.bases), bases_per_second);
+        fprintf(out, "Phase       wall s      CPU s   (summed over threads)\n");
+        for (size_t i = 0; i < kStatsPhaseCount; ++i)
+            fprintf(out, "%-8s %9.3f  %9.3f\n", kPhases[i], total.wall_seconds[i], total.cpu_seconds[i]);
+        if (total.records != 0) {
+            fprintf(out, "Record lengths:\n");
+            for (size_t i = 0; i <= last_bucket; ++i) {
+                fprintf(out, "  %8llu - %-8llu %llu\n", BucketMin(i), BucketMax(i),
+                        static_cast<unsigned long long>(total.length_histogram[i]));
+            }
+        }
+        if (draws[2] + draws[3] + draws[4] + draws[1] != 0) {
+            fprintf(out, "IUPAC symbols:");
+            for (size_t c = 0; c < 256; ++c) {
+                if (total.symbols[c] != 0)
+                    fprintf(out, " %s=%llu", SymbolName(c).c_str(), static_cast<unsigned long long>(total.symbols[c]));
+            }
+            fprintf(out, "\nRandom draws: %llu from 2 bases, %llu from 3 bases, %llu from 4 bases\n",
+                    static_cast<unsigned long long>(draws[2]), static_cast<unsigned long long>(draws[3]),
+                    static_cast<unsigned long long>(draws[4]));
+        }
+        fprintf(out, "All-zero matrix columns (random base): %llu\n",
+                static_cast<unsigned long long>(total.random_fallbacks));
+    }
+
+ private:
+    std::chrono::steady_clock::time_point start_;
+
+    static unsigned long long BucketMin(size_t bucket)
+    {
+        return (bucket == 0) ? 0 : 1ULL << (bucket - 1);
+    }
+
+    static unsigned long long BucketMax(size_t bucket)
+    {
+        return (bucket == 0) ? 0 : (1ULL << bucket) - 1;
+    }
+
+    static std::string SymbolName(size_t c)
+    {
+        if (c > ' ' && c < 127 && c != '"' && c != '\\')
+            return std::string(1, static_cast<char>(c));
+        char name[8];
+        snprintf(name, sizeof(name), "0x%02zx", c);
+        return name;
+    }
+};
+
+#endif /* Stats_h */
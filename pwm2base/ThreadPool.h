@@ -0,0 +1,173 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Fixed-size pool where every worker owns a task deque. Workers run the tasks
+// of their own deque in submission order and steal the oldest task of another
+// worker when they run dry, so tasks submitted in priority order (e.g. largest
+// file first) are started roughly in that order.
+//
+class WorkStealingPool {
+ public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(unsigned threads)
+    {
+        if (threads == 0)
+            threads = 1;
+
+        for (unsigned i = 0; i < threads; ++i)
+            queues_.emplace_back(std::make_unique<Queue>());
+        for (unsigned i = 0; i < threads; ++i)
+            threads_.emplace_back(&WorkStealingPool::Run, this, i);
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_)
+            thread.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(threads_.size());
+    }
+
+    //
+    // Index of the pool worker running the calling code, or -1 when called
+    // from outside of the pool.
+    //
+    static int CurrentWorker()
+    {
+        return current_worker_;
+    }
+
+    void Submit(Task task)
+    {
+        // Tasks spawned by a worker stay on its own deque, the rest are spread out
+        size_t target = (current_worker_ >= 0 && owner_ == this)
+            ? static_cast<size_t>(current_worker_)
+            : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+            queues_[target]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++queued_;
+            ++unfinished_;
+        }
+        wake_.notify_one();
+    }
+
+    // Block until every submitted task has finished
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return unfinished_ == 0; });
+    }
+
+ private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_queue_{0};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    size_t queued_{0};
+    size_t unfinished_{0};
+    bool stop_{false};
+
+    static inline thread_local int current_worker_ = -1;
+    static inline thread_local const WorkStealingPool *owner_ = nullptr;
+
+    bool TryTake(unsigned self, Task& task)
+    {
+        {
+            Queue& own = *queues_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& victim = *queues_[(self + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run(unsigned self)
+    {
+        current_worker_ = static_cast<int>(self);
+        owner_ = this;
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+                if (queued_ == 0)
+                    return;
+                --queued_;
+            }
+
+            // A queued task is reserved for us, so it must be in one of the deques
+            Task task;
+            while (!TryTake(self, task))
+                std::this_thread::yield();
+            task();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--unfinished_ == 0)
+                idle_.notify_all();
+        }
+    }
+};
+
+#endif /* ThreadPool_h */
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TopSequences_h
+#define TopSequences_h
+
+#include "Common.h"
+#include "MotifScanner.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <vector>
+
+//
+// Enumerates the sequences of a matrix in order of decreasing log-odds score
+// (the scores of 'pwm2base scan'). Columns score independently, so a
+// sequence is the best one with some columns demoted to their 2nd, 3rd or 4th
+// base, and its score is the best score minus the losses of the demotions.
+//
+// The search is best-first over demotions: with the columns ordered by the
+// loss of their first demotion, every demotion set has exactly one parent
+// that loses no more than it does, so each sequence is generated once and a
+// heap pops them in score order. The top k cost O(k log k) time and O(k * L)
+// memory no matter how long the motif is.
+//
+class TopSequences {
+ public:
+    void Build(const std::vector<std::array<double, 4>>& columns)
+    {
+        ScoreMatrix matrix = ScoreMatrix::FromColumns(std::string(), columns);
+        length_ = columns.size();
+        best_score_ = 0.0;
+        bases_.resize(length_);
+        losses_.resize(length_);
+
+        for (size_t j = 0; j < length_; ++j) {
+            const float *row = &matrix.forward[j * scan::kRowSize];
+            std::array<uint8_t, 4>& bases = bases_[j];
+            for (uint8_t base = 0; base < 4; ++base)
+                bases[base] = base;
+            // Ties keep the A, C, G, T order
+            std::stable_sort(bases.begin(), bases.end(), [row](uint8_t a, uint8_t b) { return row[a] > row[b]; });
+            best_score_ += row[bases[0]];
+            for (size_t rank = 0; rank < 4; ++rank)
+                losses_[j][rank] = static_cast<double>(row[bases[0]]) - row[bases[rank]];
+        }
+
+        order_.resize(length_);
+        for (size_t j = 0; j < length_; ++j)
+            order_[j] = j;
+        std::stable_sort(order_.begin(), order_.end(), [this](size_t a, size_t b) {
+            return losses_[a][1] < losses_[b][1];
+        });
+    }
+
+    //
+    // Call visit(sequence, score) for the 'k' best sequences, best first.
+    // 'sequence' holds the output bases of 'Format_'.
+    //
+    template<Format Format_, typename Visit>
+    void Enumerate(uint64_t k, Visit visit)
+    {
+        nodes_.clear();
+        ranks_.clear();
+        while (!queue_.empty())
+            queue_.pop();
+        if (k == 0)
+            return;
+
+        std::string sequence(length_, ' ');
+        // The best sequence: no demotions
+        std::vector<uint8_t> ranks(length_, 0);
+        Emit<Format_>(ranks.data(), 0.0, sequence, visit);
+        if (--k == 0 || length_ == 0)
+            return;
+
+        Push(ranks.data(), 0, 1, losses_[order_[0]][1]);
+        while (k > 0 && !queue_.empty()) {
+            Entry entry = queue_.top();
+            queue_.pop();
+
+            const Node node = nodes_[entry.node];
+            ranks.assign(ranks_.begin() + node.ranks, ranks_.begin() + node.ranks + length_);
+            Emit<Format_>(ranks.data(), entry.loss, sequence, visit);
+            --k;
+
+            size_t position = node.position;
+            size_t column = order_[position];
+            uint8_t rank = ranks[column];
+            // Demote the same column further
+            if (rank < 3)
+                Push(ranks.data(), position, rank + 1, entry.loss - losses_[column][rank] + losses_[column][rank + 1]);
+            if (position + 1 < length_) {
+                size_t next = order_[position + 1];
+                // Also demote the next column
+                Push(ranks.data(), position + 1, 1, entry.loss + losses_[next][1]);
+                // Move a first demotion on to the next column
+                if (rank == 1) {
+                    ranks[column] = 0;
+                    Push(ranks.data(), position + 1, 1, entry.loss - losses_[column][1] + losses_[next][1]);
+                }
+            }
+        }
+    }
+
+ private:
+    struct Node {
+        // Offset of the node's ranks in 'ranks_'
+        size_t ranks;
+        // Index into 'order_' of the last demoted column
+        size_t position;
+    };
+
+    struct Entry {
+        double loss;
+        size_t node;
+
+        // Least loss first; ties in generation order
+        bool operator<(const Entry& other) const
+        {
+            return loss != other.loss ? loss > other.loss : node > other.node;
+        }
+    };
+
+    size_t length_{0};
+    double best_score_{0.0};
+    // Bases of every column from best to worst, and their losses against the best
+    std::vector<std::array<uint8_t, 4>> bases_;
+    std::vector<std::array<double, 4>> losses_;
+    // Columns by the loss of their first demotion
+    std::vector<size_t> order_;
+
+    std::vector<Node> nodes_;
+    std::vector<uint8_t> ranks_;
+    std::priority_queue<Entry> queue_;
+
+    // 'ranks' with the column at 'position' demoted to 'rank'
+    void Push(const uint8_t *ranks, size_t position, uint8_t rank, double loss)
+    {
+        size_t offset = ranks_.size();
+        ranks_.insert(ranks_.end(), ranks, ranks + length_);
+        ranks_[offset + order_[position]] = rank;
+        nodes_.push_back(Node{offset, position});
+        queue_.push(Entry{loss, nodes_.size() - 1});
+    }
+
+    template<Format Format_, typename Visit>
+    void Emit(const uint8_t *ranks, double loss, std::string& sequence, Visit& visit)
+    {
+        for (size_t j = 0; j < length_; ++j)
+            sequence[j] = OutputBases<Format_>::kBases[bases_[j][ranks[j]]];
+        visit(static_cast<const std::string&>(sequence), best_score_ - loss);
+    }
+};
+
+#endif /* TopSequences_h */
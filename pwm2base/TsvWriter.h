@@ -0,0 +1,300 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TsvWriter_h
+#define TsvWriter_h
+
+#include "Compression.h"
+#include "MappedSequenceFile.h"
+
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+//
+// "<name> <desc>" -- the id column of an output line
+//
+inline void AppendQuotedId(const RecordView& record, std::string& out)
+{
+    out += '"';
+    out.append(record.name.data(), record.name.size());
+    if (!record.desc.empty()) {
+        out += ' ';
+        out.append(record.desc.data(), record.desc.size());
+    }
+    out += '"';
+}
+
+// One output line: "<name> <desc>"\t<bases>\n
+inline void AppendLine(const RecordView& record, std::string_view bases, std::string& out)
+{
+    AppendQuotedId(record, out);
+    out += '\t';
+    out.append(bases.data(), bases.size());
+    out += '\n';
+}
+
+//
+// Output lines collected in memory (e.g. a batch converted ahead of writing)
+//
+class TextBuffer {
+ public:
+    using Buffer = TextBuffer;
+
+    void WriteRecord(const RecordView& record, std::string_view bases)
+    {
+        AppendLine(record, bases, text_);
+    }
+
+    void Write(std::string_view lines)
+    {
+        text_.append(lines.data(), lines.size());
+    }
+
+    std::string& buffer() { return text_; }
+    void Commit() {}
+
+ private:
+    std::string text_;
+};
+
+//
+// Writes the output .tsv through one large reusable buffer. Lines are put
+// together in place and reach the file in write(2) calls of ~4 MiB; a long
+// sequence or a block of lines produced elsewhere is written straight from its
+// own buffer with writev(2) rather than copied.
+//
+// With 'compression' the output goes through a BlockCompressor that
+// compresses on 'threads' threads of its own. The path "-" is stdout.
+//
+class TsvWriter {
+ public:
+    // What batches of lines are collected in before they're written
+    using Buffer = TextBuffer;
+
+    static constexpr size_t kBufferSize = size_t{4} << 20;
+    static constexpr size_t kDirectWriteSize = size_t{64} << 10;
+
+    static std::unique_ptr<TsvWriter> Open(const std::string& path, Compression compression = Compression::None,
+                                           unsigned threads = 1)
+    {
+        int fd = (path == "-") ? dup(STDOUT_FILENO) : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return nullptr;
+        std::unique_ptr<TsvWriter> writer(new TsvWriter(fd, path));
+        if (compression != Compression::None) {
+            TsvWriter *raw = writer.get();
+            writer->compressor_ = std::make_unique<BlockCompressor>(compression, threads, [raw](std::string_view block) {
+                raw->WriteFile({block, {}, {}});
+            });
+        }
+        return writer;
+    }
+
+    ~TsvWriter()
+    {
+        if (fd_ >= 0) {
+            try {
+                Flush();
+                if (compressor_)
+                    compressor_->Finish();
+            } catch (...) {
+            }
+            compressor_.reset();
+            close(fd_);
+        }
+    }
+
+    TsvWriter(const TsvWriter&) = delete;
+    TsvWriter& operator=(const TsvWriter&) = delete;
+
+    const std::string& path() const
+    {
+        return path_;
+    }
+
+    // Bytes of output so far (before compression)
+    uint64_t size() const
+    {
+        return written_ + buffer_.size();
+    }
+
+    void WriteRecord(const RecordView& record, std::string_view bases)
+    {
+        AppendQuotedId(record, buffer_);
+        buffer_ += '\t';
+        if (bases.size() >= kDirectWriteSize) {
+            WriteAll({buffer_, bases, "\n"});
+            buffer_.clear();
+            return;
+        }
+        buffer_.append(bases.data(), bases.size());
+        buffer_ += '\n';
+        Commit();
+    }
+
+    // Write output lines (or a long line in parts, see ConvertRecordPieces())
+    void Write(std::string_view lines)
+    {
+        if (lines.size() >= kDirectWriteSize) {
+            WriteAll({buffer_, lines, {}});
+            buffer_.clear();
+            return;
+        }
+        buffer_.append(lines.data(), lines.size());
+        Commit();
+    }
+
+    //
+    // Lines may also be appended to buffer() directly; Commit() then flushes
+    // the buffer once it's full.
+    //
+    std::string& buffer()
+    {
+        return buffer_;
+    }
+
+    void Commit()
+    {
+        if (buffer_.size() >= kBufferSize)
+            Flush();
+    }
+
+    void Flush()
+    {
+        if (!buffer_.empty()) {
+            WriteAll({buffer_, {}, {}});
+            buffer_.clear();
+        }
+    }
+
+    //
+    // Copy 'length' bytes of the file 'fd' from 'offset' on, e.g. output lines
+    // of an earlier run. Uncompressed output is copied by the kernel where it
+    // can be.
+    //
+    void CopyFrom(int fd, uint64_t offset, uint64_t length)
+    {
+        Flush();
+#ifdef __linux__
+        if (!compressor_) {
+            while (length > 0) {
+                loff_t from = static_cast<loff_t>(offset);
+                ssize_t copied = copy_file_range(fd, &from, fd_, nullptr, length, 0);
+                if (copied < 0 && errno == EINTR)
+                    continue;
+                if (copied <= 0)
+                    break;
+                offset += copied;
+                length -= copied;
+                written_ += copied;
+            }
+        }
+#endif
+        std::string chunk;
+        while (length > 0) {
+            chunk.resize(std::min<uint64_t>(length, kBufferSize));
+            ssize_t read_size = pread(fd, &chunk[0], chunk.size(), static_cast<off_t>(offset));
+            if (read_size < 0 && errno == EINTR)
+                continue;
+            if (read_size <= 0)
+                throw std::runtime_error("Couldn't read the lines to copy into '" + path_ + "'");
+            chunk.resize(static_cast<size_t>(read_size));
+            WriteAll({chunk, {}, {}});
+            offset += chunk.size();
+            length -= chunk.size();
+        }
+    }
+
+    // Flush and close the file, throwing if anything couldn't be written
+    void Close()
+    {
+        Flush();
+        if (compressor_) {
+            compressor_->Finish();
+            compressor_.reset();
+        }
+        int fd = fd_;
+        fd_ = -1;
+        if (close(fd) != 0)
+            throw std::runtime_error("Couldn't write the output file '" + path_ + "'");
+    }
+
+ private:
+    int fd_;
+    std::string path_;
+    std::string buffer_;
+    uint64_t written_{0};
+    std::unique_ptr<BlockCompressor> compressor_;
+
+    TsvWriter(int fd, const std::string& path) : fd_(fd), path_(path)
+    {
+        buffer_.reserve(kBufferSize + kDirectWriteSize);
+    }
+
+    void WriteAll(std::initializer_list<std::string_view> parts)
+    {
+        for (std::string_view part : parts)
+            written_ += part.size();
+        if (compressor_) {
+            for (std::string_view part : parts)
+                compressor_->Write(part);
+            return;
+        }
+        WriteFile(parts);
+    }
+
+    void WriteFile(std::initializer_list<std::string_view> parts)
+    {
+        iovec vectors[3];
+        int count = 0;
+        for (std::string_view part : parts) {
+            if (!part.empty())
+                vectors[count++] = iovec{const_cast<char *>(part.data()), part.size()};
+        }
+
+        iovec *next = vectors;
+        while (count > 0) {
+            ssize_t written = writev(fd_, next, count);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("Couldn't write the output file '" + path_ + "'");
+            }
+            // Skip what has been written, the rest goes in the next call
+            size_t remaining = static_cast<size_t>(written);
+            while (count > 0 && remaining >= next->iov_len) {
+                remaining -= next->iov_len;
+                ++next;
+                --count;
+            }
+            if (count > 0) {
+                next->iov_base = static_cast<char *>(next->iov_base) + remaining;
+                next->iov_len -= remaining;
+            }
+        }
+    }
+};
+
+#endif /* TsvWriter_h */
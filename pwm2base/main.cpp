@@ -24,132 +24,735 @@
 #include "PwmConverter.h"
 #include "PwmConverterWithWeights.h"
 #include "PwmPfmConverter.h"
+#include "Pipeline.h"
+#include "ParallelFiles.h"
+#include "MappedSequenceFile.h"
+#include "MatrixCache.h"
+#include "Manifest.h"
+#include "Readahead.h"
+#include "PackedWriter.h"
+#include "TsvWriter.h"
+#include "Benchmark.h"
+#include "MotifScanner.h"
+#include "Server.h"
+#include "Stats.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <string>
 #include <random>
 #include <cstdio>
+#include <map>
 
-int main(int argc, const char *argv[])
+//
+// Ask the user before overwriting an existing output file. Returns false if
+// the file exists and the user declined. Stdout is never asked about, and
+// there's no asking when stdin carries the input: the file is then only
+// overwritten with '-f'.
+//
+static bool ConfirmOutputPath(const std::string& output_path, const std::string& input_path)
 {
-    ArgumentsParser arguments(argc, argv);
-    
-    if (arguments.input_path.empty()) {
-        std::cerr << "No input files provided. Terminating\n";
+    if (output_path == "-")
+        return true;
+    FILE *test_out_file = fopen(output_path.c_str(), "wx");
+
+    if (test_out_file == nullptr && input_path == "-") {
+        std::cerr << "File '" << output_path << "' already exists. Use '-f' to override it\n";
+        return false;
+    }
+    if (test_out_file == nullptr) {
+        std::cout << "File '" << output_path << "' already exists. Do you wish to override it? [Y/n] ";
+        char response;
+        std::cin >> response;
+        if (std::tolower(response) != 'y') {
+            std::cerr << "Skipping file '" << input_path << "'\n";
+            return false;
+        }
+    } else {
+        fclose(test_out_file);
+    }
+    return true;
+}
+
+//
+// 'motifs.fasta.pwmbin' -> 'motifs.fasta', so a cache produces the same output
+// name as its source. Compressed inputs lose their '.gz' / '.zst' as well.
+//
+static std::string WithoutCacheExtension(const std::string& path)
+{
+    std::string suffix = std::string(".") + pwmbin::kExtension;
+    if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0)
+        return WithoutCompressionExtension(path.substr(0, path.size() - suffix.size()));
+    return WithoutCompressionExtension(path);
+}
+
+// 'out-bases.tsv' -> 'out-bases.tsv.gz' for a gzip-compressed output
+static std::string WithCompressionExtension(const std::string& path, Compression compression)
+{
+    if (compression == Compression::None)
+        return path;
+    return path + "." + CompressionExtension(compression);
+}
+
+//
+// Output path for one input file in '--split-output' mode: next to the input
+// file, or inside 'output_directory' if one was given. 'keep_extension' keeps
+// inputs like 'a.txt' and 'a.fasta' from sharing an output file.
+//
+static std::string SplitOutputPath(const std::string& input_file_path,
+                                   const std::string& output_directory,
+                                   const std::string& output_extension,
+                                   bool keep_extension = false)
+{
+    std::string input_path = WithoutCacheExtension(input_file_path);
+    size_t slash_position = input_path.rfind('/');
+    size_t name_start = (slash_position == std::string::npos) ? 0 : slash_position + 1;
+    size_t dot_position = input_path.rfind('.');
+    if (keep_extension || dot_position == std::string::npos || dot_position < name_start)
+        dot_position = input_path.size();
+
+    std::string output_path = output_directory.empty() ? input_path.substr(0, name_start) : output_directory;
+    if (!output_path.empty() && output_path.back() != '/')
+        output_path += '/';
+    return output_path + input_path.substr(name_start, dot_position - name_start) + "-bases." + output_extension;
+}
+
+static bool IsMatrixExtension(const std::string& extension)
+{
+    return extension == "txt" || extension == "pfm" || extension == "fasta" || extension == "fa";
+}
+
+// Extension of the file inside a '.gz' / '.zst' file
+static std::string InnerExtension(const std::string& path)
+{
+    return utils::GetExtension(WithoutCompressionExtension(path));
+}
+
+//
+// 'pwm2base compile': a matrix file goes into '<file>.pwmbin' (or the '-o'
+// path), every matrix file of a directory into a '.pwmbin' next to it (or
+// into the '-o' directory).
+//
+static int CompileMatrices(const ArgumentsParser& arguments)
+{
+    std::vector<std::pair<std::string, std::string>> jobs;
+    if (utils::IsDirectory(arguments.input_path)) {
+        std::string output_directory = arguments.output_path;
+        if (!output_directory.empty() && output_directory.back() != '/')
+            output_directory += '/';
+
+        for (const auto& path : utils::GetDirectoryContents(arguments.input_path)) {
+            if (!IsMatrixExtension(InnerExtension(path)))
+                continue;
+            std::string cache_path = path + "." + pwmbin::kExtension;
+            if (!output_directory.empty())
+                cache_path = output_directory + cache_path.substr(cache_path.rfind('/') + 1);
+            jobs.emplace_back(path, cache_path);
+        }
+    } else {
+        jobs.emplace_back(arguments.input_path, arguments.output_path.empty()
+                          ? arguments.input_path + "." + pwmbin::kExtension
+                          : arguments.output_path);
+    }
+
+    if (jobs.empty()) {
+        std::cerr << "No matrix files found in '" << arguments.input_path << "'\n";
         return 1;
     }
-    
-    InitRandom(arguments.verbose);
-    std::unique_ptr<PwmConverter> converter;
-    std::unique_ptr<PwmConverter> converter_pfm;
+    for (const auto& job : jobs) {
+        std::string error;
+        if (!CompileMatrixCache(job.first, job.second, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+        std::cout << "The cache file is located at '" << job.second << "'\n";
+    }
+    return 0;
+}
+
+//
+// 'pwm2base bench': corpora go into '--corpus-dir' (kept) or a temporary
+// directory (removed afterwards)
+//
+static int RunBenchmark(const ArgumentsParser& arguments)
+{
+    BenchmarkOptions options;
+    options.corpus.records = arguments.bench_records;
+    options.corpus.length = arguments.bench_length;
+    options.corpus.degeneracy = arguments.bench_degeneracy;
+    options.corpus.seed = arguments.seed_provided ? arguments.seed : 1;
+    options.iterations = static_cast<unsigned>(std::min<uint64_t>(arguments.bench_iterations, 1000));
+    options.threads = arguments.threads;
+    options.output_format = arguments.output_format;
+
+    bool temporary = arguments.corpus_directory.empty();
+    if (temporary) {
+        const char *tmpdir = getenv("TMPDIR");
+        std::string pattern = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/pwm2base-bench-XXXXXX";
+        if (!mkdtemp(&pattern[0])) {
+            std::cerr << "Couldn't create a temporary directory for the benchmark corpora\n";
+            return 1;
+        }
+        options.directory = pattern;
+    } else {
+        options.directory = arguments.corpus_directory;
+        mkdir(options.directory.c_str(), 0755);
+    }
+
+    Benchmark benchmark(options);
+    int status = 0;
     try {
-        if (arguments.matrix_file_provided) {
-            converter = std::make_unique<PwmConverterWithWeights>(arguments.output_format);
-            converter_pfm = std::make_unique<PwmPfmConverter>(arguments.output_format);
+        auto results = benchmark.Run();
+        Benchmark::PrintSummary(results, stderr);
+
+        FILE *out = arguments.output_path.empty() ? stdout : fopen(arguments.output_path.c_str(), "w");
+        if (out == nullptr) {
+            std::cerr << "Couldn't open the output file '" << arguments.output_path << "'\n";
+            status = 1;
         } else {
-            converter = std::make_unique<PwmConverterRandom>(arguments.output_format);
+            benchmark.WriteJson(results, out);
+            if (out != stdout && fclose(out) == 0)
+                std::cerr << "The results are located at '" << arguments.output_path << "'\n";
+        }
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << '\n';
+        status = 1;
+    }
+
+    if (temporary) {
+        for (const char *name : {"iupac.fasta", "weights.fasta", "jaspar.pfm",
+                                 "iupac-bases.tsv", "weights-bases.tsv", "jaspar_pfm-bases.tsv"}) {
+            remove((options.directory + "/corpus-" + name).c_str());
+        }
+        rmdir(options.directory.c_str());
+    }
+    return status;
+}
+
+//
+// Matrices of 'path' (a file or the matrix files of a directory) as log-odds
+// score tables
+//
+static bool LoadScoreMatrices(const std::string& path, std::vector<ScoreMatrix>& motifs)
+{
+    std::vector<std::string> files;
+    if (utils::IsDirectory(path)) {
+        for (const auto& file : utils::GetDirectoryContents(path)) {
+            std::string extension = InnerExtension(file);
+            if (IsMatrixExtension(extension) || extension == pwmbin::kExtension)
+                files.push_back(file);
+        }
+    } else {
+        files.push_back(path);
+    }
+
+    ConverterSet converters = MakeConverterSet(Format::DNA, true);
+    for (const auto& file : files) {
+        std::string error;
+        auto reader = RecordReader::Open(file, true, error);
+        if (!reader) {
+            std::cerr << error << '\n';
+            return false;
+        }
+
+        RecordView record;
+        try {
+            while (reader->Next(record)) {
+                if (record.matrix) {
+                    converters.columns.clear();
+                    for (size_t i = 0; i < record.columns; ++i) {
+                        const float *column = record.matrix + 4 * i;
+                        converters.columns.push_back({column[0], column[1], column[2], column[3]});
+                    }
+                } else {
+                    converters.For(reader->pfm()).ParseColumns(record.seq, converters.columns);
+                }
+                motifs.push_back(ScoreMatrix::FromColumns(std::string(record.name), converters.columns));
+            }
+        } catch (MatrixParseError& parse_error) {
+            parse_error.SetRecord(record.name);
+            parse_error.SetFile(file);
+            std::cerr << parse_error.what() << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// 'pwm2base scan': motif hits of the '-m' matrices on the '-g' genome
+//
+static int ScanGenome(ArgumentsParser& arguments)
+{
+    if (arguments.genome_path.empty()) {
+        std::cerr << "No genome file provided ('-g'). Terminating\n";
+        return 1;
+    }
+    std::vector<ScoreMatrix> motifs;
+    if (!LoadScoreMatrices(arguments.input_path, motifs))
+        return 1;
+    if (motifs.empty()) {
+        std::cerr << "No matrices found in '" << arguments.input_path << "'\n";
+        return 1;
+    }
+
+    auto genome = MappedFile::Open(arguments.genome_path);
+    if (!genome) {
+        std::cerr << "Couldn't open the genome file '" << arguments.genome_path << "'\n";
+        return 1;
+    }
+
+    {
+        // Score distributions (for the p-values) are computed in parallel, one motif per task
+        WorkStealingPool pool(arguments.threads);
+        for (auto& motif : motifs) {
+            pool.Submit([&motif, &arguments] {
+                motif.ComputeDistribution();
+                if (arguments.scan_threshold_provided)
+                    motif.threshold = static_cast<float>(arguments.scan_threshold);
+                else
+                    motif.SetPValue(arguments.scan_pvalue);
+            });
         }
-    } catch (std::runtime_error err) {
+        pool.Wait();
+    }
+
+    if (arguments.output_path.empty()) {
+        size_t dot_position = arguments.genome_path.rfind('.');
+        size_t slash_position = arguments.genome_path.rfind('/');
+        if (dot_position != std::string::npos && (slash_position == std::string::npos || dot_position > slash_position))
+            arguments.output_path = arguments.genome_path.substr(0, dot_position);
+        else
+            arguments.output_path = arguments.genome_path;
+        arguments.output_path = WithCompressionExtension(arguments.output_path + "-hits.bed", arguments.compression);
+    }
+    if (!arguments.override_output && !ConfirmOutputPath(arguments.output_path, arguments.genome_path))
+        return 1;
+
+    auto out_file = TsvWriter::Open(arguments.output_path, arguments.compression, arguments.threads);
+    if (!out_file) {
+        std::cerr << "Couldn't open the output file '" << arguments.output_path << "'\n";
+        return 1;
+    }
+
+    try {
+        bool tsv = InnerExtension(arguments.output_path) == "tsv";
+        GenomeScanner scanner(std::move(motifs), arguments.threads, tsv);
+        uint64_t hits = scanner.Run(*genome, *out_file);
+        out_file->Close();
+        std::cout << hits << " hits. The output file is located at '" << arguments.output_path << "'\n";
+    } catch (const std::exception& err) {
         std::cerr << err.what() << '\n';
         return 1;
     }
+    return 0;
+}
+
+//
+// 'pwm2base serve': requests on '--socket' or on stdin, answered on '-t' threads
+//
+static int RunServer(const ArgumentsParser& arguments)
+{
+    MotifServer server(arguments.threads);
+    for (const auto& collection : arguments.preload) {
+        std::string error;
+        if (!server.Load(collection.first, collection.second, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+    }
+
+    if (arguments.socket_path.empty()) {
+        server.ServeStream(STDIN_FILENO, STDOUT_FILENO);
+        return 0;
+    }
+    std::string error;
+    if (!server.ServeSocket(arguments.socket_path, error)) {
+        std::cerr << error << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Report the matrices the memo spared parsing ('-v') and save it to
+// '--memo-file'. Returns false if it couldn't be saved.
+//
+static bool FinishMemo(const ArgumentsParser& arguments, const ConsensusMemo *memo)
+{
+    if (memo == nullptr)
+        return true;
+    if (arguments.verbose)
+        std::cerr << "Matrix memo: " << memo->hits() << " hits, " << memo->misses() << " misses\n";
+
+    std::string error;
+    if (!arguments.memo_path.empty() && !memo->Save(arguments.memo_path, error)) {
+        std::cerr << error << '\n';
+        return false;
+    }
+    return true;
+}
 
-    auto flags = std::make_unique<CommandLineFlags>();
-    if (arguments.matrix_file_provided)
-        flags->SetSetting(Flags::kInputFormat, "fasta");
+//
+// What an '--incremental' output depends on besides the input files. A
+// manifest written with other options doesn't describe the output.
+//
+static std::string IncrementalOptions(const ArgumentsParser& arguments)
+{
+    return "seed=" + std::to_string(arguments.seed) +
+           ",format=" + (arguments.output_format == Format::RNA ? "rna" : "dna") +
+           ",matrices=" + std::to_string(arguments.matrix_file_provided) +
+           ",samples=" + std::to_string(arguments.samples) +
+           ",top_k=" + std::to_string(arguments.top_k);
+}
+
+//
+// '--incremental': convert the directory 'inputs' into 'arguments.output_path'
+// as a full run would, but copy the lines of every file that is unchanged
+// since the run that wrote the manifest. A file is unchanged if the manifest
+// has its path (a record's random draws depend on nothing else, see
+// FileStreamKey()) with the same size and either the same mtime or the same
+// content hash, so adding or removing a file only converts that file. The
+// output is rebuilt in a temporary file that then replaces it, so an
+// interrupted run leaves the last one intact.
+//
+static bool ConvertIncrementally(const ArgumentsParser& arguments, std::vector<std::unique_ptr<RecordReader>>& inputs,
+                                 const ConverterFactory& make_converters, Readahead *readahead)
+{
+    std::string manifest_path = arguments.output_path + Manifest::kSuffix;
+    Manifest previous;
+    int64_t output_mtime_ns = 0;
+    uint64_t output_size = 0;
+    bool reusable = previous.Load(manifest_path) && previous.options == IncrementalOptions(arguments) &&
+                    GetFileStamp(arguments.output_path, output_mtime_ns, output_size) &&
+                    output_size == previous.output_size && output_mtime_ns == previous.output_mtime_ns;
+    // The output is only overwritten without asking if it's the one the manifest describes
+    if (!reusable && !arguments.override_output && !ConfirmOutputPath(arguments.output_path, arguments.input_path))
+        return false;
+
+    std::map<std::string, const ManifestEntry *> previous_files;
+    if (reusable) {
+        for (const auto& entry : previous.files)
+            previous_files.emplace(entry.path, &entry);
+    }
+    // The previous lines of every file that is copied rather than converted
+    std::vector<const ManifestEntry *> copied(inputs.size(), nullptr);
+
+    Manifest manifest;
+    manifest.options = IncrementalOptions(arguments);
+    manifest.files.resize(inputs.size());
+    size_t converted = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        ManifestEntry& entry = manifest.files[i];
+        entry.path = inputs[i]->fileName();
+        if (!GetFileStamp(entry.path, entry.mtime_ns, entry.size)) {
+            std::cerr << "Couldn't read '" << entry.path << "'\n";
+            return false;
+        }
+
+        auto found = previous_files.find(entry.path);
+        const ManifestEntry *last = (found != previous_files.end()) ? found->second : nullptr;
+        bool hashed = false;
+        if (last && last->size == entry.size && last->mtime_ns != entry.mtime_ns)
+            hashed = FileContentHash(entry.path, entry.hash);
+        if (last && last->size == entry.size && (last->mtime_ns == entry.mtime_ns || (hashed && entry.hash == last->hash))) {
+            entry.hash = last->hash;
+            copied[i] = last;
+            inputs[i].reset();
+            continue;
+        }
+        if (!hashed && !FileContentHash(entry.path, entry.hash)) {
+            std::cerr << "Couldn't read '" << entry.path << "'\n";
+            return false;
+        }
+        ++converted;
+    }
+    std::cout << "Converting " << converted << " of " << inputs.size() << " files\n";
+    if (converted == 0 && inputs.size() == previous.files.size())
+        return true;
+
+    int previous_fd = reusable ? open(arguments.output_path.c_str(), O_RDONLY) : -1;
+    if (reusable && previous_fd < 0) {
+        std::cerr << "Couldn't read the output file '" << arguments.output_path << "'\n";
+        return false;
+    }
+    // A name of its own, so concurrent runs never write the same temporary file
+    std::string temporary_path;
+    int temporary_fd = CreateTemporaryFile(arguments.output_path, temporary_path);
+    std::unique_ptr<TsvWriter> out_file;
+    if (temporary_fd >= 0) {
+        close(temporary_fd);
+        out_file = TsvWriter::Open(temporary_path);
+    }
+    if (!out_file) {
+        if (previous_fd >= 0)
+            close(previous_fd);
+        if (temporary_fd >= 0)
+            remove(temporary_path.c_str());
+        std::cerr << "Couldn't open the output file '" << temporary_path << "'\n";
+        return false;
+    }
+
+    bool ok = true;
+    try {
+        uint64_t offset = 0;
+        ParallelFileConverter converter(arguments.threads, make_converters, readahead);
+        converter.RunMerged(inputs, *out_file, [&](size_t file_index, TsvWriter& out) {
+            out.CopyFrom(previous_fd, copied[file_index]->offset, copied[file_index]->length);
+        }, [&](size_t file_index) {
+            manifest.files[file_index].offset = offset;
+            manifest.files[file_index].length = out_file->size() - offset;
+            offset = out_file->size();
+        });
+        PhaseTimer write_timer(StatsPhase::Write);
+        out_file->Close();
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << '\n';
+        ok = false;
+    }
+    if (previous_fd >= 0)
+        close(previous_fd);
+    out_file.reset();
+
+    if (ok && rename(temporary_path.c_str(), arguments.output_path.c_str()) != 0) {
+        std::cerr << "Couldn't write the output file '" << arguments.output_path << "'\n";
+        ok = false;
+    }
+    if (!ok) {
+        remove(temporary_path.c_str());
+        return false;
+    }
+
+    std::string error;
+    if (!GetFileStamp(arguments.output_path, manifest.output_mtime_ns, manifest.output_size) ||
+        !manifest.Save(manifest_path, error)) {
+        std::cerr << (error.empty() ? "Couldn't read the output file '" + arguments.output_path + "'" : error) << '\n';
+        return false;
+    }
+    return true;
+}
+
+//
+// Convert every input into 'out_file' (a TsvWriter or a PackedWriter) and close it.
+// 'readahead' (if any) reads ahead the files of a directory.
+//
+template<typename Writer>
+static void ConvertInputs(const ArgumentsParser& arguments, std::vector<std::unique_ptr<RecordReader>>& inputs,
+                          const ConverterFactory& make_converters, Readahead *readahead, Writer& out_file)
+{
+    bool many_lines = arguments.samples != 0 || arguments.top_k != 0;
+    if (arguments.threads > 1 && inputs.size() > 1 && !many_lines) {
+        // Whole files are converted concurrently and merged in directory order
+        ParallelFileConverter converter(arguments.threads, make_converters, readahead);
+        converter.RunMerged(inputs, out_file);
+    } else if (arguments.threads > 1) {
+        // Sampled and top-k records make many lines each, so fewer of them make up a batch
+        ConversionPipeline pipeline(arguments.threads, make_converters, many_lines ? 16 : 256);
+        pipeline.Run(inputs, out_file);
+    } else {
+        auto converters = make_converters();
+        for (auto& input : inputs)
+            ConvertRecords(converters, *input, out_file);
+    }
+    PhaseTimer write_timer(StatsPhase::Write);
+    out_file.Close();
+}
+
+int main(int argc, const char *argv[])
+{
+    ArgumentsParser arguments(argc, argv);
+    if (arguments.command == ArgumentsParser::Command::Bench)
+        return RunBenchmark(arguments);
+    if (arguments.command == ArgumentsParser::Command::Serve)
+        return RunServer(arguments);
     
-    std::vector<std::unique_ptr<SequenceFile>> input_files;
+    if (arguments.input_path.empty()) {
+        std::cerr << "No input files provided. Terminating\n";
+        return 1;
+    }
+    if (arguments.command == ArgumentsParser::Command::Compile)
+        return CompileMatrices(arguments);
+    if (arguments.command == ArgumentsParser::Command::Scan)
+        return ScanGenome(arguments);
+
+    bool stdin_input = arguments.input_path == "-";
+    if (stdin_input && arguments.output_path.empty())
+        arguments.output_path = "-";
+    // Nothing but the output goes to stdout then
+    bool stdout_output = arguments.output_path == "-";
+
+    uint64_t seed = PickRandomSeed(arguments.verbose && !stdout_output, arguments.seed_provided, arguments.seed);
+    if (arguments.verbose && stdout_output)
+        std::cerr << "Random seed: " << seed << '\n';
+    stats_enabled = arguments.stats;
+    StatsReport stats_report;
+    // Packed output takes base codes; its file header records DNA or RNA
+    Format converter_format = arguments.packed_output ? Format::Packed : arguments.output_format;
+    std::string output_extension = arguments.packed_output ? packed::kExtension : "tsv";
+    // Set up once the inputs are open: only matrices are memoized
+    std::unique_ptr<ConsensusMemo> memo;
+    auto make_converters = [&arguments, &memo, converter_format, seed] {
+        ConverterSet converters = MakeConverterSet(converter_format, arguments.matrix_file_provided, seed);
+        converters.samples = arguments.samples;
+        converters.top_k = arguments.top_k;
+        converters.SetMemo(memo.get());
+        return converters;
+    };
+
+    // Outlives the inputs, which report to it as they're opened
+    std::unique_ptr<Readahead> readahead;
+    std::vector<std::unique_ptr<RecordReader>> inputs;
+    std::string error;
     bool input_is_directory = false;
-    if ((input_is_directory = utils::IsDirectory(arguments.input_path))) {
+    PhaseTimer open_timer(StatsPhase::Open);
+    if (stdin_input) {
+        auto input = RecordReader::OpenStream(STDIN_FILENO, "stdin", arguments.matrix_file_provided, error);
+        if (!input) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+        if (!arguments.sequence_file_provided && !arguments.matrix_file_provided)
+            arguments.matrix_file_provided = input->matrices();
+        if ((arguments.samples != 0 || arguments.top_k != 0) && !arguments.matrix_file_provided) {
+            std::cerr << "'-n' and '--top-k' require weight matrices, but stdin holds IUPAC sequences. Aborting\n";
+            return 1;
+        }
+        inputs.emplace_back(std::move(input));
+    } else if ((input_is_directory = utils::IsDirectory(arguments.input_path))) {
         if (arguments.input_path.back() != '/')
             arguments.input_path += '/';
         
-        auto directory_contents = utils::GetDirectoryContents(arguments.input_path);
-        for (const auto& path: directory_contents) {
-            std::string extension = utils::GetExtension(path);
-
-            if (extension != "txt" &&
-                extension != "pfm" &&
-                extension != "fasta" &&
-                extension != "fa" &&
-                extension != "fq") {
-                // If the extension is none of those skip this file
-                std::cerr << "Urecognized file extension '" << extension << "'. Skipping this file\n";
-                continue;
-            }
-
-            auto input_file = SequenceFile::FileWithName(path, flags, OpenMode::Read);
-            if (!input_file) {
-                std::cerr << "File '" << path << "' couldn't be opened. Either it doesn't exist, or you don't have permissions to read it.\n";
-                return 1;
-            }
-            input_files.emplace_back(std::move(input_file));
+        // Files are only opened as they're converted and closed right after
+        std::vector<std::string> paths = DirectoryInputs(arguments.input_path, true);
+        readahead = std::make_unique<Readahead>(paths);
+        for (size_t i = 0; i < paths.size(); ++i) {
+            Readahead *files = readahead.get();
+            inputs.emplace_back(RecordReader::OpenLazily(paths[i], arguments.matrix_file_provided,
+                                                         [files, i] { files->Opened(i); }));
+            inputs.back()->set_file_key(FileStreamKey(std::string_view(paths[i]).substr(arguments.input_path.size())));
         }
     } else {
-        auto input_file = SequenceFile::FileWithName(arguments.input_path,
-                                                     flags,
-                                                     OpenMode::Read);
-        if (!input_file) {
-            std::cerr << "Couldn't open input file '" << arguments.input_path << "'\n";
+        auto input = RecordReader::Open(arguments.input_path, arguments.matrix_file_provided, error);
+        if (!input) {
+            std::cerr << error << '\n';
             return 1;
         }
-        input_files.emplace_back(std::move(input_file));
+        inputs.emplace_back(std::move(input));
     }
+    open_timer.Stop();
     
-    if (input_files.empty()) {
+    if (inputs.empty()) {
         std::cerr << "No input files provided\n";
         return 1;
     }
+
+    // IUPAC records of any length go through a bounded window
+    if (!arguments.matrix_file_provided && !arguments.packed_output) {
+        for (auto& input : inputs)
+            input->SplitRecords(kRecordPieceSize);
+    }
+
+    if (arguments.memo && arguments.matrix_file_provided) {
+        memo = std::make_unique<ConsensusMemo>();
+        if (!arguments.memo_path.empty() && !memo->Load(arguments.memo_path, error)) {
+            std::cerr << error << '\n';
+            return 1;
+        }
+    }
     
-    size_t dot_position = arguments.input_path.rfind('.');
-    if (arguments.output_path.empty())
-        arguments.output_path = arguments.input_path.substr(0, (input_is_directory ? arguments.input_path.size() - 1 : dot_position)) + "-bases" + ".tsv";
-    
-    std::unique_ptr<SequenceFile> out_file;
-    if (!arguments.override_output) {
-        FILE *test_out_file = fopen(arguments.output_path.c_str(), "wx");
-
-        if (test_out_file == nullptr) {
-            std::cout << "File '" << arguments.output_path << "' already exists. Do you wish to override it? [Y/n] ";
-            char response;
-            std::cin >> response;
-            if (std::tolower(response) != 'y') {
-                std::cerr << "Skipping file '" << arguments.input_path << "'\n";
+    if (arguments.split_output) {
+        std::vector<std::string> output_paths;
+        std::map<std::string, int> path_counts;
+        for (const auto& input : inputs)
+            path_counts[SplitOutputPath(input->fileName(), arguments.output_path, output_extension)]++;
+
+        for (const auto& input : inputs) {
+            std::string output_path = SplitOutputPath(input->fileName(), arguments.output_path, output_extension);
+            if (path_counts[output_path] > 1)
+                output_path = SplitOutputPath(input->fileName(), arguments.output_path, output_extension, true);
+            output_path = WithCompressionExtension(output_path, arguments.compression);
+
+            if (!arguments.override_output && !ConfirmOutputPath(output_path, input->fileName()))
                 return 1;
+            output_paths.emplace_back(std::move(output_path));
+        }
+
+        try {
+            ParallelFileConverter converter(arguments.threads, make_converters, readahead.get());
+            if (arguments.packed_output) {
+                converter.RunSplit(inputs, output_paths, [&arguments](const std::string& path) {
+                    return PackedWriter::Open(path, arguments.output_format);
+                });
+            } else {
+                converter.RunSplit(inputs, output_paths, [&arguments](const std::string& path) {
+                    return TsvWriter::Open(path, arguments.compression);
+                });
             }
-        } else {
-            fclose(test_out_file);
+        } catch (const std::exception& err) {
+            std::cerr << err.what() << '\n';
+            return 1;
+        }
+        for (const auto& output_path : output_paths)
+            std::cout << "The output file is located at '" << output_path << "'\n";
+        if (!FinishMemo(arguments, memo.get()))
+            return 1;
+        if (arguments.stats)
+            stats_report.Print(stderr, arguments.stats_json, arguments.threads);
+        return 0;
+    }
+
+    std::string output_base = WithoutCacheExtension(arguments.input_path);
+    size_t dot_position = output_base.rfind('.');
+    if (arguments.output_path.empty())
+        arguments.output_path = WithCompressionExtension(
+            output_base.substr(0, (input_is_directory ? output_base.size() - 1 : dot_position)) + "-bases." + output_extension,
+            arguments.compression);
+    
+    if (arguments.incremental) {
+        if (!input_is_directory) {
+            std::cerr << "'--incremental' converts directories; '" << arguments.input_path << "' is a file\n";
+            return 1;
         }
+        if (!ConvertIncrementally(arguments, inputs, make_converters, readahead.get()))
+            return 1;
+        std::cout << "The output file is located at '" << arguments.output_path << "'\n";
+        if (!FinishMemo(arguments, memo.get()))
+            return 1;
+        if (arguments.stats)
+            stats_report.Print(stderr, arguments.stats_json, arguments.threads);
+        return 0;
     }
 
-    flags = std::make_unique<CommandLineFlags>();
-    flags->SetSetting(Flags::kOutputFormat, "txt");
-    if (!(out_file = SequenceFile::FileWithName(arguments.output_path,
-                                                flags,
-                                                OpenMode::Write))) {
+    if (!arguments.override_output && !ConfirmOutputPath(arguments.output_path, arguments.input_path))
+        return 1;
+
+    std::unique_ptr<TsvWriter> tsv_file;
+    std::unique_ptr<PackedWriter> packed_file;
+    if (arguments.packed_output)
+        packed_file = PackedWriter::Open(arguments.output_path, arguments.output_format);
+    else
+        tsv_file = TsvWriter::Open(arguments.output_path, arguments.compression, arguments.threads);
+    if (!tsv_file && !packed_file) {
         std::cerr << "Couldn't open the output file '" << arguments.output_path << "'\n";
         return 1;
     }
     
-    SequenceRecord record;
-    for (auto& input_file : input_files) {
-        PwmConverter *selected_converter;
-        
-        if (utils::GetExtension(input_file->fileName()) == "pfm")
-            selected_converter = converter_pfm.get();
+    try {
+        if (packed_file)
+            ConvertInputs(arguments, inputs, make_converters, readahead.get(), *packed_file);
         else
-            selected_converter = converter.get();
-        
-        while (!(record = input_file->Read()).Empty()) {
-            selected_converter->Convert(record.name, record.seq);
-            std::string id = record.name;
-            if (!record.desc.empty()) {
-                id += ' ' + record.desc;
-            }
-            record.seq = '"' + id + '"' + '\t' + record.seq;
-            out_file->Write(record);
-        }
+            ConvertInputs(arguments, inputs, make_converters, readahead.get(), *tsv_file);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << '\n';
+        return 1;
     }
-    std::cout << "The output file is located at '" << arguments.output_path << "'\n";
+    if (!stdout_output)
+        std::cout << "The output file is located at '" << arguments.output_path << "'\n";
+    if (!FinishMemo(arguments, memo.get()))
+        return 1;
+    if (arguments.stats)
+        stats_report.Print(stderr, arguments.stats_json, arguments.threads);
     return 0;
 }
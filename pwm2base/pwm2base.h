@@ -0,0 +1,91 @@
+/*
+ * Copyright 2018 Frangou Lab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef pwm2base_h
+#define pwm2base_h
+
+//
+// C interface of libpwm2base, a thin layer over ConversionContext (see
+// ConversionContext.h for the details of a conversion). No function keeps
+// global state; a context may be shared between threads.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pwm2base_context pwm2base_context;
+
+typedef enum {
+    PWM2BASE_OK = 0,
+    // The bases don't fit in the output buffer; the sizes are filled in
+    PWM2BASE_BUFFER_TOO_SMALL,
+    PWM2BASE_INVALID_ARGUMENT,
+    PWM2BASE_PARSE_ERROR,
+    PWM2BASE_OUT_OF_MEMORY,
+    PWM2BASE_INTERNAL_ERROR
+} pwm2base_status;
+
+typedef enum {
+    PWM2BASE_DNA = 0,
+    PWM2BASE_RNA,
+    // Base codes 0-3 (A, C, G, T); gaps are left as they are
+    PWM2BASE_CODES
+} pwm2base_format;
+
+typedef enum {
+    PWM2BASE_IUPAC = 0,
+    PWM2BASE_WEIGHTS,
+    PWM2BASE_PFM
+} pwm2base_input;
+
+// Returns NULL if out of memory or 'format'/'input' are out of range
+pwm2base_context *pwm2base_context_create(pwm2base_format format, pwm2base_input input, uint64_t seed);
+void pwm2base_context_destroy(pwm2base_context *context);
+
+//
+// Key of the input file 'relative_path' (its path within the input directory)
+// for pwm2base_convert_batch(). The file of a single-file run has key 0.
+//
+uint64_t pwm2base_file_key(const char *relative_path);
+
+//
+// Convert records 'first_record' .. 'first_record + count - 1' of the file
+// with key 'file_key'; record i is 'sequences[i]' ('sequence_sizes[i]'
+// bytes). The bases go to 'output' back to back, 'output_sizes[i]' bytes for
+// record i.
+// '*output_total' (if not NULL) is set to the size of all of them, and
+// PWM2BASE_BUFFER_TOO_SMALL returned without writing anything if that's more
+// than 'capacity'. A buffer as large as the input always suffices.
+//
+// On PWM2BASE_PARSE_ERROR and PWM2BASE_INTERNAL_ERROR 'error' (if not NULL)
+// gets the message, truncated to 'error_capacity' bytes including the
+// terminating zero.
+//
+pwm2base_status pwm2base_convert_batch(pwm2base_context *context,
+                                       const char *const *sequences, const size_t *sequence_sizes, size_t count,
+                                       uint64_t file_key, uint64_t first_record,
+                                       char *output, size_t capacity, size_t *output_sizes, size_t *output_total,
+                                       char *error, size_t error_capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* pwm2base_h */